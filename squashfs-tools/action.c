@@ -1741,13 +1741,7 @@ static char *get_comp(char **pathname)
 
 static struct dir_ent *lookup_comp(char *comp, struct dir_info *dest)
 {
-	struct dir_ent *dir_ent;
-
-	for(dir_ent = dest->list; dir_ent; dir_ent = dir_ent->next)
-		if(strcmp(comp, dir_ent->name) == 0)
-			break;
-
-	return dir_ent;
+	return lookup_name(dest, comp);
 }
 
 
@@ -2017,6 +2011,7 @@ static void move_file(struct move_ent *move_ent)
 		}
 
 		/* Remove the file from source directory */
+		free_dir_hash(source);
 		for(comp_ent = source->list; comp_ent != dir_ent;
 				prev = comp_ent, comp_ent = comp_ent->next);
 
@@ -2030,6 +2025,7 @@ static void move_file(struct move_ent *move_ent)
 			source->directory_count --;
 
 		/* Add the file to dest directory */
+		free_dir_hash(dest);
 		comp_ent->next = dest->list;
 		dest->list = comp_ent;
 		comp_ent->our_dir = dest;
@@ -2064,6 +2060,7 @@ static void move_file(struct move_ent *move_ent)
 		else
 			free(dir_ent->name);
 
+		free_dir_hash(dir_ent->our_dir);
 		dir_ent->name = move_ent->name;
 	}
 
@@ -0,0 +1,259 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * block_cache.c
+ *
+ * Duplicate checking reads back blocks already written to the output
+ * filesystem.  The writer thread adds the blocks it writes to this cache,
+ * so they can be read back from memory rather than the output, which may be
+ * a slow block device or network volume.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "block_cache.h"
+#include "mksquashfs_error.h"
+
+#define TRUE 1
+#define FALSE 0
+
+struct block_cache *block_cache_init(long long max_bytes)
+{
+	struct block_cache *cache = malloc(sizeof(struct block_cache));
+
+	if(cache == NULL)
+		MEM_ERROR();
+
+	cache->max_bytes = max_bytes;
+	cache->bytes = 0;
+	cache->lru_head = cache->lru_tail = NULL;
+	cache->hits = cache->misses = cache->evictions = 0;
+	memset(cache->hash_table, 0, sizeof(cache->hash_table));
+	memset(cache->region_table, 0, sizeof(cache->region_table));
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	return cache;
+}
+
+
+/* Called with the cache mutex held */
+static void lru_remove(struct block_cache *cache, struct block_cache_entry *entry)
+{
+	if(entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if(entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+
+/* Called with the cache mutex held */
+static void lru_insert(struct block_cache *cache, struct block_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+
+	if(cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+
+	cache->lru_head = entry;
+}
+
+
+/* Called with the cache mutex held */
+static void remove_entry(struct block_cache *cache,
+	struct block_cache_entry *entry)
+{
+	struct block_cache_entry **p;
+
+	p = &cache->hash_table[BLOCK_CACHE_HASH(entry->start)];
+	for(; *p != entry; p = &(*p)->hash_next);
+	*p = entry->hash_next;
+
+	p = &cache->region_table[BLOCK_CACHE_HASH(BLOCK_CACHE_REGION(
+							entry->start))];
+	for(; *p != entry; p = &(*p)->region_next);
+	*p = entry->region_next;
+
+	lru_remove(cache, entry);
+	cache->bytes -= entry->size;
+	free(entry);
+}
+
+
+/*
+ * Remove every block overlapping the size bytes at start.  Called with the
+ * cache mutex held
+ */
+static void remove_range(struct block_cache *cache, long long start,
+	long long size)
+{
+	long long region = BLOCK_CACHE_REGION(start) - 1;
+	long long last = BLOCK_CACHE_REGION(start + size - 1);
+
+	if(region < 0)
+		region = 0;
+
+	/*
+	 * Writes can be larger than the cache, in which case it is quicker
+	 * to look at every block rather than every region
+	 */
+	if(last - region >= BLOCK_CACHE_HASH_SIZE) {
+		struct block_cache_entry *entry, *next;
+
+		for(entry = cache->lru_head; entry; entry = next) {
+			next = entry->lru_next;
+			if(entry->start < start + size &&
+					entry->start + entry->size > start)
+				remove_entry(cache, entry);
+		}
+		return;
+	}
+
+	for(; region <= last; region ++) {
+		struct block_cache_entry *entry, *next;
+
+		entry = cache->region_table[BLOCK_CACHE_HASH(region)];
+		for(; entry; entry = next) {
+			next = entry->region_next;
+			if(entry->start < start + size &&
+					entry->start + entry->size > start)
+				remove_entry(cache, entry);
+		}
+	}
+}
+
+
+/*
+ * Add the block of size bytes written at start, replacing anything
+ * previously written over it, and evicting the least recently used blocks
+ * to make room
+ */
+void block_cache_add(struct block_cache *cache, long long start, int size,
+	void *data)
+{
+	struct block_cache_entry *entry = NULL;
+	int hash = BLOCK_CACHE_HASH(start);
+	int region = BLOCK_CACHE_HASH(BLOCK_CACHE_REGION(start));
+
+	if(size <= cache->max_bytes && size <= 1 << BLOCK_CACHE_REGION_LOG) {
+		entry = malloc(sizeof(struct block_cache_entry) + size);
+		if(entry == NULL)
+			MEM_ERROR();
+
+		entry->start = start;
+		entry->size = size;
+		memcpy(entry->data, data, size);
+	}
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
+	pthread_mutex_lock(&cache->mutex);
+
+	remove_range(cache, start, size);
+
+	if(entry) {
+		while(cache->bytes + size > cache->max_bytes) {
+			cache->evictions ++;
+			remove_entry(cache, cache->lru_tail);
+		}
+
+		entry->hash_next = cache->hash_table[hash];
+		cache->hash_table[hash] = entry;
+		entry->region_next = cache->region_table[region];
+		cache->region_table[region] = entry;
+		lru_insert(cache, entry);
+		cache->bytes += size;
+	}
+
+	pthread_cleanup_pop(1);
+}
+
+
+/*
+ * Remove the blocks overlapping the size bytes written at start, because
+ * something else has been written over them
+ */
+void block_cache_remove(struct block_cache *cache, long long start,
+	long long size)
+{
+	if(size <= 0)
+		return;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
+	pthread_mutex_lock(&cache->mutex);
+
+	remove_range(cache, start, size);
+
+	pthread_cleanup_pop(1);
+}
+
+
+/*
+ * Copy the size byte block written at start into buff, returning FALSE if
+ * it isn't in the cache
+ */
+int block_cache_read(struct block_cache *cache, long long start, int size,
+	void *buff)
+{
+	struct block_cache_entry *entry;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &cache->mutex);
+	pthread_mutex_lock(&cache->mutex);
+
+	for(entry = cache->hash_table[BLOCK_CACHE_HASH(start)]; entry;
+						entry = entry->hash_next)
+		if(entry->start == start)
+			break;
+
+	if(entry && entry->size == size) {
+		memcpy(buff, entry->data, size);
+		lru_remove(cache, entry);
+		lru_insert(cache, entry);
+		cache->hits ++;
+	} else {
+		entry = NULL;
+		cache->misses ++;
+	}
+
+	pthread_cleanup_pop(1);
+
+	return entry != NULL;
+}
+
+
+void block_cache_stats(struct block_cache *cache)
+{
+	unsigned long long lookups = cache->hits + cache->misses;
+
+	printf("Written block cache: %llu lookups, %.2f%% hit rate, %llu "
+		"eviction%s\n", lookups, lookups ? cache->hits * 100.0 /
+		lookups : 0.0, cache->evictions, cache->evictions == 1 ? "" :
+		"s");
+}
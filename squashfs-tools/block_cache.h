@@ -0,0 +1,73 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * block_cache.h
+ */
+
+/*
+ * Cache of the most recently written compressed blocks, keyed on their
+ * position in the output filesystem, bounded to a total size in bytes
+ * and with least recently used replacement.
+ *
+ * Blocks are also hashed on the region they start in, so that the blocks
+ * overlapping a write can be found.  Blocks are no larger than a region
+ * (the maximum block size), and so only the regions of the write and
+ * the region before need to be searched.
+ */
+#define BLOCK_CACHE_HASH_SIZE	65536
+#define BLOCK_CACHE_HASH(n)	((n) & (BLOCK_CACHE_HASH_SIZE - 1))
+#define BLOCK_CACHE_REGION_LOG	20
+#define BLOCK_CACHE_REGION(n)	((n) >> BLOCK_CACHE_REGION_LOG)
+
+struct block_cache_entry {
+	long long			start;
+	int				size;
+	struct block_cache_entry	*hash_next;
+	struct block_cache_entry	*region_next;
+	struct block_cache_entry	*lru_next;
+	struct block_cache_entry	*lru_prev;
+	char				data[0];
+};
+
+struct block_cache {
+	long long			max_bytes;
+	long long			bytes;
+	struct block_cache_entry	*lru_head;
+	struct block_cache_entry	*lru_tail;
+	unsigned long long		hits;
+	unsigned long long		misses;
+	unsigned long long		evictions;
+	pthread_mutex_t			mutex;
+	struct block_cache_entry	*hash_table[BLOCK_CACHE_HASH_SIZE];
+	struct block_cache_entry	*region_table[BLOCK_CACHE_HASH_SIZE];
+};
+
+extern struct block_cache *block_cache_init(long long max_bytes);
+extern void block_cache_add(struct block_cache *cache, long long start,
+	int size, void *data);
+extern void block_cache_remove(struct block_cache *cache, long long start,
+	long long size);
+extern int block_cache_read(struct block_cache *cache, long long start,
+	int size, void *buff);
+extern void block_cache_stats(struct block_cache *cache);
+#endif
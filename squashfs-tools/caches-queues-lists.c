@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "mksquashfs_error.h"
 #include "caches-queues-lists.h"
@@ -316,6 +317,7 @@ struct cache *cache_init(int buffer_size, int max_buffers, int noshrink_lookup,
 	 * from the freelist
 	 */
 	cache->first_freelist = first_freelist;
+	cache->aligned = FALSE;
 
 	memset(cache->hash_table, 0, sizeof(struct file_buffer *) * 65536);
 	pthread_mutex_init(&cache->mutex, NULL);
@@ -326,6 +328,16 @@ struct cache *cache_init(int buffer_size, int max_buffers, int noshrink_lookup,
 }
 
 
+/*
+ * Align the data of buffers subsequently allocated by the cache on a
+ * CACHE_ALIGNMENT boundary, so they can be read into with O_DIRECT
+ */
+void cache_align(struct cache *cache)
+{
+	cache->aligned = TRUE;
+}
+
+
 struct file_buffer *cache_lookup(struct cache *cache, long long index)
 {
 	/* Lookup block in the cache, if found return with usage count
@@ -373,11 +385,28 @@ static struct file_buffer *cache_freelist(struct cache *cache)
 
 static struct file_buffer *cache_alloc(struct cache *cache)
 {
-	struct file_buffer *entry = malloc(sizeof(struct file_buffer) +
-							cache->buffer_size);
-	if(entry == NULL)
+	struct file_buffer *entry;
+
+	if(cache->aligned) {
+		void *mem;
+
+		/*
+		 * Place the buffer header immediately before the first
+		 * alignment boundary, so its data starts there
+		 */
+		if(posix_memalign(&mem, CACHE_ALIGNMENT, CACHE_ALIGNMENT +
+							cache->buffer_size))
 			MEM_ERROR();
 
+		entry = mem + CACHE_ALIGNMENT - offsetof(struct file_buffer,
+									data);
+	} else {
+		entry = malloc(sizeof(struct file_buffer) + cache->buffer_size);
+		if(entry == NULL)
+			MEM_ERROR();
+	}
+
+	entry->aligned = cache->aligned;
 	entry->cache = cache;
 	entry->free_prev = entry->free_next = NULL;
 	cache->count ++;
@@ -385,6 +414,15 @@ static struct file_buffer *cache_alloc(struct cache *cache)
 }
 
 
+static void cache_free(struct file_buffer *entry)
+{
+	if(entry->aligned)
+		free(entry->data - CACHE_ALIGNMENT);
+	else
+		free(entry);
+}
+
+
 static struct file_buffer *_cache_get(struct cache *cache, long long index,
 	int hash)
 {
@@ -461,6 +499,28 @@ void cache_hash(struct file_buffer *entry, long long index)
 }
 
 
+/*
+ * Exchange the caches owning two in use, unhashed buffers of the same size.
+ * This hands the data in one buffer over to the other cache without
+ * copying it, the other buffer taking its place in the original cache.
+ * Cache counts are unchanged as each cache still owns the same number
+ * of buffers.
+ */
+int cache_swap(struct file_buffer *a, struct file_buffer *b)
+{
+	struct cache *cache = a->cache;
+
+	if(cache == NULL || b->cache == NULL ||
+				cache->buffer_size != b->cache->buffer_size)
+		return FALSE;
+
+	a->cache = b->cache;
+	b->cache = cache;
+
+	return TRUE;
+}
+
+
 void cache_block_put(struct file_buffer *entry)
 {
 	struct cache *cache;
@@ -495,7 +555,7 @@ void cache_block_put(struct file_buffer *entry)
 			insert_free_list(&cache->free_list, entry);
 			cache->used --;
 		} else {
-			free(entry);
+			cache_free(entry);
 			cache->count --;
 		}
 
@@ -82,6 +82,9 @@ void remove_##NAME##_hash_table(TYPE *container, struct file_buffer *entry) \
 }
 
 #define HASH_SIZE 65536
+
+/* alignment of the data in buffers from an aligned cache, for O_DIRECT */
+#define CACHE_ALIGNMENT 4096
 #define CALCULATE_HASH(n) ((n) & 0xffff)
 
 
@@ -113,6 +116,8 @@ struct file_buffer {
 			struct file_buffer *seq_prev;
 		};
 	};
+	struct incremental_data *incremental;
+	int old_block;
 	int size;
 	int c_byte;
 	char used;
@@ -122,6 +127,7 @@ struct file_buffer {
 	char wait_on_unlock;
 	char noD;
 	char duplicate;
+	char aligned;
 	char data[0] __attribute__((aligned));
 };
 
@@ -160,6 +166,7 @@ struct cache {
 	int	buffer_size;
 	int	noshrink_lookup;
 	int	first_freelist;
+	int	aligned;
 	union {
 		int	used;
 		int	max_count;
@@ -184,10 +191,12 @@ extern void dump_seq_queue(struct seq_queue *, int);
 extern struct file_buffer *seq_queue_get(struct seq_queue *);
 extern void seq_queue_flush(struct seq_queue *);
 extern struct cache *cache_init(int, int, int, int);
+extern void cache_align(struct cache *);
 extern struct file_buffer *cache_lookup(struct cache *, long long);
 extern struct file_buffer *cache_get(struct cache *, long long);
 extern struct file_buffer *cache_get_nohash(struct cache *);
 extern void cache_hash(struct file_buffer *, long long);
+extern int cache_swap(struct file_buffer *, struct file_buffer *);
 extern void cache_block_put(struct file_buffer *);
 extern void dump_cache(struct cache *);
 extern struct file_buffer *cache_get_nowait(struct cache *, long long);
@@ -0,0 +1,354 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * incremental.c
+ *
+ * Incremental rebuilds.  The directory tree of a previous image is read,
+ * and regular files in the source which have the same pathname, size and
+ * modification time as a file in the previous image are candidates for
+ * reusing its compressed blocks.
+ *
+ * Modification times are stored in whole seconds, and are often preserved
+ * or clamped when the contents change, and so candidates are still read
+ * and each block is checked by the deflator threads against the
+ * decompressed block of the previous image.  If they are the same the
+ * compressed block is copied rather than compressing the block again.
+ * Decompressing is much cheaper than compressing.
+ */
+
+#define TRUE 1
+#define FALSE 0
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "compressor.h"
+#include "caches-queues-lists.h"
+#include "mksquashfs.h"
+#include "mksquashfs_error.h"
+#include "pseudo.h"
+#include "read_meta.h"
+#include "incremental.h"
+
+int incremental = FALSE;
+int incremental_blocks = 0;
+long long incremental_bytes = 0;
+int incremental_changed = 0;
+
+static pthread_mutex_t incremental_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int match_mtime;
+static int old_fd;
+static struct squashfs_super_block old_sBlk;
+static struct meta_reader old_reader;
+static struct squashfs_fragment_entry *old_fragment_table = NULL;
+static struct incremental_file **path_table;
+static struct incremental_data **data_table;
+static unsigned int table_size;
+
+
+static unsigned int path_hash(char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while(*name)
+		hash = (hash ^ (unsigned char) *name++) * 16777619U;
+
+	return hash & (table_size - 1);
+}
+
+
+static unsigned int data_hash(long long start, long long file_size)
+{
+	return (unsigned int) (start ^ (file_size << 7)) & (table_size - 1);
+}
+
+
+static void read_old_bytes(long long start, int bytes, void *buff)
+{
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pread(old_fd, buff + count, bytes - count, start + count);
+		if(res < 1) {
+			if(res == 0)
+				BAD_ERROR("Unexpected EOF reading incremental "
+					"image\n");
+			else if(errno != EINTR)
+				BAD_ERROR("Read on incremental image failed "
+					"because %s\n", strerror(errno));
+			res = 0;
+		}
+	}
+}
+
+
+static struct incremental_data *add_data(long long start, long long file_size,
+	unsigned int fragment, unsigned int offset, long long block,
+	int block_offset)
+{
+	int hash = data_hash(start, file_size), res;
+	struct incremental_data *data;
+	unsigned int i;
+
+	for(data = data_table[hash]; data; data = data->next)
+		if(data->start == start && data->file_size == file_size &&
+				data->fragment == fragment &&
+				data->offset == offset)
+			return data;
+
+	data = malloc(sizeof(struct incremental_data));
+	if(data == NULL)
+		MEM_ERROR();
+
+	data->start = start;
+	data->file_size = file_size;
+	data->fragment = fragment;
+	data->offset = offset;
+
+	if(fragment == SQUASHFS_INVALID_FRAG)
+		data->blocks = (file_size + block_size - 1) >> block_log;
+	else {
+		if(fragment >= old_sBlk.fragments)
+			BAD_ERROR("Incremental image fragment index out of "
+				"range, filesystem corrupted?\n");
+		data->blocks = file_size >> block_log;
+	}
+
+	if(data->blocks) {
+		data->block_list = malloc(data->blocks * sizeof(unsigned int));
+		if(data->block_list == NULL)
+			MEM_ERROR();
+
+		res = read_meta(&old_reader, data->block_list, &block,
+			&block_offset, data->blocks * sizeof(unsigned int));
+		if(res)
+			BAD_ERROR("Failed to read block list in incremental "
+				"image because %s\n", strerror(-res));
+		SQUASHFS_INSWAP_INTS(data->block_list, data->blocks);
+
+		data->block_start = malloc(data->blocks * sizeof(long long));
+		if(data->block_start == NULL)
+			MEM_ERROR();
+
+		for(i = 0; i < data->blocks; i++) {
+			data->block_start[i] = start;
+			start += SQUASHFS_COMPRESSED_SIZE_BLOCK(
+							data->block_list[i]);
+		}
+	} else {
+		data->block_list = NULL;
+		data->block_start = NULL;
+	}
+
+	data->next = data_table[hash];
+	data_table[hash] = data;
+
+	return data;
+}
+
+
+static void add_path(struct meta_reader *reader, char *pathname,
+	struct meta_inode *inode)
+{
+	struct incremental_file *entry;
+	int hash;
+
+	if(inode->size == 0)
+		return;
+
+	hash = path_hash(pathname);
+	entry = malloc(sizeof(struct incremental_file));
+	if(entry == NULL)
+		MEM_ERROR();
+
+	entry->pathname = strdup(pathname);
+	if(entry->pathname == NULL)
+		MEM_ERROR();
+
+	entry->mtime = inode->mtime;
+	entry->data = add_data(inode->start, inode->size, inode->fragment,
+		inode->offset, inode->block, inode->block_offset);
+	entry->next = path_table[hash];
+	path_table[hash] = entry;
+}
+
+
+/*
+ * Read the previous image.  If use_mtime is FALSE, the modification times
+ * in the image were overridden (-all-time or SOURCE_DATE_EPOCH), and so
+ * candidates are chosen on pathname and size alone
+ */
+void incremental_open(char *filename, int use_mtime)
+{
+	int res;
+
+	old_fd = open(filename, O_RDONLY);
+	if(old_fd == -1)
+		BAD_ERROR("Failed to open incremental image %s because %s\n",
+			filename, strerror(errno));
+
+	read_old_bytes(SQUASHFS_START, sizeof(old_sBlk), &old_sBlk);
+	SQUASHFS_INSWAP_SUPER_BLOCK(&old_sBlk);
+
+	if(old_sBlk.s_magic != SQUASHFS_MAGIC ||
+				old_sBlk.s_major != SQUASHFS_MAJOR)
+		BAD_ERROR("Incremental image %s is not a Squashfs 4.0 "
+			"filesystem\n", filename);
+
+	if(old_sBlk.compression != comp->id)
+		BAD_ERROR("Incremental image %s uses a different compressor, "
+			"-incremental requires the same compressor\n",
+			filename);
+
+	if(old_sBlk.block_size != block_size)
+		BAD_ERROR("Incremental image %s has a block size of %d, "
+			"-incremental requires the same block size\n",
+			filename, old_sBlk.block_size);
+
+	for(table_size = 1; table_size < old_sBlk.inodes; table_size <<= 1);
+
+	path_table = calloc(table_size, sizeof(struct incremental_file *));
+	data_table = calloc(table_size, sizeof(struct incremental_data *));
+	if(path_table == NULL || data_table == NULL)
+		MEM_ERROR();
+
+	if(meta_reader_init(&old_reader, old_fd, &old_sBlk, comp))
+		MEM_ERROR();
+
+	res = read_meta_fragments(&old_reader, &old_fragment_table);
+	if(res == 0)
+		res = scan_meta(&old_reader, TRUE, add_path, NULL);
+	if(res)
+		BAD_ERROR("Failed to read incremental image %s because %s\n",
+			filename, strerror(-res));
+
+	meta_reader_free(&old_reader);
+	match_mtime = use_mtime;
+	incremental = TRUE;
+}
+
+
+static struct incremental_file *lookup_path(char *pathname)
+{
+	struct incremental_file *file = path_table[path_hash(pathname)];
+
+	for(; file; file = file->next)
+		if(strcmp(file->pathname, pathname) == 0)
+			break;
+
+	return file;
+}
+
+
+/*
+ * Mark the regular files which are candidates for reusing the compressed
+ * blocks of the previous image.  Their blocks are checked as they are
+ * compressed by incremental_block()
+ */
+void incremental_mark(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent = dir->list;
+
+	for(; dir_ent; dir_ent = dir_ent->next) {
+		struct inode_info *inode = dir_ent->inode;
+		struct incremental_file *file;
+
+		if((inode->buf.st_mode & S_IFMT) == S_IFDIR) {
+			if(dir_ent->dir)
+				incremental_mark(dir_ent->dir);
+			continue;
+		}
+
+		if((inode->buf.st_mode & S_IFMT) != S_IFREG ||
+				inode->root_entry || IS_PSEUDO(inode) ||
+				inode->tarfile)
+			continue;
+
+		file = lookup_path(subpathname(dir_ent));
+		if(file && file->data->file_size == inode->buf.st_size &&
+				(!match_mtime || file->mtime ==
+						inode->buf.st_mtime))
+			inode->incremental = file->data;
+	}
+}
+
+
+/*
+ * Called by the deflator threads.  If the block read into file_buffer is
+ * the same as the block of the previous image, copy its compressed data to
+ * dest and return its c_byte, otherwise return 0.  Old_data is a block_size
+ * buffer for the decompressed block
+ */
+int incremental_block(struct file_buffer *file_buffer, char *dest,
+	char *old_data)
+{
+	struct incremental_data *data = file_buffer->incremental;
+	int block = file_buffer->old_block, size, length, error, same;
+	unsigned int c_byte;
+
+	if(data == NULL || block >= data->blocks)
+		return 0;
+
+	c_byte = data->block_list[block];
+	size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+
+	/*
+	 * Sparse blocks are left to the deflator, and compressed blocks
+	 * can't be used if the block is to be stored uncompressed
+	 */
+	if(size == 0 || (file_buffer->noD && SQUASHFS_COMPRESSED_BLOCK(c_byte)))
+		return 0;
+
+	if(size > block_size)
+		BAD_ERROR("Incremental image block too large, filesystem "
+			"corrupted?\n");
+
+	read_old_bytes(data->block_start[block], size, dest);
+
+	if(SQUASHFS_COMPRESSED_BLOCK(c_byte)) {
+		length = compressor_uncompress(comp, old_data, dest, size,
+			block_size, &error);
+		same = length == file_buffer->size && memcmp(old_data,
+					file_buffer->data, length) == 0;
+	} else
+		same = size == file_buffer->size && memcmp(dest,
+					file_buffer->data, size) == 0;
+
+	pthread_mutex_lock(&incremental_mutex);
+	if(same) {
+		incremental_blocks ++;
+		incremental_bytes += file_buffer->size;
+	} else
+		incremental_changed ++;
+	pthread_mutex_unlock(&incremental_mutex);
+
+	return same ? c_byte : 0;
+}
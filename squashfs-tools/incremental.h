@@ -0,0 +1,57 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * incremental.h
+ */
+
+/*
+ * The data of a regular file in the previous image.  Hard links and
+ * duplicate files in the previous image share the same data.
+ */
+struct incremental_data {
+	long long			start;
+	long long			file_size;
+	unsigned int			*block_list;
+	long long			*block_start;
+	unsigned int			blocks;
+	unsigned int			fragment;
+	unsigned int			offset;
+	struct incremental_data		*next;
+};
+
+struct incremental_file {
+	char				*pathname;
+	unsigned int			mtime;
+	struct incremental_data		*data;
+	struct incremental_file		*next;
+};
+
+extern int incremental;
+extern int incremental_blocks;
+extern long long incremental_bytes;
+extern int incremental_changed;
+extern void incremental_open(char *filename, int use_mtime);
+extern void incremental_mark(struct dir_info *dir);
+extern int incremental_block(struct file_buffer *file_buffer, char *dest,
+	char *old_data);
+#endif
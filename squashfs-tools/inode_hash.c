@@ -0,0 +1,209 @@
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * inode_hash.c
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "inode_hash.h"
+#include "mksquashfs_error.h"
+
+
+static inline unsigned long long hash_key(dev_t dev, ino_t ino)
+{
+	unsigned long long key = ((unsigned long long) dev << 32) ^ ino;
+
+	/* 64-bit finalizer from MurmurHash3 */
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return key;
+}
+
+
+struct inode_hash *inode_hash_create(unsigned long long size)
+{
+	struct inode_hash *hash = malloc(sizeof(struct inode_hash));
+	unsigned long long table_size = INODE_HASH_MIN_SIZE;
+
+	if(hash == NULL)
+		MEM_ERROR();
+
+	while(table_size < size)
+		table_size <<= 1;
+
+	hash->table = calloc(table_size, sizeof(struct inode_hash_entry));
+	if(hash->table == NULL)
+		MEM_ERROR();
+
+	hash->size = table_size;
+	hash->count = 0;
+	hash->lookups = 0;
+	hash->probes = 0;
+	hash->resizes = 0;
+
+	return hash;
+}
+
+
+/*
+ * Return the slot holding (dev, ino), or the empty slot where it
+ * should be inserted
+ */
+static struct inode_hash_entry *find_slot(struct inode_hash *hash, dev_t dev,
+	ino_t ino)
+{
+	unsigned long long mask = hash->size - 1;
+	unsigned long long i = hash_key(dev, ino) & mask;
+
+	hash->lookups ++;
+
+	for(;; i = (i + 1) & mask) {
+		struct inode_hash_entry *entry = &hash->table[i];
+
+		hash->probes ++;
+		if(entry->data == NULL || (entry->dev == dev &&
+							entry->ino == ino))
+			return entry;
+	}
+}
+
+
+static void grow_table(struct inode_hash *hash)
+{
+	struct inode_hash_entry *old = hash->table;
+	unsigned long long i, old_size = hash->size;
+
+	hash->size <<= 1;
+	hash->table = calloc(hash->size, sizeof(struct inode_hash_entry));
+	if(hash->table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < old_size; i++)
+		if(old[i].data)
+			*find_slot(hash, old[i].dev, old[i].ino) = old[i];
+
+	hash->resizes ++;
+	free(old);
+}
+
+
+/*
+ * Remove the entry at slot i, shifting back any following entries in
+ * the probe sequence so lookups never terminate early at the hole
+ */
+static void remove_slot(struct inode_hash *hash, unsigned long long i)
+{
+	unsigned long long mask = hash->size - 1, j = i, home;
+
+	hash->count --;
+
+	for(;;) {
+		hash->table[i].data = NULL;
+
+		for(;;) {
+			j = (j + 1) & mask;
+			if(hash->table[j].data == NULL)
+				return;
+
+			home = hash_key(hash->table[j].dev,
+					hash->table[j].ino) & mask;
+
+			/* can the entry at j be moved back to i? */
+			if(i <= j ? (home <= i || home > j) :
+						(home <= i && home > j))
+				break;
+		}
+
+		hash->table[i] = hash->table[j];
+		i = j;
+	}
+}
+
+
+void *inode_hash_lookup(struct inode_hash *hash, dev_t dev, ino_t ino)
+{
+	return find_slot(hash, dev, ino)->data;
+}
+
+
+/*
+ * Set the data associated with (dev, ino), replacing any existing
+ * association.  Setting NULL data removes the entry
+ */
+void inode_hash_set(struct inode_hash *hash, dev_t dev, ino_t ino, void *data)
+{
+	struct inode_hash_entry *entry = find_slot(hash, dev, ino);
+
+	if(data == NULL) {
+		if(entry->data)
+			remove_slot(hash, entry - hash->table);
+		return;
+	}
+
+	if(entry->data == NULL) {
+		if((hash->count + 1) * 2 > hash->size) {
+			grow_table(hash);
+			entry = find_slot(hash, dev, ino);
+		}
+
+		entry->dev = dev;
+		entry->ino = ino;
+		hash->count ++;
+	}
+
+	entry->data = data;
+}
+
+
+/*
+ * Iterate over the table.  *index should be initialised to 0, and NULL
+ * is returned once all entries have been returned
+ */
+void *inode_hash_next(struct inode_hash *hash, unsigned long long *index)
+{
+	while(*index < hash->size) {
+		void *data = hash->table[(*index) ++].data;
+
+		if(data)
+			return data;
+	}
+
+	return NULL;
+}
+
+
+void inode_hash_stats(struct inode_hash *hash, char *name)
+{
+	printf("%s hash table: %llu entries, %llu slots, load factor %.2f\n",
+		name, hash->count, hash->size, (double) hash->count /
+		hash->size);
+	printf("\t%llu lookups, average probe length %.2f, %d resize%s\n",
+		hash->lookups, hash->lookups ? (double) hash->probes /
+		hash->lookups : 0.0, hash->resizes, hash->resizes == 1 ? "" :
+		"s");
+}
@@ -0,0 +1,56 @@
+#ifndef INODE_HASH_H
+#define INODE_HASH_H
+/*
+ * Create a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * inode_hash.h
+ */
+
+/*
+ * Open addressing (linear probing) hash table keyed on (st_dev, st_ino).
+ * The table doubles in size whenever it becomes more than half full.
+ * An entry with a NULL data pointer is an empty slot.
+ */
+#define INODE_HASH_MIN_SIZE	1024
+
+struct inode_hash_entry {
+	dev_t			dev;
+	ino_t			ino;
+	void			*data;
+};
+
+struct inode_hash {
+	struct inode_hash_entry	*table;
+	unsigned long long	size;
+	unsigned long long	count;
+	unsigned long long	lookups;
+	unsigned long long	probes;
+	int			resizes;
+};
+
+extern struct inode_hash *inode_hash_create(unsigned long long size);
+extern void *inode_hash_lookup(struct inode_hash *hash, dev_t dev, ino_t ino);
+extern void inode_hash_set(struct inode_hash *hash, dev_t dev, ino_t ino,
+	void *data);
+extern void *inode_hash_next(struct inode_hash *hash,
+	unsigned long long *index);
+extern void inode_hash_stats(struct inode_hash *hash, char *name);
+#endif
@@ -73,6 +73,11 @@
 #include "process_fragments.h"
 #include "fnmatch_compat.h"
 #include "tar.h"
+#include "inode_hash.h"
+#include "incremental.h"
+#include "path_index.h"
+#include "resources.h"
+#include "block_cache.h"
 
 int delete = FALSE;
 int quiet = FALSE;
@@ -130,7 +135,11 @@ unsigned int cache_bytes = 0, cache_size = 0, inode_count = 0;
 /* inode lookup table */
 squashfs_inode *inode_lookup_table = NULL;
 
-struct inode_info *inode_info[INODE_HASH_SIZE];
+/*
+ * inode hash table, used to detect hardlinks.  Each entry is a list of
+ * the inodes having that st_dev, st_ino pair
+ */
+struct inode_hash *inode_info;
 
 /* hash tables used to do fast duplicate searches in duplicate check */
 struct file_info **dupl_frag;
@@ -155,6 +164,7 @@ unsigned int fragments = 0;
 
 struct squashfs_fragment_entry *fragment_table = NULL;
 int fragments_outstanding = 0;
+long long fragment_sequence = 0;
 
 int fragments_locked = FALSE;
 
@@ -210,9 +220,10 @@ unsigned int sid_count = 0, suid_count = 0, sguid_count = 0;
 struct cache *reader_buffer, *fragment_buffer, *reserve_cache;
 struct cache *bwriter_buffer, *fwriter_buffer;
 struct queue *to_reader, *to_deflate, *to_writer, *from_writer,
-	*to_frag, *locked_fragment, *to_process_frag;
+	*to_frag, *locked_fragment, *to_process_frag, *to_metadata,
+	*from_metadata;
 struct seq_queue *to_main;
-pthread_t reader_thread, writer_thread, main_thread;
+pthread_t reader_thread, writer_thread, main_thread, metadata_thread;
 pthread_t *deflator_thread, *frag_deflator_thread, *frag_thread;
 pthread_t *restore_thread = NULL;
 pthread_mutex_t	fragment_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -223,6 +234,8 @@ pthread_mutex_t	dup_mutex = PTHREAD_MUTEX_INITIALIZER;
 struct seq_queue *to_order;
 pthread_t order_thread;
 pthread_cond_t fragment_waiting = PTHREAD_COND_INITIALIZER;
+pthread_cond_t fragment_release = PTHREAD_COND_INITIALIZER;
+long long fragments_allowed = 0;
 
 int reproducible = REP_DEF;
 
@@ -246,8 +259,21 @@ int clamping = TRUE;
 
 /* user options that control parallelisation */
 int processors = -1;
+
+/* processors the compressor threads, and the reader and writer threads run on */
+struct cpu_list *worker_cpus = NULL;
+struct cpu_list *io_cpus = NULL;
 int bwriter_size;
 
+/* user options that control how source files and the output are cached */
+int drop_caches = FALSE;
+int direct_io = FALSE;
+int noatime = FALSE;
+
+/* cache of written blocks read back by duplicate checking, size in Mbytes */
+int dup_cache_size = -1;
+struct block_cache *block_cache = NULL;
+
 /* compression operations */
 struct compressor *comp = NULL;
 int compressor_opt_parsed = FALSE;
@@ -285,6 +311,19 @@ dev_t cur_dev;
 /* Is Mksquashfs processing a tarfile? */
 int tarfile = FALSE;
 
+/* Previous image to copy unchanged files from */
+static char *incremental_image = NULL;
+
+/* Should Mksquashfs write a path index after the filesystem tables? */
+static int path_index = FALSE;
+
+/* path index being written */
+static char *pindex_buff, *pindex_last = NULL, *pindex_index = NULL;
+static int pindex_bytes = 0, pindex_last_len = 0, pindex_last_size = 0;
+static int pindex_index_bytes = 0, pindex_index_size = 0;
+static unsigned int pindex_entries = 0, pindex_blocks = 0;
+static long long pindex_start;
+
 /* list of options that have an argument */
 char *option_table[] = { "comp", "b", "mkfs-time", "fstime", "all-time", "root-mode",
 	"force-uid", "force-gid", "action", "log-action", "true-action",
@@ -293,22 +332,24 @@ char *option_table[] = { "comp", "b", "mkfs-time", "fstime", "all-time", "root-m
 	"recovery-path", "throttle", "limit", "processors", "mem", "offset",
 	"o", "log", "a", "va", "ta", "fa", "af", "vaf", "taf", "faf",
 	"read-queue", "write-queue", "fragment-queue", "root-time", "root-uid",
-	"root-gid", NULL
+	"root-gid", "incremental", "cpu-set", "io-cpu-set", "dup-cache", NULL
 };
 
 char *sqfstar_option_table[] = { "comp", "b", "mkfs-time", "fstime", "all-time",
 	"root-mode", "force-uid", "force-gid", "throttle", "limit",
 	"processors", "mem", "offset", "o", "root-time", "root-uid",
-	"root-gid", NULL
+	"root-gid", "cpu-set", "io-cpu-set", "dup-cache", NULL
 };
 
 static char *read_from_disk(long long start, unsigned int avail_bytes);
+static int read_written_block(long long start, unsigned int avail_bytes,
+	void *buff);
 static void add_old_root_entry(char *name, squashfs_inode inode,
 	unsigned int inode_number, int type);
 static struct file_info *duplicate(int *dup, int *block_dup, long long file_size, long long bytes,
 	unsigned int *block_list, long long start, struct dir_ent *dir_ent,
 	struct file_buffer *file_buffer, int blocks, long long sparse,
-	int bl_hash);
+	int bl_hash, int check_blocks);
 static struct dir_info *dir_scan1(char *, char *, struct pathnames *,
 	struct dir_ent *(_readdir)(struct dir_info *), int);
 static void dir_scan2(struct dir_info *dir, struct pseudo *pseudo);
@@ -317,6 +358,8 @@ static void dir_scan4(struct dir_info *dir, int symlink);
 static void dir_scan5(struct dir_info *dir);
 static void dir_scan6(struct dir_info *dir);
 static void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info);
+static void dir_scan7_files(struct dir_info *dir_info);
+static void *metadata_builder(void *arg);
 static struct dir_ent *scan1_readdir(struct dir_info *dir);
 static struct dir_ent *scan1_single_readdir(struct dir_info *dir);
 static struct dir_ent *scan1_encomp_readdir(struct dir_info *dir);
@@ -330,7 +373,7 @@ void restorefs();
 struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth);
 static void write_filesystem_tables(struct squashfs_super_block *sBlk);
 unsigned short get_checksum_mem(char *buff, int bytes);
-static void check_usable_phys_mem(int total_mem);
+static int check_usable_phys_mem(int total_mem);
 static void print_summary();
 void write_destination(int fd, long long byte, long long bytes, void *buff);
 
@@ -446,20 +489,36 @@ void sighandler()
 }
 
 
+/*
+ * Compress size bytes at s into d, and return the compressed size, or 0 if
+ * the block should be stored uncompressed, because uncompressed is set or
+ * because it doesn't compress
+ */
+static int compress_block(void *strm, char *d, char *s, int size,
+	int block_size, int uncompressed)
+{
+	int error, c_byte;
+
+	if(uncompressed)
+		return 0;
+
+	c_byte = compressor_compress(comp, strm, d, s, size, block_size,
+		 &error);
+	if(c_byte == -1)
+		BAD_ERROR("%s compress failed with error code %d\n",
+			comp->name, error);
+
+	return c_byte < size ? c_byte : 0;
+}
+
+
 static int mangle2(void *strm, char *d, char *s, int size,
 	int block_size, int uncompressed, int data_block)
 {
-	int error, c_byte = 0;
-
-	if(!uncompressed) {
-		c_byte = compressor_compress(comp, strm, d, s, size, block_size,
-			 &error);
-		if(c_byte == -1)
-			BAD_ERROR("mangle2:: %s compress failed with error "
-				"code %d\n", comp->name, error);
-	}
+	int c_byte = compress_block(strm, d, s, size, block_size,
+		uncompressed);
 
-	if(c_byte == 0 || c_byte >= size) {
+	if(c_byte == 0) {
 		memcpy(d, s, size);
 		return size | (data_block ? SQUASHFS_COMPRESSED_BIT_BLOCK :
 			SQUASHFS_COMPRESSED_BIT);
@@ -601,6 +660,9 @@ void write_destination(int fd, long long byte, long long bytes, void *buff)
 {
 	off_t off = byte;
 
+	if(block_cache)
+		block_cache_remove(block_cache, byte, bytes);
+
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &pos_mutex);
 	pthread_mutex_lock(&pos_mutex);
 
@@ -779,10 +841,14 @@ unsigned int get_guid(unsigned int guid)
 }
 
 
+/*
+ * The main thread and the metadata thread both generate pathnames, and so
+ * each has its own buffer
+ */
 char *pathname(struct dir_ent *dir_ent)
 {
-	static char *pathname = NULL;
-	static int size = ALLOC_SIZE;
+	static __thread char *pathname = NULL;
+	static __thread int size = ALLOC_SIZE;
 
 	if (dir_ent->nonstandard_pathname)
 		return dir_ent->nonstandard_pathname;
@@ -820,8 +886,8 @@ char *pathname(struct dir_ent *dir_ent)
 
 char *subpathname(struct dir_ent *dir_ent)
 {
-	static char *subpath = NULL;
-	static int size = ALLOC_SIZE;
+	static __thread char *subpath = NULL;
+	static __thread int size = ALLOC_SIZE;
 	int res;
 
 	if(subpath == NULL) {
@@ -1447,7 +1513,7 @@ again:
 	} else if(compressed_buffer)
 		memcpy(buffer->data, compressed_buffer->data, size);
 	else {
-		res = read_fs_bytes(fd, start_block, size, buffer->data);
+		res = read_written_block(start_block, size, buffer->data);
 		if(res == 0) {
 			ERROR("Failed to read fragment from output "
 				"filesystem\n");
@@ -1510,24 +1576,35 @@ static unsigned short get_fragment_checksum(struct file_info *file)
 }
 
 
-static void ensure_fragments_flushed()
+/*
+ * Stop fragments being written while the blocks of a file are being written.
+ *
+ * When building reproducible images the fragments placed before the file
+ * must not depend on how quickly they compressed.  Fragments are only
+ * allowed to be written once they are SQUASHFS_FRAGMENT_BACKLOG behind the
+ * last one queued, by which time they have almost always been compressed,
+ * and so waiting for the orderer thread to write them rarely stalls.
+ */
+static void lock_fragments()
 {
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
-
-	while(fragments_outstanding)
-		pthread_cond_wait(&fragment_waiting, &fragment_mutex);
-
+	if(reproducible)
+		while(fragment_sequence - fragments_outstanding <
+							fragments_allowed)
+			pthread_cond_wait(&fragment_waiting, &fragment_mutex);
+	fragments_locked = TRUE;
 	pthread_cleanup_pop(1);
 }
 
 
-static void lock_fragments()
+/* Called with the fragment_mutex locked */
+static void allow_fragments(long long sequence)
 {
-	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
-	pthread_mutex_lock(&fragment_mutex);
-	fragments_locked = TRUE;
-	pthread_cleanup_pop(1);
+	if(sequence > fragments_allowed) {
+		fragments_allowed = sequence;
+		pthread_cond_signal(&fragment_release);
+	}
 }
 
 
@@ -1546,13 +1623,17 @@ static void unlock_fragments()
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
 
+	/* The orderer thread writes any fragments allowed while locked */
+	if(reproducible)
+		pthread_cond_signal(&fragment_release);
+
 	/*
 	 * Note queue_empty() is inherently racy with respect to concurrent
 	 * queue get and pushes.  We avoid this because we're holding the
 	 * fragment_mutex which ensures no other threads can be using the
 	 * queue at this time.
 	 */
-	while(!queue_empty(locked_fragment)) {
+	while(!reproducible && !queue_empty(locked_fragment)) {
 		write_buffer = queue_get(locked_fragment);
 		frg = write_buffer->block;	
 		size = SQUASHFS_COMPRESSED_SIZE_BLOCK(fragment_table[frg].size);
@@ -1582,18 +1663,24 @@ static void add_pending_fragment(struct file_buffer *write_buffer, int c_byte,
 
 static void write_fragment(struct file_buffer *fragment)
 {
-	static long long sequence = 0;
-
 	if(fragment == NULL)
 		return;
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
 	fragment_table[fragment->block].unused = 0;
-	fragment->sequence = sequence ++;
+	fragment->sequence = fragment_sequence ++;
 	fragments_outstanding ++;
-	queue_put(to_frag, fragment);
+	if(reproducible)
+		allow_fragments(fragment_sequence -
+						SQUASHFS_FRAGMENT_BACKLOG);
 	pthread_cleanup_pop(1);
+
+	/*
+	 * Queue outside the fragment_mutex, the fragment deflators and orderer
+	 * thread need it to make progress if to_frag is full
+	 */
+	queue_put(to_frag, fragment);
 }
 
 
@@ -1665,6 +1752,32 @@ static struct fragment *get_and_fill_fragment(struct file_buffer *file_buffer,
 }
 
 
+/*
+ * Compress every threads'th metadata block of a table from first to last - 1,
+ * starting at block first + thread, into its slot in the compressed buffer
+ */
+static void *table_compressor(void *arg)
+{
+	struct table_compressor *table = arg;
+	int i;
+
+	for(i = table->first + table->thread; i < table->last;
+						i += table->threads) {
+		long long offset = (long long) i * SQUASHFS_METADATA_SIZE;
+		int avail_bytes = table->length - offset > SQUASHFS_METADATA_SIZE ?
+			SQUASHFS_METADATA_SIZE : table->length - offset;
+		int slot = i - table->first;
+
+		table->c_byte[slot] = mangle2(table->stream, table->cbuffer +
+			slot * TABLE_SLOT_SIZE, table->buffer + offset,
+			avail_bytes, SQUASHFS_METADATA_SIZE,
+			table->uncompressed, 0);
+	}
+
+	return NULL;
+}
+
+
 long long generic_write_table(long long length, void *buffer, int length2,
 	void *buffer2, int uncompressed)
 {
@@ -1672,8 +1785,14 @@ long long generic_write_table(long long length, void *buffer, int length2,
 		SQUASHFS_METADATA_SIZE;
 	long long *list, start_bytes;
 	int compressed_size, i, list_size = meta_blocks * sizeof(long long);
-	unsigned short c_byte;
-	char cbuffer[(SQUASHFS_METADATA_SIZE << 2) + 2];
+	int threads = processors < meta_blocks ? processors : meta_blocks;
+	int batch, first, last, compressed_bytes;
+	static void **table_stream = NULL;
+	static int table_streams = 0;
+	struct table_compressor *table;
+	unsigned short c_byte, *c_bytes;
+	pthread_t *thread;
+	char *cbuffer;
 	
 #ifdef SQUASHFS_TRACE
 	long long obytes = bytes;
@@ -1684,24 +1803,109 @@ long long generic_write_table(long long length, void *buffer, int length2,
 	if(list == NULL)
 		MEM_ERROR();
 
-	for(i = 0; i < meta_blocks; i++) {
-		int avail_bytes = length > SQUASHFS_METADATA_SIZE ?
-			SQUASHFS_METADATA_SIZE : length;
-		c_byte = mangle(cbuffer + BLOCK_OFFSET, buffer + i *
-			SQUASHFS_METADATA_SIZE , avail_bytes,
-			SQUASHFS_METADATA_SIZE, uncompressed, 0);
-		SQUASHFS_SWAP_SHORTS(&c_byte, cbuffer, 1);
-		list[i] = bytes;
-		compressed_size = SQUASHFS_COMPRESSED_SIZE(c_byte) +
-			BLOCK_OFFSET;
-		TRACE("block %d @ 0x%llx, compressed size %d\n", i, bytes,
-			compressed_size);
-		write_destination(fd, bytes, compressed_size, cbuffer);
-		bytes += compressed_size;
-		total_bytes += avail_bytes;
-		length -= avail_bytes;
+	/*
+	 * Tables such as the fragment and export tables can run to
+	 * thousands of metadata blocks, so compress a batch of blocks in
+	 * parallel into slots in cbuffer, write them out in order, and
+	 * repeat.  This bounds the memory used to the batch size
+	 */
+	if(threads < 1)
+		threads = 1;
+
+	/* the compressor streams are kept for the next table */
+	if(threads > table_streams) {
+		table_stream = realloc(table_stream, threads * sizeof(void *));
+		if(table_stream == NULL)
+			MEM_ERROR();
+
+		for(i = table_streams; i < threads; i++)
+			if(i == 0)
+				table_stream[i] = stream;
+			else if(compressor_init(comp, &table_stream[i],
+						SQUASHFS_METADATA_SIZE, 0))
+				BAD_ERROR("compressor_init failed\n");
+
+		table_streams = threads;
+	}
+
+	batch = threads * TABLE_BATCH_BLOCKS;
+	cbuffer = malloc(batch * TABLE_SLOT_SIZE);
+	c_bytes = malloc(batch * sizeof(unsigned short));
+	table = malloc(threads * sizeof(struct table_compressor));
+	thread = malloc(threads * sizeof(pthread_t));
+	if(cbuffer == NULL || c_bytes == NULL || table == NULL ||
+							thread == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < threads; i++) {
+		table[i].stream = table_stream[i];
+		table[i].buffer = buffer;
+		table[i].length = length;
+		table[i].uncompressed = uncompressed;
+		table[i].cbuffer = cbuffer + BLOCK_OFFSET;
+		table[i].c_byte = c_bytes;
+		table[i].thread = i;
+		table[i].threads = threads;
+	}
+
+	for(first = 0; first < meta_blocks; first = last) {
+		last = first + batch < meta_blocks ? first + batch : meta_blocks;
+
+		for(i = 0; i < threads; i++) {
+			table[i].first = first;
+			table[i].last = last;
+		}
+
+		if(threads == 1)
+			table_compressor(table);
+		else {
+			for(i = 0; i < threads; i++) {
+				if(pthread_create(&thread[i], NULL,
+						table_compressor, &table[i]))
+					BAD_ERROR("Failed to create thread\n");
+				if(!set_thread_cpus(thread[i], worker_cpus))
+					BAD_ERROR("Failed to set the processors "
+						"of the table compressor "
+						"threads\n");
+			}
+
+			for(i = 0; i < threads; i++)
+				pthread_join(thread[i], NULL);
+		}
+
+		/*
+		 * pack the compressed blocks of the batch together, and list
+		 * their positions
+		 */
+		for(compressed_bytes = 0, i = first; i < last; i++) {
+			int avail_bytes = length > SQUASHFS_METADATA_SIZE ?
+				SQUASHFS_METADATA_SIZE : length;
+			char *block = cbuffer + (i - first) * TABLE_SLOT_SIZE;
+
+			c_byte = c_bytes[i - first];
+			compressed_size = SQUASHFS_COMPRESSED_SIZE(c_byte) +
+				BLOCK_OFFSET;
+			SQUASHFS_SWAP_SHORTS(&c_byte, block, 1);
+			memmove(cbuffer + compressed_bytes, block,
+				compressed_size);
+
+			list[i] = bytes + compressed_bytes;
+			TRACE("block %d @ 0x%llx, compressed size %d\n", i,
+				list[i], compressed_size);
+			compressed_bytes += compressed_size;
+			total_bytes += avail_bytes;
+			length -= avail_bytes;
+		}
+
+		write_destination(fd, bytes, compressed_bytes, cbuffer);
+		bytes += compressed_bytes;
 	}
 
+	free(cbuffer);
+	free(c_bytes);
+	free(table);
+	free(thread);
+
 	start_bytes = bytes;
 	if(length2) {
 		write_destination(fd, bytes, length2, buffer2);
@@ -1741,12 +1945,27 @@ static long long write_fragment_table()
 }
 
 
+/*
+ * Read back a block written to the output filesystem, from the written
+ * block cache if it's there
+ */
+static int read_written_block(long long start, unsigned int avail_bytes,
+	void *buff)
+{
+	if(block_cache && block_cache_read(block_cache, start, avail_bytes,
+									buff))
+		return TRUE;
+
+	return read_fs_bytes(fd, start, avail_bytes, buff);
+}
+
+
 char read_from_file_buffer[SQUASHFS_FILE_MAX_SIZE];
 static char *read_from_disk(long long start, unsigned int avail_bytes)
 {
 	int res;
 
-	res = read_fs_bytes(fd, start, avail_bytes, read_from_file_buffer);
+	res = read_written_block(start, avail_bytes, read_from_file_buffer);
 	if(res == 0)
 		return NULL;
 
@@ -1759,7 +1978,7 @@ static char *read_from_disk2(long long start, unsigned int avail_bytes)
 {
 	int res;
 
-	res = read_fs_bytes(fd, start, avail_bytes, read_from_file_buffer2);
+	res = read_written_block(start, avail_bytes, read_from_file_buffer2);
 	if(res == 0)
 		return NULL;
 
@@ -1819,6 +2038,52 @@ static unsigned short get_checksum_disk(long long start, long long l,
 }
 
 
+/*
+ * Return the checksum of block <block> of file, which starts at <start> in
+ * the output filesystem.  Block checksums are computed on demand, in block
+ * order, and are kept so later files of the same size don't need to read the
+ * file back from the output filesystem again.
+ */
+static unsigned short get_block_checksum(struct file_info *file, int block,
+	long long start)
+{
+	int bytes = SQUASHFS_COMPRESSED_SIZE_BLOCK(file->block_list[block]);
+	struct file_buffer *write_buffer;
+	unsigned short chksum = 0;
+
+	if(block < file->checksum_blocks)
+		return file->block_checksum[block];
+
+	if(file->block_checksum == NULL) {
+		file->block_checksum = malloc(file->blocks *
+						sizeof(unsigned short));
+		if(file->block_checksum == NULL)
+			MEM_ERROR();
+	}
+
+	if(bytes) {
+		write_buffer = cache_lookup(bwriter_buffer, start);
+		if(write_buffer) {
+			chksum = get_checksum_mem(write_buffer->data, bytes);
+			cache_block_put(write_buffer);
+		} else {
+			void *data = read_from_disk(start, bytes);
+			if(data == NULL) {
+				ERROR("Failed to checksum data from output"
+					" filesystem\n");
+				BAD_ERROR("Output filesystem corrupted?\n");
+			}
+
+			chksum = get_checksum_mem(data, bytes);
+		}
+	}
+
+	file->block_checksum[block] = chksum;
+	file->checksum_blocks = block + 1;
+	return chksum;
+}
+
+
 unsigned short get_checksum_mem(char *buff, int bytes)
 {
 	return get_checksum(buff, bytes, 0);
@@ -1972,6 +2237,8 @@ static struct file_info *create_non_dup(long long file_size, long long bytes,
 	dupl_ptr->block_next = NULL;
 	dupl_ptr->frag_next = NULL;
 	dupl_ptr->dup = NULL;
+	dupl_ptr->block_checksum = NULL;
+	dupl_ptr->checksum_blocks = 0;
 
 	return dupl_ptr;
 }
@@ -2003,6 +2270,8 @@ static struct file_info *add_non_dup(long long file_size, long long bytes,
 	dupl_ptr->block_next = NULL;
 	dupl_ptr->frag_next = NULL;
 	dupl_ptr->dup = NULL;
+	dupl_ptr->block_checksum = NULL;
+	dupl_ptr->checksum_blocks = 0;
 
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &dup_mutex);
         pthread_mutex_lock(&dup_mutex);
@@ -2090,7 +2359,8 @@ static struct file_info *frag_duplicate(struct file_buffer *file_buffer, int *du
 
 static struct file_info *duplicate(int *dupf, int *block_dup, long long file_size, long long bytes,
 	unsigned int *block_list, long long start, struct dir_ent *dir_ent,
-	struct file_buffer *file_buffer, int blocks, long long sparse, int bl_hash)
+	struct file_buffer *file_buffer, int blocks, long long sparse, int bl_hash,
+	int check_blocks)
 {
 	struct file_info *dupl_ptr, *block_dupl = NULL, *frag_dupl = NULL, *file;
 	struct dup_info *dup;
@@ -2101,8 +2371,10 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 	char checksum_flag = FALSE;
 	struct fragment *fragment;
 
-	/* Look for a possible duplicate set of blocks */
-	for(dupl_ptr = dupl_block[bl_hash]; dupl_ptr; dupl_ptr = dupl_ptr->block_next) {
+	/* Look for a possible duplicate set of blocks, unless the caller
+	 * has already found none of them match while reading the file */
+	for(dupl_ptr = check_blocks ? dupl_block[bl_hash] : NULL; dupl_ptr;
+					dupl_ptr = dupl_ptr->block_next) {
 		if(bytes == dupl_ptr->bytes && blocks == dupl_ptr->blocks) {
 			long long target_start, dup_start = dupl_ptr->start;
 			int block;
@@ -2358,6 +2630,55 @@ static struct file_info *duplicate(int *dupf, int *block_dup, long long file_siz
 }
 
 
+/*
+ * With -drop-caches, stop the output filling the page cache.  Once the
+ * output has been written past a chunk, writeback of the chunk is started,
+ * and the previous chunk, which by now should have been written back, is
+ * waited for and dropped.  Output written behind the chunks (e.g. fragment
+ * blocks) is left to normal writeback
+ */
+static void drop_output(long long end)
+{
+#if defined(SYNC_FILE_RANGE_WRITE) && defined(POSIX_FADV_DONTNEED)
+	static long long started = -1, dropped;
+
+	if(started == -1)
+		started = dropped = end & ~((long long) DROP_CACHES_CHUNK - 1);
+
+	while(end >= started + DROP_CACHES_CHUNK) {
+		sync_file_range(fd, start_offset + started, DROP_CACHES_CHUNK,
+			SYNC_FILE_RANGE_WRITE);
+
+		if(started > dropped) {
+			sync_file_range(fd, start_offset + dropped, started -
+				dropped, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(fd, start_offset + dropped, started -
+				dropped, POSIX_FADV_DONTNEED);
+			dropped = started;
+		}
+
+		started += DROP_CACHES_CHUNK;
+	}
+#endif
+}
+
+
+/*
+ * With -drop-caches, write back and drop the rest of the output at the
+ * end, which includes the filesystem tables
+ */
+static void drop_output_all()
+{
+#if defined(SYNC_FILE_RANGE_WRITE) && defined(POSIX_FADV_DONTNEED)
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+		SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+
 static void *writer(void *arg)
 {
 	while(1) {
@@ -2389,6 +2710,13 @@ static void *writer(void *arg)
 
 		pthread_cleanup_pop(1);
 
+		if(block_cache)
+			block_cache_add(block_cache, off, file_buffer->size,
+							file_buffer->data);
+
+		if(drop_caches)
+			drop_output(off + file_buffer->size);
+
 		cache_block_put(file_buffer);
 	}
 }
@@ -2418,23 +2746,56 @@ static void *deflator(void *arg)
 {
 	struct file_buffer *write_buffer = cache_get_nohash(bwriter_buffer);
 	void *stream = NULL;
-	int res;
+	char *old_data = NULL;
+	int res, c_byte;
 
 	res = compressor_init(comp, &stream, block_size, 1);
 	if(res)
 		BAD_ERROR("deflator:: compressor_init failed\n");
 
+	if(incremental) {
+		old_data = malloc(block_size);
+		if(old_data == NULL)
+			MEM_ERROR();
+	}
+
 	while(1) {
 		struct file_buffer *file_buffer = queue_get(to_deflate);
 
 		if(sparse_files && all_zero(file_buffer)) { 
 			file_buffer->c_byte = 0;
 			seq_queue_put(to_main, file_buffer);
+			continue;
+		}
+
+		c_byte = incremental_block(file_buffer, write_buffer->data,
+			old_data);
+		if(c_byte == 0)
+			c_byte = compress_block(stream, write_buffer->data,
+				file_buffer->data, file_buffer->size,
+				block_size, file_buffer->noD);
+
+		if(c_byte == 0 && cache_swap(file_buffer, write_buffer)) {
+			/*
+			 * The block is to be stored uncompressed, rather than
+			 * copying it into the writer buffer, swap the buffers
+			 * over and send the read buffer on
+			 */
+			file_buffer->c_byte = file_buffer->size |
+				SQUASHFS_COMPRESSED_BIT_BLOCK;
+			file_buffer->fragment = FALSE;
+			file_buffer->error = FALSE;
+			cache_block_put(write_buffer);
+			seq_queue_put(to_main, file_buffer);
 		} else {
-			write_buffer->c_byte = mangle2(stream,
-				write_buffer->data, file_buffer->data,
-				file_buffer->size, block_size,
-				file_buffer->noD, 1);
+			if(c_byte == 0) {
+				memcpy(write_buffer->data, file_buffer->data,
+					file_buffer->size);
+				c_byte = file_buffer->size |
+					SQUASHFS_COMPRESSED_BIT_BLOCK;
+			}
+
+			write_buffer->c_byte = c_byte;
 			write_buffer->sequence = file_buffer->sequence;
 			write_buffer->file_size = file_buffer->file_size;
 			write_buffer->block = file_buffer->block;
@@ -2444,8 +2805,9 @@ static void *deflator(void *arg)
 			write_buffer->error = FALSE;
 			cache_block_put(file_buffer);
 			seq_queue_put(to_main, write_buffer);
-			write_buffer = cache_get_nohash(bwriter_buffer);
 		}
+
+		write_buffer = cache_get_nohash(bwriter_buffer);
 	}
 }
 
@@ -2517,6 +2879,15 @@ static void *frag_order_deflator(void *arg)
 		write_buffer->sequence = file_buffer->sequence;
 		write_buffer->size = c_byte;
 		write_buffer->fragment = FALSE;
+
+		/*
+		 * The fragment may not be written for some time, and
+		 * get_fragment() needs its size to use the compressed data
+		 */
+		pthread_mutex_lock(&fragment_mutex);
+		fragment_table[file_buffer->block].size = c_byte;
+		pthread_mutex_unlock(&fragment_mutex);
+
 		seq_queue_put(to_order, write_buffer);
 		TRACE("Writing fragment %lld, uncompressed size %d, "
 			"compressed size %d\n", file_buffer->block,
@@ -2535,7 +2906,10 @@ static void *frag_orderer(void *arg)
 		int block = write_buffer->block;
 
 		pthread_mutex_lock(&fragment_mutex);
-		fragment_table[block].size = write_buffer->size;
+		while(fragments_locked || write_buffer->sequence >=
+							fragments_allowed)
+			pthread_cond_wait(&fragment_release, &fragment_mutex);
+
 		fragment_table[block].start_block = bytes;
 		write_buffer->block = bytes;
 		bytes += SQUASHFS_COMPRESSED_SIZE_BLOCK(write_buffer->size);
@@ -2620,10 +2994,7 @@ static struct file_info *write_file_process(int *status, struct dir_ent *dir_ent
 
 	*duplicate_file = FALSE;
 
-	if(reproducible)
-		ensure_fragments_flushed();
-	else
-		lock_fragments();
+	lock_fragments();
 
 	file_bytes = 0;
 	start = bytes;
@@ -2660,8 +3031,7 @@ static struct file_info *write_file_process(int *status, struct dir_ent *dir_ent
 			goto read_err;
 	}
 
-	if(!reproducible)
-		unlock_fragments();
+	unlock_fragments();
 
 	fragment = get_and_fill_fragment(fragment_buffer, dir_ent, block != 0);
 
@@ -2700,8 +3070,7 @@ read_err:
 			BAD_ERROR("Failed to truncate dest file because %s\n",
 				strerror(errno));
 	}
-	if(!reproducible)
-		unlock_fragments();
+	unlock_fragments();
 	free(block_list);
 	cache_block_put(read_buffer);
 	return NULL;
@@ -2711,7 +3080,7 @@ read_err:
 static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_ent,
 	struct file_buffer *read_buffer, int *duplicate_file, int bl_hash)
 {
-	int block, thresh;
+	int block, thresh, candidates = 0, written = FALSE;
 	long long read_size = read_buffer->file_size;
 	long long file_bytes, start;
 	int blocks = (read_size + block_size - 1) >> block_log;
@@ -2719,8 +3088,9 @@ static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_
 	struct file_buffer **buffer_list;
 	long long sparse = 0;
 	struct file_buffer *fragment_buffer = NULL;
-	struct file_info *file;
-	int block_dup;
+	struct file_info *file, *dupl_ptr;
+	struct dup_candidate *candidate = NULL;
+	int block_dup, i, j;
 
 	block_list = malloc(blocks * sizeof(unsigned int));
 	if(block_list == NULL)
@@ -2730,10 +3100,31 @@ static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_
 	if(buffer_list == NULL)
 		MEM_ERROR();
 
-	if(reproducible)
-		ensure_fragments_flushed();
-	else
-		lock_fragments();
+	/*
+	 * Get the files which may have the same block list.  These are
+	 * compared block by block as the file is read, and once none match
+	 * the blocks held back from the writer can be released to it
+	 */
+	for(dupl_ptr = dupl_block[bl_hash]; dupl_ptr; dupl_ptr = dupl_ptr->block_next)
+		if(dupl_ptr->blocks <= blocks && dupl_ptr->block_list[0] ==
+							read_buffer->c_byte)
+			candidates ++;
+
+	if(candidates) {
+		candidate = malloc(candidates * sizeof(struct dup_candidate));
+		if(candidate == NULL)
+			MEM_ERROR();
+
+		candidates = 0;
+		for(dupl_ptr = dupl_block[bl_hash]; dupl_ptr; dupl_ptr = dupl_ptr->block_next)
+			if(dupl_ptr->blocks <= blocks && dupl_ptr->block_list[0]
+						== read_buffer->c_byte) {
+				candidate[candidates].file = dupl_ptr;
+				candidate[candidates++].start = dupl_ptr->start;
+			}
+	}
+
+	lock_fragments();
 
 	file_bytes = 0;
 	start = bytes;
@@ -2746,16 +3137,56 @@ static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_
 			fragment_buffer = read_buffer;
 			blocks = read_size >> block_log;
 		} else {
+			unsigned short checksum = 0;
+
 			block_list[block] = read_buffer->c_byte;
 
+			if(candidates && read_buffer->c_byte)
+				checksum = get_checksum_mem(read_buffer->data,
+							read_buffer->size);
+
+			for(i = j = 0; i < candidates; i++) {
+				long long dup_start = candidate[i].start;
+
+				dupl_ptr = candidate[i].file;
+
+				if(block >= dupl_ptr->blocks ||
+						dupl_ptr->block_list[block] !=
+						read_buffer->c_byte ||
+						get_block_checksum(dupl_ptr,
+						block, dup_start) != checksum)
+					continue;
+
+				candidate[j].file = dupl_ptr;
+				candidate[j++].start = dup_start +
+					SQUASHFS_COMPRESSED_SIZE_BLOCK(
+					read_buffer->c_byte);
+			}
+
+			if(candidates && j == 0) {
+				/*
+				 * Nothing matches any more, this file isn't
+				 * a duplicate of another's block list, and
+				 * so stop holding blocks back from the writer
+				 */
+				for(i = thresh; i < block; i++)
+					if(buffer_list[i]) {
+						queue_put(to_writer, buffer_list[i]);
+						buffer_list[i] = NULL;
+						written = TRUE;
+					}
+			}
+			candidates = j;
+
 			if(read_buffer->c_byte) {
 				read_buffer->block = bytes;
 				bytes += read_buffer->size;
 				file_bytes += read_buffer->size;
 				cache_hash(read_buffer, read_buffer->block);
-				if(block < thresh) {
+				if(block < thresh || candidates == 0) {
 					buffer_list[block] = NULL;
 					queue_put(to_writer, read_buffer);
+					written = TRUE;
 				} else
 					buffer_list[block] = read_buffer;
 			} else {
@@ -2785,7 +3216,8 @@ static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_
 		sparse = 0;
 
 	file = duplicate(duplicate_file, &block_dup, read_size, file_bytes, block_list,
-		start, dir_ent, fragment_buffer, blocks, sparse, bl_hash);
+		start, dir_ent, fragment_buffer, blocks, sparse, bl_hash,
+		candidates != 0);
 
 	if(block_dup == FALSE) {
 		for(block = thresh; block < blocks; block ++)
@@ -2795,7 +3227,7 @@ static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_
 		for(block = thresh; block < blocks; block ++)
 			cache_block_put(buffer_list[block]);
 		bytes = start;
-		if(thresh && !block_device) {
+		if(written && !block_device) {
 			int res;
 
 			queue_put(to_writer, NULL);
@@ -2808,10 +3240,10 @@ static struct file_info *write_file_blocks_dup(int *status, struct dir_ent *dir_
 		}
 	}
 
-	if(!reproducible)
-		unlock_fragments();
+	unlock_fragments();
 	cache_block_put(fragment_buffer);
 	free(buffer_list);
+	free(candidate);
 	file_count ++;
 	total_bytes += read_size;
 
@@ -2827,7 +3259,7 @@ read_err:
 	dec_progress_bar(block);
 	*status = read_buffer->error;
 	bytes = start;
-	if(thresh && !block_device) {
+	if(written && !block_device) {
 		int res;
 
 		queue_put(to_writer, NULL);
@@ -2838,12 +3270,12 @@ read_err:
 			BAD_ERROR("Failed to truncate dest file because %s\n",
 				strerror(errno));
 	}
-	if(!reproducible)
-		unlock_fragments();
+	unlock_fragments();
 	for(blocks = thresh; blocks < block; blocks ++)
 		cache_block_put(buffer_list[blocks]);
 	free(buffer_list);
 	free(block_list);
+	free(candidate);
 	cache_block_put(read_buffer);
 	return NULL;
 }
@@ -2872,10 +3304,7 @@ static struct file_info *write_file_blocks(int *status, struct dir_ent *dir_ent,
 	if(block_list == NULL)
 		MEM_ERROR();
 
-	if(reproducible)
-		ensure_fragments_flushed();
-	else
-		lock_fragments();
+	lock_fragments();
 
 	file_bytes = 0;
 	start = bytes;
@@ -2917,8 +3346,7 @@ static struct file_info *write_file_blocks(int *status, struct dir_ent *dir_ent,
 	if(sparse && (dir_ent->inode->buf.st_blocks << 9) >= read_size)
 		sparse = 0;
 
-	if(!reproducible)
-		unlock_fragments();
+	unlock_fragments();
 
 	fragment = get_and_fill_fragment(fragment_buffer, dir_ent, TRUE);
 
@@ -2954,8 +3382,7 @@ read_err:
 			BAD_ERROR("Failed to truncate dest file because %s\n",
 				strerror(errno));
 	}
-	if(!reproducible)
-		unlock_fragments();
+	unlock_fragments();
 	free(block_list);
 	cache_block_put(read_buffer);
 	return NULL;
@@ -3082,8 +3509,8 @@ static inline void dec_nlink_inode(struct dir_ent *dir_ent)
 		/* Delete this inode, as the last or only reference
 		 * to it is going away */
 		struct stat *buf = &dir_ent->inode->buf;
-		int ino_hash = INODE_HASH(buf->st_dev, buf->st_ino);
-		struct inode_info *inode = inode_info[ino_hash];
+		struct inode_info *inode = inode_hash_lookup(inode_info,
+			buf->st_dev, buf->st_ino);
 		struct inode_info *prev = NULL;
 
 		while(inode && inode != dir_ent->inode) {
@@ -3095,7 +3522,8 @@ static inline void dec_nlink_inode(struct dir_ent *dir_ent)
 			if(prev)
 				prev->next = inode->next;
 			else
-				inode_info[ino_hash] = inode->next;
+				inode_hash_set(inode_info, buf->st_dev,
+					buf->st_ino, inode->next);
 		}
 
 		/* Decrement the progress bar */
@@ -3110,10 +3538,18 @@ static inline void dec_nlink_inode(struct dir_ent *dir_ent)
 }
 
 
+void add_inode_hash(struct inode_info *inode)
+{
+	struct stat *buf = &inode->buf;
+
+	inode->next = inode_hash_lookup(inode_info, buf->st_dev, buf->st_ino);
+	inode_hash_set(inode_info, buf->st_dev, buf->st_ino, inode);
+}
+
+
 static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pseudo,
 	char *symlink, int bytes)
 {
-	int ino_hash = INODE_HASH(buf->st_dev, buf->st_ino);
 	struct inode_info *inode;
 
 	/*
@@ -3123,7 +3559,8 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 	 * allow hard-links to directories.
 	 */
 	if ((buf->st_mode & S_IFMT) != S_IFDIR && !no_hardlinks) {
-		for(inode = inode_info[ino_hash]; inode; inode = inode->next) {
+		for(inode = inode_hash_lookup(inode_info, buf->st_dev,
+				buf->st_ino); inode; inode = inode->next) {
 			if(memcmp(buf, &inode->buf, sizeof(struct stat)) == 0) {
 				inode->nlink ++;
 				return inode;
@@ -3143,6 +3580,8 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 		memcpy(&inode->symlink, symlink, bytes);
 	memcpy(&inode->buf, buf, sizeof(struct stat));
 	inode->read = FALSE;
+	inode->written = FALSE;
+	inode->incremental = NULL;
 	inode->root_entry = FALSE;
 	inode->pseudo = pseudo;
 	inode->inode = SQUASHFS_INVALID_BLK;
@@ -3162,8 +3601,7 @@ static struct inode_info *lookup_inode3(struct stat *buf, struct pseudo_dev *pse
 	inode->noD = noD;
 	inode->noF = noF;
 
-	inode->next = inode_info[ino_hash];
-	inode_info[ino_hash] = inode;
+	add_inode_hash(inode);
 
 	return inode;
 }
@@ -3203,6 +3641,8 @@ struct dir_info *create_dir(char *pathname, char *subpath, int depth)
 	dir->directory_count = 0;
 	dir->dir_is_ldir = TRUE;
 	dir->list = NULL;
+	dir->hash_table = NULL;
+	dir->hash_size = 0;
 	dir->depth = depth;
 	dir->excluded = 0;
 
@@ -3210,11 +3650,83 @@ struct dir_info *create_dir(char *pathname, char *subpath, int depth)
 }
 
 
+static inline unsigned int name_hash(char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	/* FNV-1a */
+	for(; *name; name ++)
+		hash = (hash ^ (unsigned char) *name) * 16777619U;
+
+	return hash;
+}
+
+
+static inline void dir_hash_insert(struct dir_info *dir,
+	struct dir_ent *dir_ent)
+{
+	unsigned int hash = name_hash(dir_ent->name) & (dir->hash_size - 1);
+
+	dir_ent->hash_next = dir->hash_table[hash];
+	dir->hash_table[hash] = dir_ent;
+}
+
+
+/*
+ * (Re)build the name hash index for a directory.  The table size is
+ * kept at a power of two no smaller than twice the number of entries,
+ * giving an average chain length below one
+ */
+static void build_dir_hash(struct dir_info *dir)
+{
+	struct dir_ent *dir_ent;
+	unsigned int size = DIR_HASH_MIN;
+
+	while(size < dir->count * 2)
+		size <<= 1;
+
+	free(dir->hash_table);
+	dir->hash_table = calloc(size, sizeof(struct dir_ent *));
+	if(dir->hash_table == NULL)
+		MEM_ERROR();
+
+	dir->hash_size = size;
+
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next)
+		dir_hash_insert(dir, dir_ent);
+}
+
+
+/*
+ * Discard the name hash index for a directory.  This must be called
+ * whenever entries are removed from, or renamed in, the directory
+ * list by anything other than add_dir_entry().  The index will be
+ * rebuilt by the next lookup_name() if needed
+ */
+void free_dir_hash(struct dir_info *dir)
+{
+	free(dir->hash_table);
+	dir->hash_table = NULL;
+	dir->hash_size = 0;
+}
+
+
 struct dir_ent *lookup_name(struct dir_info *dir, char *name)
 {
-	struct dir_ent *dir_ent = dir->list;
+	struct dir_ent *dir_ent;
 
-	for(; dir_ent && strcmp(dir_ent->name, name) != 0;
+	if(dir->hash_table == NULL && dir->count >= DIR_HASH_MIN)
+		build_dir_hash(dir);
+
+	if(dir->hash_table) {
+		dir_ent = dir->hash_table[name_hash(name) &
+						(dir->hash_size - 1)];
+
+		for(; dir_ent && strcmp(dir_ent->name, name) != 0;
+					dir_ent = dir_ent->hash_next);
+	} else
+		for(dir_ent = dir->list; dir_ent &&
+					strcmp(dir_ent->name, name) != 0;
 					dir_ent = dir_ent->next);
 
 	return dir_ent;
@@ -3234,6 +3746,7 @@ struct dir_ent *create_dir_entry(char *name, char *source_name,
 	dir_ent->our_dir = dir;
 	dir_ent->inode = NULL;
 	dir_ent->next = NULL;
+	dir_ent->hash_next = NULL;
 
 	return dir_ent;
 }
@@ -3252,6 +3765,13 @@ void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
 	dir_ent->next = dir->list;
 	dir->list = dir_ent;
 	dir->count++;
+
+	if(dir->hash_table) {
+		if(dir->count > dir->hash_size)
+			build_dir_hash(dir);
+		else
+			dir_hash_insert(dir, dir_ent);
+	}
 }
 
 
@@ -3295,6 +3815,7 @@ static inline void add_excluded(struct dir_info *dir)
 squashfs_inode do_directory_scans(struct dir_ent *dir_ent, int progress)
 {
 	squashfs_inode inode;
+	struct metadata_scan scan;
 	struct pseudo *pseudo = get_pseudo();
 
 	/*
@@ -3360,13 +3881,25 @@ squashfs_inode do_directory_scans(struct dir_ent *dir_ent, int progress)
 		write_destination(fd, SQUASHFS_START, 4, "\0\0\0\0");
 	}
 
+	if(incremental)
+		incremental_mark(root_dir);
+
 	if(!tarfile)
 		queue_put(to_reader, root_dir);
 
 	if(sorted)
 		sort_files_and_write(root_dir);
 
-	dir_scan7(&inode, root_dir);
+	/*
+	 * Write the files here, while the metadata thread builds the inode
+	 * and directory tables from the results
+	 */
+	scan.dir_info = root_dir;
+	queue_put(to_metadata, &scan);
+	dir_scan7_files(root_dir);
+	queue_get(from_metadata);
+
+	inode = scan.inode;
 	dir_ent->inode->inode = inode;
 	dir_ent->inode->type = SQUASHFS_DIR_TYPE;
 
@@ -3499,6 +4032,8 @@ struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth)
 	dir->directory_count = 0;
 	dir->dir_is_ldir = TRUE;
 	dir->list = NULL;
+	dir->hash_table = NULL;
+	dir->hash_size = 0;
 	dir->depth = depth;
 	dir->excluded = 0;
 
@@ -3920,6 +4455,7 @@ void free_dir(struct dir_info *dir)
 		free_dir_entry(tmp);
 	}
 
+	free_dir_hash(dir);
 	free(dir->pathname);
 	free(dir->subpath);
 	free(dir);
@@ -3957,6 +4493,7 @@ static void dir_scan4(struct dir_info *dir, int symlink)
 			dir->count --;
 
 			/* remove dir_ent from list */
+			free_dir_hash(dir);
 			dir_ent = dir_ent->next;
 			if(prev)
 				prev->next = dir_ent;
@@ -4003,11 +4540,13 @@ static void dir_scan5(struct dir_info *dir)
 				 * delete sub-directory, this is by definition
 				 * empty
 				 */
+				free_dir_hash(dir_ent->dir);
 				free(dir_ent->dir->pathname);
 				free(dir_ent->dir->subpath);
 				free(dir_ent->dir);
 
 				/* remove dir_ent from list */
+				free_dir_hash(dir);
 				dir_ent = dir_ent->next;
 				if(prev)
 					prev->next = dir_ent;
@@ -4196,7 +4735,6 @@ static void scan7_freedir(struct directory *dir)
 static void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 {
 	int squashfs_type;
-	int duplicate_file;
 	struct directory dir;
 	struct dir_ent *dir_ent = NULL;
 	struct file_info *file;
@@ -4206,22 +4744,13 @@ static void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 	while((dir_ent = scan7_readdir(&dir, dir_info, dir_ent)) != NULL) {
 		struct stat *buf = &dir_ent->inode->buf;
 
-		update_info(dir_ent);
-
 		if(dir_ent->inode->inode == SQUASHFS_INVALID_BLK) {
 			switch(buf->st_mode & S_IFMT) {
 				case S_IFREG:
 					if(dir_ent->inode->tarfile && dir_ent->inode->tar_file->file)
 						file = dir_ent->inode->tar_file->file;
-					else {
-						file = write_file(dir_ent, &duplicate_file);
-						INFO("file %s, uncompressed size %lld "
-							"bytes %s\n",
-							subpathname(dir_ent),
-							(long long) buf->st_size,
-							duplicate_file ?  "DUPLICATE" :
-							 "");
-					}
+					else
+						file = queue_get(to_metadata);
 					squashfs_type = SQUASHFS_FILE_TYPE;
 					*inode = create_inode(NULL, dir_ent,
 						squashfs_type, file->file_size,
@@ -4353,6 +4882,68 @@ static void dir_scan7(squashfs_inode *inode, struct dir_info *dir_info)
 }
 
 
+/*
+ * Write the files in the order dir_scan7() creates their inodes, and pass
+ * the results to the metadata thread.  Files already written (hard links,
+ * sorted files), and tar files (written when the tar file was read) are
+ * skipped, as dir_scan7() doesn't wait for them
+ */
+static void dir_scan7_files(struct dir_info *dir_info)
+{
+	struct dir_ent *dir_ent;
+
+	for(dir_ent = dir_info->list; dir_ent; dir_ent = dir_ent->next) {
+		struct inode_info *inode = dir_ent->inode;
+		struct stat *buf = &inode->buf;
+		struct file_info *file;
+		int duplicate_file;
+
+		if(inode->root_entry)
+			continue;
+
+		update_info(dir_ent);
+
+		if(inode->written)
+			continue;
+
+		inode->written = TRUE;
+
+		switch(buf->st_mode & S_IFMT) {
+		case S_IFREG:
+			if(inode->tarfile && inode->tar_file->file)
+				break;
+
+			file = write_file(dir_ent, &duplicate_file);
+			INFO("file %s, uncompressed size %lld bytes %s\n",
+				subpathname(dir_ent), (long long) buf->st_size,
+				duplicate_file ?  "DUPLICATE" : "");
+			queue_put(to_metadata, file);
+			break;
+		case S_IFDIR:
+			dir_scan7_files(dir_ent->dir);
+			break;
+		}
+	}
+}
+
+
+/*
+ * The metadata thread builds the inode and directory tables, taking the
+ * written files from the main thread as it needs them
+ */
+static void *metadata_builder(void *arg)
+{
+	struct metadata_scan *scan;
+
+	while((scan = queue_get(to_metadata)) != NULL) {
+		dir_scan7(&scan->inode, scan->dir_info);
+		queue_put(from_metadata, scan);
+	}
+
+	return NULL;
+}
+
+
 static void handle_root_entries(struct dir_info *dir)
 {
 	int i;
@@ -4961,7 +5552,7 @@ static void add_old_root_entry(char *name, squashfs_inode inode,
 static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	int freelst, char *destination_file)
 {
-	int i;
+	int i, mem;
 	sigset_t sigmask, old_mask;
 	int total_mem = readq;
 	int reader_size;
@@ -4989,7 +5580,35 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 		BAD_ERROR("Queue sizes rediculously too large\n");
 	total_mem += fwriteq;
 
-	check_usable_phys_mem(total_mem);
+	/*
+	 * The written block cache is only used by duplicate checking, and
+	 * unless set by the user, is sized in proportion to the queues
+	 */
+	if(!duplicate_checking)
+		dup_cache_size = 0;
+	else if(dup_cache_size == -1)
+		dup_cache_size = total_mem / SQUASHFS_DUPQ_MEM;
+	if(add_overflow(total_mem, dup_cache_size))
+		BAD_ERROR("Queue sizes rediculously too large\n");
+	total_mem += dup_cache_size;
+
+	mem = check_usable_phys_mem(total_mem);
+	if(mem < total_mem) {
+		/* shrink the queues in proportion to fit */
+		readq = readq * (long long) mem / total_mem;
+		fragq = fragq * (long long) mem / total_mem;
+		bwriteq = bwriteq * (long long) mem / total_mem;
+		fwriteq = fwriteq * (long long) mem / total_mem;
+		dup_cache_size = dup_cache_size * (long long) mem / total_mem;
+		if(readq == 0)
+			readq = 1;
+		if(fragq == 0)
+			fragq = 1;
+		if(bwriteq == 0)
+			bwriteq = 1;
+		if(fwriteq == 0)
+			fwriteq = 1;
+	}
 
 	/*
 	 * convert from queue size in Mbytes to queue size in
@@ -5003,6 +5622,13 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	bwriter_size = bwriteq << (20 - block_log);
 	fwriter_size = fwriteq << (20 - block_log);
 
+	/*
+	 * reproducible images hold back SQUASHFS_FRAGMENT_BACKLOG fragments,
+	 * make sure the fragment deflators can always get a buffer
+	 */
+	if(reproducible && fwriter_size < SQUASHFS_FRAGMENT_BACKLOG * 2)
+		fwriter_size = SQUASHFS_FRAGMENT_BACKLOG * 2;
+
 	/*
 	 * setup signal handlers for the main thread, these cleanup
 	 * deleting the destination file, if appending the
@@ -5055,7 +5681,10 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 			processors = 1;
 		}
 #else
-		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		if(worker_cpus)
+			processors = cpu_list_count(worker_cpus);
+		else
+			processors = available_processors();
 #endif
 	}
 
@@ -5075,6 +5704,8 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	to_process_frag = queue_init(reader_size);
 	to_writer = queue_init(bwriter_size + fwriter_size);
 	from_writer = queue_init(1);
+	to_metadata = queue_init(METADATA_QUEUE_SIZE);
+	from_metadata = queue_init(1);
 	to_frag = queue_init(fragment_size);
 	to_main = seq_queue_init();
 	if(reproducible)
@@ -5082,12 +5713,25 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 	else
 		locked_fragment = queue_init(fragment_size);
 	reader_buffer = cache_init(block_size, reader_size, 0, 0);
+	if(dup_cache_size)
+		block_cache = block_cache_init((long long) dup_cache_size << 20);
+	if(direct_io)
+		cache_align(reader_buffer);
 	bwriter_buffer = cache_init(block_size, bwriter_size, 1, freelst);
 	fwriter_buffer = cache_init(block_size, fwriter_size, 1, freelst);
 	fragment_buffer = cache_init(block_size, fragment_size, 1, 0);
 	reserve_cache = cache_init(block_size, processors + 1, 1, 0);
 	pthread_create(&reader_thread, NULL, reader, NULL);
 	pthread_create(&writer_thread, NULL, writer, NULL);
+	if(!set_thread_cpus(reader_thread, io_cpus) ||
+				!set_thread_cpus(writer_thread, io_cpus))
+		BAD_ERROR("Failed to set the processors of the reader and "
+			"writer threads\n");
+	if(pthread_create(&metadata_thread, NULL, metadata_builder, NULL))
+		BAD_ERROR("Failed to create thread\n");
+	if(!set_thread_cpus(metadata_thread, worker_cpus))
+		BAD_ERROR("Failed to set the processors of the metadata "
+			"thread\n");
 	init_progress_bar();
 	init_info();
 
@@ -5100,12 +5744,22 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 		if(pthread_create(&frag_thread[i], NULL, frag_thrd,
 				(void *) destination_file) != 0)
 			BAD_ERROR("Failed to create thread\n");
+		if(!set_thread_cpus(deflator_thread[i], worker_cpus) ||
+				!set_thread_cpus(frag_deflator_thread[i],
+				worker_cpus) || !set_thread_cpus(frag_thread[i],
+				worker_cpus))
+			BAD_ERROR("Failed to set the processors of the "
+				"compressor threads\n");
 	}
 
 	main_thread = pthread_self();
 
-	if(reproducible)
+	if(reproducible) {
 		pthread_create(&order_thread, NULL, frag_orderer, NULL);
+		if(!set_thread_cpus(order_thread, worker_cpus))
+			BAD_ERROR("Failed to set the processors of the "
+				"fragment orderer thread\n");
+	}
 
 	if(!quiet)
 		printf("Parallel mksquashfs: Using %d processor%s\n", processors,
@@ -5119,8 +5773,10 @@ static void initialise_threads(int readq, int fragq, int bwriteq, int fwriteq,
 
 static long long write_inode_lookup_table()
 {
-	int i, lookup_bytes = SQUASHFS_LOOKUP_BYTES(inode_count);
+	int lookup_bytes = SQUASHFS_LOOKUP_BYTES(inode_count);
+	unsigned long long i = 0;
 	unsigned int inode_number;
+	struct inode_info *list;
 	void *it;
 
 	if(inode_count == sinode_count)
@@ -5131,10 +5787,10 @@ static long long write_inode_lookup_table()
 		MEM_ERROR();
 	inode_lookup_table = it;
 
-	for(i = 0; i < INODE_HASH_SIZE; i ++) {
+	while((list = inode_hash_next(inode_info, &i)) != NULL) {
 		struct inode_info *inode;
 
-		for(inode = inode_info[i]; inode; inode = inode->next) {
+		for(inode = list; inode; inode = inode->next) {
 
 			inode_number = get_inode_no(inode);
 
@@ -5565,6 +6221,183 @@ static void read_recovery_data(char *recovery_file, char *destination_file)
 }
 
 
+static void path_index_flush()
+{
+	unsigned short c_byte;
+	char cbuffer[(SQUASHFS_METADATA_SIZE << 2) + 2];
+	int compressed_size;
+
+	c_byte = mangle(cbuffer + BLOCK_OFFSET, pindex_buff, pindex_bytes,
+		SQUASHFS_METADATA_SIZE, noI, 0);
+	SQUASHFS_SWAP_SHORTS(&c_byte, cbuffer, 1);
+	compressed_size = SQUASHFS_COMPRESSED_SIZE(c_byte) + BLOCK_OFFSET;
+	write_destination(fd, bytes, compressed_size, cbuffer);
+	bytes += compressed_size;
+	pindex_bytes = 0;
+	pindex_blocks ++;
+}
+
+
+static int path_index_add(char *path, int len, struct inode_info *inode)
+{
+	struct squashfs_path_index_entry entry;
+	struct squashfs_path_index index;
+	int shared = 0;
+
+	if(len > SQUASHFS_METADATA_SIZE - (int) sizeof(entry)) {
+		ERROR("Pathname %s too long for the path index\n", path);
+		return FALSE;
+	}
+
+	if(pindex_last && path_index_compare(pindex_last, pindex_last_len,
+						path, len) >= 0) {
+		ERROR("Directory %s isn't sorted in path index order\n", path);
+		return FALSE;
+	}
+
+	if(pindex_bytes) {
+		int max = len < pindex_last_len ? len : pindex_last_len;
+
+		if(max > 65535)
+			max = 65535;
+		for(; shared < max && path[shared] == pindex_last[shared];
+								shared++);
+
+		if(pindex_bytes + sizeof(entry) + len - shared >
+						SQUASHFS_METADATA_SIZE) {
+			path_index_flush();
+			shared = 0;
+		}
+	}
+
+	if(pindex_bytes == 0) {
+		/* first entry in the block, add it to the block index */
+		if(pindex_index_bytes + sizeof(index) + len >
+							pindex_index_size) {
+			pindex_index_size = (pindex_index_size + len +
+				sizeof(index)) << 1;
+			pindex_index = realloc(pindex_index,
+							pindex_index_size);
+			if(pindex_index == NULL)
+				MEM_ERROR();
+		}
+
+		index.start_block = bytes - pindex_start;
+		index.size = len - 1;
+		SQUASHFS_SWAP_PATH_INDEX(&index, pindex_index +
+							pindex_index_bytes);
+		memcpy(pindex_index + pindex_index_bytes + sizeof(index),
+			path, len);
+		pindex_index_bytes += sizeof(index) + len;
+	}
+
+	entry.start_block = SQUASHFS_INODE_BLK(inode->inode);
+	entry.offset = SQUASHFS_INODE_OFFSET(inode->inode);
+	entry.type = inode->type;
+	entry.shared = shared;
+	entry.size = len - shared - 1;
+	SQUASHFS_SWAP_PATH_INDEX_ENTRY(&entry, pindex_buff + pindex_bytes);
+	memcpy(pindex_buff + pindex_bytes + sizeof(entry), path + shared,
+								len - shared);
+	pindex_bytes += sizeof(entry) + len - shared;
+
+	if(len > pindex_last_size) {
+		pindex_last_size = len;
+		pindex_last = realloc(pindex_last, len);
+		if(pindex_last == NULL)
+			MEM_ERROR();
+	}
+	memcpy(pindex_last, path, len);
+	pindex_last_len = len;
+	pindex_entries ++;
+
+	return TRUE;
+}
+
+
+static int path_index_scan(struct dir_info *dir, char **path, int *size,
+	int len)
+{
+	struct dir_ent *dir_ent;
+
+	for(dir_ent = dir->list; dir_ent; dir_ent = dir_ent->next) {
+		int name_len = strlen(dir_ent->name);
+
+		if(len + name_len + 2 > *size) {
+			*size = (len + name_len + 2) << 1;
+			*path = realloc(*path, *size);
+			if(*path == NULL)
+				MEM_ERROR();
+		}
+
+		(*path)[len] = '/';
+		memcpy(*path + len + 1, dir_ent->name, name_len + 1);
+
+		if(!path_index_add(*path, len + name_len + 1, dir_ent->inode))
+			return FALSE;
+
+		if(dir_ent->inode->type == SQUASHFS_DIR_TYPE && dir_ent->dir &&
+				!path_index_scan(dir_ent->dir, path, size,
+							len + name_len + 1))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Write the path index after the filesystem tables.  The index isn't
+ * part of the filesystem (it is beyond bytes_used), and so if it can't be
+ * written it is dropped, leaving a valid filesystem without an index.
+ */
+static void write_path_index(squashfs_inode root_inode)
+{
+	struct squashfs_path_index_header header, sheader;
+	char *path = NULL;
+	int size = 0, res;
+
+	pindex_buff = malloc(SQUASHFS_METADATA_SIZE);
+	if(pindex_buff == NULL)
+		MEM_ERROR();
+
+	/* write a zeroed header, which is filled in once the index is done */
+	memset(&header, 0, sizeof(header));
+	pindex_start = bytes;
+	write_destination(fd, bytes, sizeof(header), &header);
+	bytes += sizeof(header);
+
+	res = path_index_scan(root_dir, &path, &size, 0);
+	if(res == FALSE) {
+		ERROR("Path index not written\n");
+		bytes = pindex_start;
+		goto failed;
+	}
+
+	if(pindex_bytes)
+		path_index_flush();
+
+	header.magic = SQUASHFS_PATH_INDEX_MAGIC;
+	header.entries = pindex_entries;
+	header.blocks = pindex_blocks;
+	header.index_bytes = pindex_index_bytes;
+	header.index_start = bytes;
+	header.root_inode = root_inode;
+
+	write_destination(fd, bytes, pindex_index_bytes, pindex_index);
+	bytes += pindex_index_bytes;
+
+	SQUASHFS_SWAP_PATH_INDEX_HEADER(&header, &sheader);
+	write_destination(fd, pindex_start, sizeof(sheader), &sheader);
+
+failed:
+	free(path);
+	free(pindex_buff);
+	free(pindex_last);
+	free(pindex_index);
+}
+
+
 static void write_filesystem_tables(struct squashfs_super_block *sBlk)
 {
 	sBlk->fragments = fragments;
@@ -5587,6 +6420,9 @@ static void write_filesystem_tables(struct squashfs_super_block *sBlk)
 
 	sBlk->bytes_used = bytes;
 
+	if(path_index)
+		write_path_index(sBlk->root_inode);
+
 	sBlk->compression = comp->id;
 
 	SQUASHFS_INSWAP_SUPER_BLOCK(sBlk); 
@@ -5781,7 +6617,23 @@ static int get_physical_memory()
 }
 
 
-static void check_usable_phys_mem(int total_mem)
+/*
+ * Return the memory limit in Mbytes of the cgroup Mksquashfs is running in,
+ * or 0 if there isn't one
+ */
+static int get_cgroup_memory()
+{
+	long long limit = memory_limit();
+
+	if(limit == -1)
+		return 0;
+
+	limit >>= 20;
+	return limit > INT_MAX ? INT_MAX : limit ? limit : 1;
+}
+
+
+static int check_usable_phys_mem(int total_mem)
 {
 	/*
 	 * We want to allow users to use as much of their physical
@@ -5823,6 +6675,34 @@ static void check_usable_phys_mem(int total_mem)
 				"addressable memory by this process\n");
 		BAD_ERROR("Requested memory size too large\n");
 	}
+
+	/*
+	 * Exceeding a cgroup memory limit gets Mksquashfs killed, rather
+	 * than causing thrashing, so shrink the caches to fit instead.
+	 *
+	 * Budget the caches against 75% of the limit, less the duplicate
+	 * checking hash tables, leaving the rest for the inode, directory
+	 * and other tables, which grow with the size of the filesystem
+	 */
+	mem = get_cgroup_memory();
+	if(mem) {
+		mem = (mem >> 1) + (mem >> 2) - (int) ((1048576 +
+			SQUASHFS_FILE_MAX_SIZE) * sizeof(struct file_info *)
+			>> 20);
+		if(mem < SQUASHFS_LOWMEM / SQUASHFS_TAKE)
+			mem = SQUASHFS_LOWMEM / SQUASHFS_TAKE;
+
+		if(total_mem > mem) {
+			ERROR("Warning: Total memory requested (%dM) is more "
+				"than the cgroup memory limit allows.\n",
+				total_mem);
+			ERROR("Warning: Reducing the memory used to %dM.\n",
+				mem);
+			return mem;
+		}
+	}
+
+	return total_mem;
 }
 
 
@@ -5834,9 +6714,14 @@ static int get_default_phys_mem()
 	 * SQUASHFS_LOWMEM / SQUASHFS_TAKE as default,
 	 * and allow a larger value to be set with -mem.
 	 */
-	int mem = get_physical_memory();
-
-	if(mem == 0) {
+	int mem = get_physical_memory(), limit = get_cgroup_memory();
+
+	if(limit && (mem == 0 || limit < mem)) {
+		/* in a cgroup with a lower memory limit */
+		mem = limit / SQUASHFS_TAKE;
+		if(mem < SQUASHFS_LOWMEM / SQUASHFS_TAKE)
+			mem = SQUASHFS_LOWMEM / SQUASHFS_TAKE;
+	} else if(mem == 0) {
 		mem = SQUASHFS_LOWMEM / SQUASHFS_TAKE;
 
 		ERROR("Warning: Cannot get size of physical memory, probably "
@@ -5943,6 +6828,9 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "unsigned int\n");
 	fprintf(stream, "-no-exports\t\tdon't make filesystem exportable via NFS (-tar default)\n");
 	fprintf(stream, "-exports\t\tmake filesystem exportable via NFS (default)\n");
+	fprintf(stream, "-path-index\t\tadd an index of pathnames after the filesystem, which\n");
+	fprintf(stream, "\t\t\tallows Unsquashfs to list and look up paths without\n");
+	fprintf(stream, "\t\t\treading the whole directory table\n");
 	fprintf(stream, "-no-sparse\t\tdon't detect sparse files\n");
 	fprintf(stream, "-no-xattrs\t\tdon't store extended attributes" NOXOPT_STR "\n");
 	fprintf(stream, "-xattrs\t\t\tstore extended attributes" XOPT_STR "\n");
@@ -5959,6 +6847,10 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "than block size\n");
 	fprintf(stream, "-no-duplicates\t\tdo not perform duplicate checking\n");
 	fprintf(stream, "-no-hardlinks\t\tdo not hardlink files, instead store duplicates\n");
+	fprintf(stream, "-incremental <image>\tcopy the compressed blocks of files in ");
+	fprintf(stream, "<image> with the\n\t\t\tsame path, size and mtime, if their ");
+	fprintf(stream, "contents are\n\t\t\tunchanged, rather than compressing them ");
+	fprintf(stream, "again\n");
 	fprintf(stream, "-all-root\t\tmake all files owned by root\n");
 	fprintf(stream, "-root-time <time>\tset root directory time to <time>\n");
 	fprintf(stream, "-root-mode <mode>\tset root directory permissions to octal ");
@@ -6046,12 +6938,28 @@ static void print_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-limit <percentage>\tlimit the I/O input rate to the given ");
 	fprintf(stream, "percentage.\n\t\t\tThis can be used to reduce the I/O and CPU ");
 	fprintf(stream, "consumption\n\t\t\tof Mksquashfs (alternative to -throttle)\n");
+	fprintf(stream, "-drop-caches\t\tdrop source files and the output from the page ");
+	fprintf(stream, "cache\n\t\t\tonce they've been read and written, rather ");
+	fprintf(stream, "than\n\t\t\tevicting other cached data\n");
+	fprintf(stream, "-direct-io\t\tread source files with O_DIRECT, bypassing ");
+	fprintf(stream, "the page\n\t\t\tcache\n");
+	fprintf(stream, "-noatime\t\tdon't update the access time of source files\n");
 	fprintf(stream, "-processors <number>\tUse <number> processors.  By default ");
 	fprintf(stream, "will use number of\n\t\t\tprocessors available\n");
+	fprintf(stream, "-cpu-set <cpus>\t\tRun the compressor threads on <cpus>, a list ");
+	fprintf(stream, "such as\n\t\t\t0-3,8, or node:<n> for the processors of NUMA ");
+	fprintf(stream, "node <n>.\n\t\t\tBy default the number of processors used ");
+	fprintf(stream, "is the number\n\t\t\tin <cpus>\n");
+	fprintf(stream, "-io-cpu-set <cpus>\tRun the reader and writer threads on ");
+	fprintf(stream, "<cpus>, e.g. the\n\t\t\tNUMA node of the output device\n");
 	fprintf(stream, "-mem <size>\t\tUse <size> physical memory.  Currently set ");
 	fprintf(stream, "to %dM\n", total_mem);
 	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
 	fprintf(stream, "specify\n\t\t\tKbytes, Mbytes or Gbytes respectively\n");
+	fprintf(stream, "-dup-cache <size>\tCache <size> Mbytes of written blocks, ");
+	fprintf(stream, "so duplicate\n\t\t\tchecking doesn't read them back ");
+	fprintf(stream, "from the output.\n\t\t\tDefault an eighth of the ");
+	fprintf(stream, "memory used, 0\n\t\t\tdisables it\n");
 	fprintf(stream, "\nMiscellaneous options:\n");
 	fprintf(stream, "-root-owned\t\talternative name for -all-root\n");
 	fprintf(stream, "-offset <offset>\tSkip <offset> bytes at the beginning of ");
@@ -6104,6 +7012,9 @@ static void print_sqfstar_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-all-time <time>\tset all inode times to <time> which is an ");
 	fprintf(stream, "unsigned int\n");
 	fprintf(stream, "-exports\t\tmake the filesystem exportable via NFS\n");
+	fprintf(stream, "-path-index\t\tadd an index of pathnames after the filesystem, which\n");
+	fprintf(stream, "\t\t\tallows Unsquashfs to list and look up paths without\n");
+	fprintf(stream, "\t\t\treading the whole directory table\n");
 	fprintf(stream, "-no-sparse\t\tdon't detect sparse files\n");
 	fprintf(stream, "-no-xattrs\t\tdon't store extended attributes" NOXOPT_STR "\n");
 	fprintf(stream, "-xattrs\t\t\tstore extended attributes" XOPT_STR "\n");
@@ -6147,12 +7058,25 @@ static void print_sqfstar_options(FILE *stream, char *name, int total_mem)
 	fprintf(stream, "-limit <percentage>\tlimit the I/O input rate to the given ");
 	fprintf(stream, "percentage.\n\t\t\tThis can be used to reduce the I/O and CPU ");
 	fprintf(stream, "consumption\n\t\t\tof Mksquashfs (alternative to -throttle)\n");
+	fprintf(stream, "-drop-caches\t\tdrop the output from the page cache once ");
+	fprintf(stream, "it's been\n\t\t\twritten, rather than evicting other ");
+	fprintf(stream, "cached data\n");
 	fprintf(stream, "-processors <number>\tUse <number> processors.  By default ");
 	fprintf(stream, "will use number of\n\t\t\tprocessors available\n");
+	fprintf(stream, "-cpu-set <cpus>\t\tRun the compressor threads on <cpus>, a list ");
+	fprintf(stream, "such as\n\t\t\t0-3,8, or node:<n> for the processors of NUMA ");
+	fprintf(stream, "node <n>.\n\t\t\tBy default the number of processors used ");
+	fprintf(stream, "is the number\n\t\t\tin <cpus>\n");
+	fprintf(stream, "-io-cpu-set <cpus>\tRun the reader and writer threads on ");
+	fprintf(stream, "<cpus>, e.g. the\n\t\t\tNUMA node of the output device\n");
 	fprintf(stream, "-mem <size>\t\tUse <size> physical memory.  Currently set ");
 	fprintf(stream, "to %dM\n", total_mem);
 	fprintf(stream, "\t\t\tOptionally a suffix of K, M or G can be given to ");
 	fprintf(stream, "specify\n\t\t\tKbytes, Mbytes or Gbytes respectively\n");
+	fprintf(stream, "-dup-cache <size>\tCache <size> Mbytes of written blocks, ");
+	fprintf(stream, "so duplicate\n\t\t\tchecking doesn't read them back ");
+	fprintf(stream, "from the output.\n\t\t\tDefault an eighth of the ");
+	fprintf(stream, "memory used, 0\n\t\t\tdisables it\n");
 	fprintf(stream, "\nMiscellaneous options:\n");
 	fprintf(stream, "-root-owned\t\talternative name for -all-root\n");
 	fprintf(stream, "-offset <offset>\tSkip <offset> bytes at the beginning of ");
@@ -6213,6 +7137,13 @@ static void print_summary()
 		"compressed", noI || noId ? "uncompressed" : "compressed");
 	printf("\tduplicates are %sremoved\n", duplicate_checking ? "" :
 		"not ");
+	if(incremental)
+		printf("\t%d blocks (%.2f Kbytes) copied from incremental "
+			"image\n", incremental_blocks,
+			incremental_bytes / 1024.0);
+	if(incremental_changed)
+		printf("\t%d blocks from incremental image had changed "
+			"contents\n", incremental_changed);
 	printf("Filesystem size %.2f Kbytes (%.2f Mbytes)\n", bytes / 1024.0,
 		bytes / (1024.0 * 1024.0));
 	printf("\t%.2f%% of uncompressed filesystem size (%.2f Kbytes)\n",
@@ -6234,10 +7165,12 @@ static void print_summary()
 			((float) xattr_bytes / total_xattr_bytes) * 100.0,
 			total_xattr_bytes);
 	}
-	if(duplicate_checking)
+	if(duplicate_checking) {
 		printf("Number of duplicate files found %u\n", file_count -
 			dup_files);
-	else
+		if(block_cache)
+			block_cache_stats(block_cache);
+	} else
 		printf("No duplicate files removed\n");
 	printf("Number of inodes %u\n", inode_count);
 	printf("Number of files %u\n", file_count);
@@ -6268,6 +7201,11 @@ static void print_summary()
 				group->gr_name, id_table[i]->id);
 		}
 	}
+
+	if(!silent) {
+		inode_hash_stats(inode_info, "Inode");
+		sort_hash_stats();
+	}
 }
 
 
@@ -6506,6 +7444,8 @@ print_sqfstar_compressor_options:
 			force_progress = TRUE;
 		else if(strcmp(argv[i], "-exports") == 0)
 			exportable = TRUE;
+		else if(strcmp(argv[i], "-path-index") == 0)
+			path_index = TRUE;
 		else if(strcmp(argv[i], "-offset") == 0 ||
 						strcmp(argv[i], "-o") == 0) {
 			if((++i == dest_index) ||
@@ -6514,7 +7454,23 @@ print_sqfstar_compressor_options:
 						"size\n", argv[0], argv[i - 1]);
 				exit(1);
 			}
-		} else if(strcmp(argv[i], "-processors") == 0) {
+		} else if(strcmp(argv[i], "-cpu-set") == 0 ||
+				strcmp(argv[i], "-io-cpu-set") == 0) {
+			struct cpu_list *list;
+
+			if((++i == dest_index) || (list = parse_cpu_list(argv[i])) ==
+									NULL) {
+				ERROR("%s: %s missing or invalid processor "
+					"list\n", argv[0], argv[i - 1]);
+				exit(1);
+			}
+			if(strcmp(argv[i - 1], "-cpu-set") == 0)
+				worker_cpus = list;
+			else
+				io_cpus = list;
+		} else if(strcmp(argv[i], "-drop-caches") == 0)
+			drop_caches = TRUE;
+		else if(strcmp(argv[i], "-processors") == 0) {
 			if((++i == dest_index) || !parse_num(argv[i], &processors)) {
 				ERROR("%s: -processors missing or invalid "
 					"processor number\n", argv[0]);
@@ -6525,6 +7481,12 @@ print_sqfstar_compressor_options:
 					argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-dup-cache") == 0) {
+			if((++i == dest_index) || !parse_num(argv[i], &dup_cache_size)) {
+				ERROR("%s: -dup-cache missing or invalid "
+					"cache size\n", argv[0]);
+				exit(1);
+			}
 		} else if(strcmp(argv[i], "-mem") == 0) {
 			long long number;
 
@@ -6819,6 +7781,8 @@ print_sqfstar_compressor_options:
 	memset(dupl_block, 0, 1048576 * sizeof(struct file_info *));
 	memset(dupl_frag, 0, block_size * sizeof(struct file_info *));
 
+	inode_info = inode_hash_create(0);
+
 	comp_data = compressor_dump_options(comp, block_size, &size);
 
 	if(!quiet)
@@ -6871,7 +7835,12 @@ print_sqfstar_compressor_options:
 
 	while((fragment = get_frag_action(fragment)))
 		write_fragment(*fragment);
-	if(!reproducible)
+	if(reproducible) {
+		pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
+		pthread_mutex_lock(&fragment_mutex);
+		allow_fragments(fragment_sequence);
+		pthread_cleanup_pop(1);
+	} else
 		unlock_fragments();
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
@@ -6895,6 +7864,9 @@ print_sqfstar_compressor_options:
 		write_destination(fd, bytes, 4096 - i, temp);
 	}
 
+	if(drop_caches)
+		drop_output_all();
+
 	close(fd);
 
 	if(recovery_file)
@@ -7281,6 +8253,8 @@ print_compressor_options:
 			exportable = TRUE;
 		else if(strcmp(argv[i], "-no-exports") == 0)
 			exportable = FALSE;
+		else if(strcmp(argv[i], "-path-index") == 0)
+			path_index = TRUE;
 		else if(strcmp(argv[i], "-offset") == 0 ||
 						strcmp(argv[i], "-o") == 0) {
 			if((++i == argc) ||
@@ -7289,7 +8263,27 @@ print_compressor_options:
 						"size\n", argv[0], argv[i - 1]);
 				exit(1);
 			}
-		} else if(strcmp(argv[i], "-processors") == 0) {
+		} else if(strcmp(argv[i], "-cpu-set") == 0 ||
+				strcmp(argv[i], "-io-cpu-set") == 0) {
+			struct cpu_list *list;
+
+			if((++i == argc) || (list = parse_cpu_list(argv[i])) ==
+									NULL) {
+				ERROR("%s: %s missing or invalid processor "
+					"list\n", argv[0], argv[i - 1]);
+				exit(1);
+			}
+			if(strcmp(argv[i - 1], "-cpu-set") == 0)
+				worker_cpus = list;
+			else
+				io_cpus = list;
+		} else if(strcmp(argv[i], "-drop-caches") == 0)
+			drop_caches = TRUE;
+		else if(strcmp(argv[i], "-direct-io") == 0)
+			direct_io = TRUE;
+		else if(strcmp(argv[i], "-noatime") == 0)
+			noatime = TRUE;
+		else if(strcmp(argv[i], "-processors") == 0) {
 			if((++i == argc) || !parse_num(argv[i], &processors)) {
 				ERROR("%s: -processors missing or invalid "
 					"processor number\n", argv[0]);
@@ -7335,6 +8329,12 @@ print_compressor_options:
 					"megabyte or larger\n", argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-dup-cache") == 0) {
+			if((++i == argc) || !parse_num(argv[i], &dup_cache_size)) {
+				ERROR("%s: -dup-cache missing or invalid "
+					"cache size\n", argv[0]);
+				exit(1);
+			}
 		} else if(strcmp(argv[i], "-mem") == 0) {
 			long long number;
 
@@ -7400,6 +8400,13 @@ print_compressor_options:
 				ERROR("%s: -sort missing filename\n", argv[0]);
 				exit(1);
 			}
+		} else if(strcmp(argv[i], "-incremental") == 0) {
+			if(++i == argc) {
+				ERROR("%s: -incremental missing image\n",
+					argv[0]);
+				exit(1);
+			}
+			incremental_image = argv[i];
 		} else if(strcmp(argv[i], "-all-root") == 0 ||
 				strcmp(argv[i], "-root-owned") == 0)
 			global_uid = global_gid = 0;
@@ -7636,6 +8643,18 @@ print_compressor_options:
 			EXIT_MKSQUASHFS();
 		}
 
+		if(incremental_image) {
+			struct stat incremental_buf;
+
+			if(stat(incremental_image, &incremental_buf) == 0 &&
+					incremental_buf.st_dev == buf.st_dev &&
+					incremental_buf.st_ino == buf.st_ino) {
+				ERROR("Incremental image cannot be the "
+					"destination\n");
+				exit(1);
+			}
+		}
+
 		if(S_ISBLK(buf.st_mode)) {
 			if((fd = open(destination_file, O_RDWR)) == -1) {
 				perror("Could not open block device as "
@@ -7746,6 +8765,28 @@ print_compressor_options:
 	memset(dupl_block, 0, 1048576 * sizeof(struct file_info *));
 	memset(dupl_frag, 0, block_size * sizeof(struct file_info *));
 
+	inode_info = inode_hash_create(0);
+
+	if(path_index && !delete)
+		BAD_ERROR("-path-index cannot be used when appending, use "
+			"-noappend\n");
+
+	if(incremental_image) {
+		if(!delete)
+			BAD_ERROR("-incremental cannot be used when appending, "
+				"use -noappend\n");
+
+		if(tarfile)
+			BAD_ERROR("-incremental is unsupported when reading "
+				"tar files\n");
+
+		/*
+		 * -all-time (and SOURCE_DATE_EPOCH) overrides the modification
+		 * times in the image, and so they can't be matched
+		 */
+		incremental_open(incremental_image, !all_time_opt);
+	}
+
 	if(delete) {
 		int size;
 		void *comp_data = compressor_dump_options(comp, block_size,
@@ -7938,7 +8979,12 @@ print_compressor_options:
 
 	while((fragment = get_frag_action(fragment)))
 		write_fragment(*fragment);
-	if(!reproducible)
+	if(reproducible) {
+		pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
+		pthread_mutex_lock(&fragment_mutex);
+		allow_fragments(fragment_sequence);
+		pthread_cleanup_pop(1);
+	} else
 		unlock_fragments();
 	pthread_cleanup_push((void *) pthread_mutex_unlock, &fragment_mutex);
 	pthread_mutex_lock(&fragment_mutex);
@@ -7962,6 +9008,9 @@ print_compressor_options:
 		write_destination(fd, bytes, 4096 - i, temp);
 	}
 
+	if(drop_caches)
+		drop_output_all();
+
 	close(fd);
 
 	if(recovery_file)
@@ -35,6 +35,8 @@ struct dir_info {
 	char			dir_is_ldir;
 	struct dir_ent		*dir_ent;
 	struct dir_ent		*list;
+	struct dir_ent		**hash_table;
+	unsigned int		hash_size;
 	DIR			*linuxdir;
 };
 
@@ -46,6 +48,7 @@ struct dir_ent {
 	struct dir_info		*dir;
 	struct dir_info		*our_dir;
 	struct dir_ent		*next;
+	struct dir_ent		*hash_next;
 };
 
 struct inode_info {
@@ -53,12 +56,14 @@ struct inode_info {
 	struct inode_info	*next;
 	struct pseudo_dev	*pseudo;
 	struct tar_file		*tar_file;
+	struct incremental_data	*incremental;
 	squashfs_inode		inode;
 	unsigned int		inode_number;
 	unsigned int		nlink;
 	char			dummy_root_dir;
 	char			type;
 	char			read;
+	char			written;
 	char			root_entry;
 	char			no_fragments;
 	char			always_use_fragments;
@@ -80,7 +85,9 @@ struct file_info {
 	struct file_info	*block_next;
 	struct fragment		*fragment;
 	struct dup_info		*dup;
+	unsigned short		*block_checksum;
 	unsigned int		blocks;
+	unsigned int		checksum_blocks;
 	unsigned short		checksum;
 	unsigned short		fragment_checksum;
 	char			have_frag_checksum;
@@ -95,6 +102,64 @@ struct dup_info {
 };
 
 
+/* file still matching the blocks read so far in write_file_blocks_dup() */
+struct dup_candidate {
+	struct file_info	*file;
+	long long		start;
+};
+
+
+/*
+ * A thread compressing the metadata blocks first to last - 1 of a table,
+ * each into a slot of TABLE_SLOT_SIZE bytes.  Tables are compressed
+ * TABLE_BATCH_BLOCKS blocks per thread at a time
+ */
+#define TABLE_SLOT_SIZE (SQUASHFS_METADATA_SIZE + BLOCK_OFFSET)
+#define TABLE_BATCH_BLOCKS 16
+
+struct table_compressor {
+	void			*stream;
+	char			*buffer;
+	long long		length;
+	char			*cbuffer;
+	unsigned short		*c_byte;
+	int			uncompressed;
+	int			first;
+	int			last;
+	int			thread;
+	int			threads;
+};
+
+/*
+ * A compressed metadata block of a table being read on appending, and the
+ * threads decompressing them
+ */
+struct table_block {
+	long long		start;
+	char			*src;
+	void			*dest;
+	int			compressed;
+	int			size;
+	int			expected;
+	int			length;
+};
+
+struct table_inflator {
+	struct table_block	*blocks;
+	int			count;
+	int			thread;
+	int			threads;
+};
+
+/*
+ * The directory tree the metadata thread builds the inode and directory
+ * tables of, and the resulting root inode
+ */
+struct metadata_scan {
+	struct dir_info		*dir_info;
+	squashfs_inode		inode;
+};
+
 /* fragment block data structures */
 struct fragment {
 	unsigned int		index;
@@ -129,6 +194,13 @@ struct append_file {
 #define SQUASHFS_READQ_MEM 4
 #define SQUASHFS_BWRITEQ_MEM 4
 #define SQUASHFS_FWRITEQ_MEM 4
+#define SQUASHFS_DUPQ_MEM 8
+
+/*
+ * Number of written files the main thread can get ahead of the metadata
+ * thread by
+ */
+#define METADATA_QUEUE_SIZE 4096
 
 /*
  * Lowest amount of physical memory considered viable for Mksquashfs
@@ -136,6 +208,18 @@ struct append_file {
  */
 #define SQUASHFS_LOWMEM 64
 
+/*
+ * Number of fragments queued for compression before they're written
+ * when building reproducible images
+ */
+#define SQUASHFS_FRAGMENT_BACKLOG 8
+
+/*
+ * With -drop-caches the output is written back and dropped from the page
+ * cache in chunks of this size
+ */
+#define DROP_CACHES_CHUNK (8 * 1024 * 1024)
+
 /* offset of data in compressed metadata blocks (allowing room for
  * compressed size */
 #define BLOCK_OFFSET 2
@@ -153,9 +237,12 @@ struct append_file {
 /* in memory directory data */
 #define I_COUNT_SIZE		128
 #define DIR_ENTRIES		32
-#define INODE_HASH_SIZE		65536
-#define INODE_HASH_MASK		(INODE_HASH_SIZE - 1)
-#define INODE_HASH(dev, ino)	(ino & INODE_HASH_MASK)
+
+/*
+ * Directories with at least DIR_HASH_MIN entries get a name hash index
+ * built on demand by lookup_name(), which is grown as entries are added
+ */
+#define DIR_HASH_MIN		64
 
 struct cached_dir_index {
 	struct squashfs_dir_index	index;
@@ -225,13 +312,19 @@ extern int no_fragments;
 extern int always_use_fragments;
 extern struct file_info **dupl_frag;
 extern int duplicate_checking;
+extern int sparse_files;
+extern int drop_caches;
+extern int direct_io;
+extern int noatime;
 extern int no_hardlinks;
 extern struct dir_info *root_dir;
 extern struct pathnames *paths;
 extern int tarfile;
 extern int root_mode_opt;
 extern mode_t root_mode;
-extern struct inode_info *inode_info[INODE_HASH_SIZE];
+extern struct inode_hash *inode_info;
+extern int processors;
+extern struct cpu_list *worker_cpus;
 
 extern int read_fs_bytes(int, long long, long long, void *);
 extern void add_file(long long, long long, long long, unsigned int *, int,
@@ -257,9 +350,27 @@ extern void add_dir_entry(struct dir_ent *dir_ent, struct dir_info *sub_dir,
 	struct inode_info *inode_info);
 extern void free_dir_entry(struct dir_ent *dir_ent);
 extern void free_dir(struct dir_info *dir);
+extern void free_dir_hash(struct dir_info *dir);
 extern struct dir_info *create_dir(char *pathname, char *subpath, int depth);
 extern char *subpathname(struct dir_ent *dir_ent);
 extern struct dir_info *scan1_opendir(char *pathname, char *subpath, int depth);
 extern squashfs_inode do_directory_scans(struct dir_ent *dir_ent, int progress);
 extern struct inode_info *lookup_inode(struct stat *buf);
+extern void add_inode_hash(struct inode_info *inode);
+
+
+static inline int is_fragment_inode(struct inode_info *inode)
+{
+	off_t file_size = inode->buf.st_size;
+
+	/*
+	 * If this block is to be compressed differently to the
+	 * fragment compression then it cannot be a fragment
+	 */
+	if(inode->noF != noF)
+		return 0;
+
+	return !inode->no_fragments && file_size && (file_size < block_size ||
+		(inode->always_use_fragments && file_size & (block_size - 1)));
+}
 #endif
@@ -0,0 +1,46 @@
+#ifndef PATH_INDEX_H
+#define PATH_INDEX_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * path_index.h
+ */
+
+/*
+ * Compare pathnames in the order they're stored in the path index.  This is
+ * directory order with '/' sorting before every other character, so that
+ * the contents of a directory immediately follow it.  Mksquashfs writes the
+ * index in this order, and Unsquashfs searches it in this order.
+ */
+static inline int path_index_compare(char *a, int a_len, char *b, int b_len)
+{
+	int i, len = a_len < b_len ? a_len : b_len;
+
+	for(i = 0; i < len && a[i] == b[i]; i++);
+
+	if(i == len)
+		return a_len - b_len;
+	if(a[i] == '/')
+		return -1;
+	if(b[i] == '/')
+		return 1;
+	return (unsigned char) a[i] - (unsigned char) b[i];
+}
+#endif
@@ -35,6 +35,7 @@
 #include <limits.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_swap.h"
@@ -42,6 +43,7 @@
 #include "xattr.h"
 #include "mksquashfs_error.h"
 #include "mksquashfs.h"
+#include "resources.h"
 
 int read_block(int fd, long long start, long long *next, int expected,
 								void *block)
@@ -103,6 +105,182 @@ int read_block(int fd, long long start, long long *next, int expected,
 }
 
 
+/*
+ * Decompress every threads'th block of a table, starting at block thread.
+ * Blocks which fail to decompress, or aren't the expected size, are left
+ * with a length of 0
+ */
+static void *table_inflator(void *arg)
+{
+	struct table_inflator *inflator = arg;
+	int i;
+
+	for(i = inflator->thread; i < inflator->count; i += inflator->threads) {
+		struct table_block *block = &inflator->blocks[i];
+		int outlen = block->expected ? block->expected :
+						SQUASHFS_METADATA_SIZE;
+		int res, error;
+
+		block->length = 0;
+		if(block->size > outlen)
+			continue;
+
+		if(block->compressed) {
+			res = compressor_uncompress(comp, block->dest,
+				block->src, block->size, outlen, &error);
+			if(res == -1)
+				continue;
+		} else {
+			memcpy(block->dest, block->src, block->size);
+			res = block->size;
+		}
+
+		if(block->expected == 0 || block->expected == res)
+			block->length = res;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Decompress the blocks of a table, which have been read into memory, in
+ * parallel.  Returns FALSE if any failed
+ */
+static int inflate_table(struct table_block *blocks, int count)
+{
+	int i, threads = processors > 0 ? processors : available_processors();
+	struct table_inflator *inflator;
+	pthread_t *thread;
+
+	if(threads > count)
+		threads = count ? count : 1;
+
+	inflator = malloc(threads * sizeof(struct table_inflator));
+	thread = malloc(threads * sizeof(pthread_t));
+	if(inflator == NULL || thread == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < threads; i++) {
+		inflator[i].blocks = blocks;
+		inflator[i].count = count;
+		inflator[i].thread = i;
+		inflator[i].threads = threads;
+	}
+
+	if(threads == 1)
+		table_inflator(inflator);
+	else {
+		for(i = 0; i < threads; i++) {
+			if(pthread_create(&thread[i], NULL, table_inflator,
+								&inflator[i]))
+				BAD_ERROR("Failed to create thread\n");
+			if(!set_thread_cpus(thread[i], worker_cpus))
+				BAD_ERROR("Failed to set the processors of the "
+					"table inflator threads\n");
+		}
+
+		for(i = 0; i < threads; i++)
+			pthread_join(thread[i], NULL);
+	}
+
+	free(inflator);
+	free(thread);
+
+	for(i = 0; i < count; i++)
+		if(blocks[i].length == 0) {
+			ERROR("Failed to read table block from 0x%llx\n",
+				blocks[i].start);
+			return FALSE;
+		}
+
+	return TRUE;
+}
+
+
+/*
+ * Read the metadata blocks of a table, located by index, into table.
+ * Mksquashfs writes the blocks of a table contiguously, followed by the
+ * index at end, and so they're read with one read of the compressed
+ * table, and then decompressed in parallel.  Tables laid out any other way
+ * are read block by block
+ */
+static int read_table(int fd, long long *index, int indexes, long long end,
+	int bytes, void *dest)
+{
+	char *table = dest;
+	long long first = indexes ? index[0] : end;
+	struct table_block *blocks;
+	char *ctable;
+	int i, res;
+
+	for(i = 0; i < indexes; i++)
+		if(index[i] < first || index[i] + 2 > end || (i && index[i] <=
+								index[i - 1]))
+			break;
+
+	if(i < indexes || end - first > (long long) indexes *
+					(SQUASHFS_METADATA_SIZE + 2)) {
+		for(i = 0; i < indexes; i++) {
+			int expected = (i + 1) != indexes ?
+				SQUASHFS_METADATA_SIZE : bytes -
+				i * SQUASHFS_METADATA_SIZE;
+
+			if(read_block(fd, index[i], NULL, expected, table +
+					i * SQUASHFS_METADATA_SIZE) == 0) {
+				ERROR("Failed to read table block %d, from "
+					"0x%llx\n", i, index[i]);
+				return FALSE;
+			}
+		}
+
+		return TRUE;
+	}
+
+	ctable = malloc(end - first);
+	blocks = malloc(indexes * sizeof(struct table_block));
+	if((ctable == NULL && end > first) || (blocks == NULL && indexes))
+		MEM_ERROR();
+
+	res = read_fs_bytes(fd, first, end - first, ctable);
+	if(res == 0)
+		goto failed;
+
+	for(i = 0; i < indexes; i++) {
+		unsigned short c_byte;
+
+		memcpy(&c_byte, ctable + index[i] - first, 2);
+		SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
+
+		blocks[i].start = index[i];
+		blocks[i].src = ctable + index[i] - first + 2;
+		blocks[i].compressed = SQUASHFS_COMPRESSED(c_byte);
+		blocks[i].size = SQUASHFS_COMPRESSED_SIZE(c_byte);
+		blocks[i].expected = (i + 1) != indexes ?
+			SQUASHFS_METADATA_SIZE : bytes - i *
+			SQUASHFS_METADATA_SIZE;
+		blocks[i].dest = table + i * SQUASHFS_METADATA_SIZE;
+
+		if(index[i] + 2 + blocks[i].size > end) {
+			ERROR("Failed to read table block %d, from 0x%llx\n",
+				i, index[i]);
+			goto failed;
+		}
+	}
+
+	res = inflate_table(blocks, indexes);
+
+	free(ctable);
+	free(blocks);
+	return res;
+
+failed:
+	free(ctable);
+	free(blocks);
+	return FALSE;
+}
+
+
 #define NO_BYTES(SIZE) \
 	(bytes - (cur_ptr - inode_table) < (SIZE))
 
@@ -119,58 +297,92 @@ unsigned char *scan_inode_table(int fd, long long start, long long end,
 {
 	unsigned char *cur_ptr;
 	unsigned char *inode_table = NULL;
-	int byte, files = 0;
+	struct table_block *table_blocks = NULL;
+	char *ctable = NULL;
+	int i, files = 0, count = 0;
 	unsigned int directory_start_block, bytes = 0, size = 0;
 	struct squashfs_base_inode_header base;
-	int alloc_size;
+	long long pos;
 
 	TRACE("scan_inode_table: start 0x%llx, end 0x%llx, root_inode_start "
 		"0x%llx\n", start, end, root_inode_start);
 
 	/*
-	 * Use the size of the compressed inode table as an initial
-	 * memory allocation value, and the reallocation value, if
-	 * this is too small.
-	 *
-	 * With a 50% compression ratio, this should require 2 alloc calls
-	 * With a 25% compression ratio, this should require 4 alloc calls
-	 * With a 12.5% compression ratio, this should require 8 alloc calls
-	 *
-	 * Always round to a multiple of SQUASHFS_METADATA_SIZE
+	 * Read the compressed inode table in one go, find its blocks, and
+	 * decompress them in parallel.  Every block but the last should
+	 * decompress to SQUASHFS_METADATA_SIZE bytes, so they're
+	 * decompressed directly into place.
 	 */
-	alloc_size = ((end - start) + SQUASHFS_METADATA_SIZE) & ~(SQUASHFS_METADATA_SIZE - 1);
+	if(end - start > INT_MAX || end < start)
+		goto corrupted;
+
+	ctable = malloc(end - start);
+	if(ctable == NULL && end > start)
+		MEM_ERROR();
+
+	if(read_fs_bytes(fd, start, end - start, ctable) == 0)
+		goto corrupted;
 
 	/* Rogue value used to check if it was found */
 	*root_inode_block = -1LL;
-	while(start < end) {
-		if(start == root_inode_start) {
-			TRACE("scan_inode_table: read compressed block 0x%llx "
-				"containing root inode\n", start);
-			*root_inode_block = bytes;
-		}
-		if(size - bytes < SQUASHFS_METADATA_SIZE) {
-			inode_table = realloc(inode_table, size
-				+= alloc_size);
-			if(inode_table == NULL)
+	for(pos = start; pos < end; count ++) {
+		unsigned short c_byte;
+
+		if(pos + 2 > end)
+			goto corrupted;
+
+		if((count & 1023) == 0) {
+			table_blocks = realloc(table_blocks, (count + 1024) *
+				sizeof(struct table_block));
+			if(table_blocks == NULL)
 				MEM_ERROR();
 		}
-		TRACE("scan_inode_table: reading block 0x%llx\n", start);
-		byte = read_block(fd, start, &start, 0, inode_table + bytes);
-		if(byte == 0)
-			goto corrupted;
 
-		bytes += byte;
+		memcpy(&c_byte, ctable + pos - start, 2);
+		SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
 
-		/* If this is not the last metadata block in the inode table
-		 * then it should be SQUASHFS_METADATA_SIZE in size.
-		 * Note, we can't use expected in read_block() above for this
-		 * because we don't know if this is the last block until
-		 * after reading.
-		 */
-		if(start != end && byte != SQUASHFS_METADATA_SIZE)
+		if(pos == root_inode_start) {
+			TRACE("scan_inode_table: read compressed block 0x%llx "
+				"containing root inode\n", pos);
+			*root_inode_block = (long long) count *
+						SQUASHFS_METADATA_SIZE;
+		}
+
+		table_blocks[count].start = pos;
+		table_blocks[count].src = ctable + pos - start + 2;
+		table_blocks[count].compressed = SQUASHFS_COMPRESSED(c_byte);
+		table_blocks[count].size = SQUASHFS_COMPRESSED_SIZE(c_byte);
+		pos += 2 + table_blocks[count].size;
+		table_blocks[count].expected = pos < end ?
+						SQUASHFS_METADATA_SIZE : 0;
+
+		if(pos > end)
 			goto corrupted;
 	}
 
+	if((long long) count * SQUASHFS_METADATA_SIZE > UINT_MAX)
+		goto corrupted;
+
+	size = count * SQUASHFS_METADATA_SIZE;
+	inode_table = malloc(size);
+	if(inode_table == NULL && size)
+		MEM_ERROR();
+
+	for(i = 0; i < count; i++)
+		table_blocks[i].dest = inode_table + i *
+						SQUASHFS_METADATA_SIZE;
+
+	if(inflate_table(table_blocks, count) == FALSE)
+		goto corrupted;
+
+	bytes = count ? (count - 1) * SQUASHFS_METADATA_SIZE +
+					table_blocks[count - 1].length : 0;
+
+	free(ctable);
+	free(table_blocks);
+	ctable = NULL;
+	table_blocks = NULL;
+
 	/*
 	 * We expect to have found the metadata block containing the
 	 * root inode in the above inode_table metadata block scan.  If it
@@ -555,6 +767,8 @@ unsigned char *scan_inode_table(int fd, long long start, long long end,
 corrupted:
 	ERROR("scan_inode_table: filesystem corruption detected in "
 		"scanning metadata\n");
+	free(ctable);
+	free(table_blocks);
 	free(inode_table);
 	return NULL;
 }
@@ -801,21 +1015,13 @@ unsigned int *read_id_table(int fd, struct squashfs_super_block *sBlk)
 
 	SQUASHFS_INSWAP_ID_BLOCKS(index, indexes);
 
-	for(i = 0; i < indexes; i++) {
-		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
-					bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, index[i], NULL, expected,
-			((unsigned char *) id_table) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read id table block %d, from 0x%llx, length %d\n", i,
-			index[i], length);
-		if(length == 0) {
-			ERROR("Failed to read id table block %d, from 0x%llx, "
-				"length %d\n", i, index[i], length);
-			ERROR("Filesystem corrupted?\n");
-			free(id_table);
-			return NULL;
-		}
+	res = read_table(fd, index, indexes, sBlk->id_table_start, bytes,
+								id_table);
+	if(res == 0) {
+		ERROR("Failed to read id table\n");
+		ERROR("Filesystem corrupted?\n");
+		free(id_table);
+		return NULL;
 	}
 
 	SQUASHFS_INSWAP_INTS(id_table, sBlk->no_ids);
@@ -858,22 +1064,13 @@ struct squashfs_fragment_entry *read_fragment_table(int fd, struct squashfs_supe
 
 	SQUASHFS_INSWAP_FRAGMENT_INDEXES(fragment_table_index, indexes);
 
-	for(i = 0; i < indexes; i++) {
-		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
-					bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, fragment_table_index[i], NULL,
-			expected, ((unsigned char *) fragment_table) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read fragment table block %d, from 0x%llx, length %d\n",
-			i, fragment_table_index[i], length);
-		if(length == 0) {
-			ERROR("Failed to read fragment table block %d, from "
-				"0x%llx, length %d\n", i,
-				fragment_table_index[i], length);
-			ERROR("Filesystem corrupted?\n");
-			free(fragment_table);
-			return NULL;
-		}
+	res = read_table(fd, fragment_table_index, indexes,
+		sBlk->fragment_table_start, bytes, fragment_table);
+	if(res == 0) {
+		ERROR("Failed to read fragment table\n");
+		ERROR("Filesystem corrupted?\n");
+		free(fragment_table);
+		return NULL;
 	}
 
 	for(i = 0; i < sBlk->fragments; i++)
@@ -888,7 +1085,7 @@ squashfs_inode *read_inode_lookup_table(int fd, struct squashfs_super_block *sBl
 	int lookup_bytes = SQUASHFS_LOOKUP_BYTES(sBlk->inodes);
 	int indexes = SQUASHFS_LOOKUP_BLOCKS(sBlk->inodes);
 	long long index[indexes];
-	int res, i;
+	int res;
 	squashfs_inode *inode_lookup_table;
 
 	inode_lookup_table = malloc(lookup_bytes);
@@ -906,22 +1103,13 @@ squashfs_inode *read_inode_lookup_table(int fd, struct squashfs_super_block *sBl
 
 	SQUASHFS_INSWAP_LONG_LONGS(index, indexes);
 
-	for(i = 0; i <  indexes; i++) {
-		int expected = (i + 1) != indexes ? SQUASHFS_METADATA_SIZE :
-				lookup_bytes & (SQUASHFS_METADATA_SIZE - 1);
-		int length = read_block(fd, index[i], NULL, expected,
-			((unsigned char *) inode_lookup_table) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read inode lookup table block %d, from 0x%llx, length "
-			"%d\n", i, index[i], length);
-		if(length == 0) {
-			ERROR("Failed to read inode lookup table block %d, "
-				"from 0x%llx, length %d\n", i, index[i],
-				length);
-			ERROR("Filesystem corrupted?\n");
-			free(inode_lookup_table);
-			return NULL;
-		}
+	res = read_table(fd, index, indexes, sBlk->lookup_table_start,
+		lookup_bytes, inode_lookup_table);
+	if(res == 0) {
+		ERROR("Failed to read inode lookup table\n");
+		ERROR("Filesystem corrupted?\n");
+		free(inode_lookup_table);
+		return NULL;
 	}
 
 	SQUASHFS_INSWAP_LONG_LONGS(inode_lookup_table, sBlk->inodes);
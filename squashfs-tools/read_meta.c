@@ -0,0 +1,606 @@
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * read_meta.c
+ */
+
+/*
+ * Common Squashfs 4.0 metadata decoding, shared by unsquashfs,
+ * libsquashfs-read, mksquashfs (-incremental) and sqfsdelta.  The metadata
+ * is read through the reader passed in, and so each can use its own
+ * metadata cache.  Nothing is reported, errors are returned as -errno.
+ */
+
+#define TRUE 1
+#define FALSE 0
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "compressor.h"
+#include "read_meta.h"
+
+/*
+ * Maximum directory depth walked by scan_meta().  Mksquashfs can't create
+ * deeper trees from a filesystem, as their pathnames would exceed PATH_MAX
+ */
+#define META_MAX_DEPTH	4096
+
+/*
+ * Cache of uncompressed metadata blocks used by meta_reader_init().  It is
+ * direct mapped on the location of the compressed block, and so is bounded
+ * in size however large the inode and directory tables are
+ */
+struct meta_block {
+	long long	start;
+	long long	next;
+	int		length;
+	char		data[SQUASHFS_METADATA_SIZE];
+};
+
+
+static int read_bytes(struct meta_reader *reader, long long start, int bytes,
+	void *buff)
+{
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pread(reader->fd, buff + count, bytes - count, start +
+									count);
+		if(res < 1) {
+			if(res == 0)
+				return -EIO;
+			else if(errno != EINTR)
+				return -errno;
+			res = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Return the uncompressed metadata block at location start, reading and
+ * decompressing it if it isn't in the cache
+ */
+static int read_meta_block(struct meta_reader *reader, long long start,
+	struct meta_block **block)
+{
+	int hash = (start ^ (start >> 13)) & (META_CACHE_SIZE - 1);
+	struct meta_block *entry = &reader->cache[hash];
+	unsigned short c_byte;
+	int size, res, error;
+
+	*block = entry;
+	if(entry->length && entry->start == start)
+		return 0;
+
+	entry->length = 0;
+
+	res = read_bytes(reader, start, 2, &c_byte);
+	if(res)
+		return res;
+
+	SQUASHFS_INSWAP_SHORTS(&c_byte, 1);
+	size = SQUASHFS_COMPRESSED_SIZE(c_byte);
+	if(size > SQUASHFS_METADATA_SIZE)
+		return -EIO;
+
+	if(SQUASHFS_COMPRESSED(c_byte)) {
+		char buffer[size];
+		int length;
+
+		res = read_bytes(reader, start + 2, size, buffer);
+		if(res)
+			return res;
+
+		length = compressor_uncompress(reader->comp, entry->data,
+			buffer, size, SQUASHFS_METADATA_SIZE, &error);
+		if(length <= 0)
+			return -EIO;
+		entry->length = length;
+	} else {
+		if(size == 0)
+			return -EIO;
+		res = read_bytes(reader, start + 2, size, entry->data);
+		if(res)
+			return res;
+		entry->length = size;
+	}
+
+	entry->start = start;
+	entry->next = start + size + 2;
+
+	return 0;
+}
+
+
+static int read_cached(struct meta_reader *reader, void *buff,
+	long long *block, int *offset, int length)
+{
+	while(length) {
+		struct meta_block *entry;
+		int avail, res = read_meta_block(reader, *block, &entry);
+
+		if(res)
+			return res;
+
+		avail = entry->length - *offset;
+		if(avail < 0)
+			return -EIO;
+
+		if(avail == 0) {
+			*block = entry->next;
+			*offset = 0;
+			continue;
+		}
+
+		if(avail > length)
+			avail = length;
+
+		memcpy(buff, entry->data + *offset, avail);
+		buff += avail;
+		*offset += avail;
+		length -= avail;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Set up reader to read the filesystem in fd, through a small cache of
+ * uncompressed metadata blocks
+ */
+int meta_reader_init(struct meta_reader *reader, int fd,
+	struct squashfs_super_block *sBlk, struct compressor *comp)
+{
+	reader->sBlk = sBlk;
+	reader->read = read_cached;
+	reader->arg = NULL;
+	reader->fd = fd;
+	reader->comp = comp;
+	reader->cache = calloc(META_CACHE_SIZE, sizeof(struct meta_block));
+
+	return reader->cache ? 0 : -ENOMEM;
+}
+
+
+void meta_reader_free(struct meta_reader *reader)
+{
+	free(reader->cache);
+	reader->cache = NULL;
+}
+
+
+/*
+ * Return the file type bits of mode for an inode or directory entry type,
+ * or 0 if the type is invalid
+ */
+unsigned int meta_type_mode(int type)
+{
+	switch(type) {
+	case SQUASHFS_DIR_TYPE:
+	case SQUASHFS_LDIR_TYPE:
+		return S_IFDIR;
+	case SQUASHFS_FILE_TYPE:
+	case SQUASHFS_LREG_TYPE:
+		return S_IFREG;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		return S_IFLNK;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_LBLKDEV_TYPE:
+		return S_IFBLK;
+	case SQUASHFS_CHRDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		return S_IFCHR;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_LFIFO_TYPE:
+		return S_IFIFO;
+	case SQUASHFS_SOCKET_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		return S_IFSOCK;
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ * Read the inode at start_block (relative to the inode table start) and
+ * offset.  The uid and gid are left as indexes into the id table, but are
+ * checked to be in range
+ */
+int read_meta_inode(struct meta_reader *reader, unsigned int start_block,
+	unsigned int offset, struct meta_inode *inode)
+{
+	long long block = reader->sBlk->inode_table_start + start_block;
+	int block_offset = offset, res;
+	union squashfs_inode_header header;
+
+	res = read_meta(reader, &header.base, &block, &block_offset,
+						sizeof(header.base));
+	if(res)
+		return res;
+
+	SQUASHFS_INSWAP_BASE_INODE_HEADER(&header.base);
+
+	if(meta_type_mode(header.base.inode_type) == 0 ||
+			header.base.uid >= reader->sBlk->no_ids ||
+			header.base.guid >= reader->sBlk->no_ids)
+		return -EIO;
+
+	memset(inode, 0, sizeof(struct meta_inode));
+	inode->type = header.base.inode_type;
+	inode->mode = meta_type_mode(inode->type) |
+					SQUASHFS_MODE(header.base.mode);
+	inode->uid = header.base.uid;
+	inode->gid = header.base.guid;
+	inode->mtime = header.base.mtime;
+	inode->inode_number = header.base.inode_number;
+	inode->nlink = 1;
+	inode->fragment = SQUASHFS_INVALID_FRAG;
+	inode->xattr = SQUASHFS_INVALID_XATTR;
+
+	block = reader->sBlk->inode_table_start + start_block;
+	block_offset = offset;
+
+	switch(inode->type) {
+	case SQUASHFS_DIR_TYPE:
+		res = read_meta(reader, &header.dir, &block, &block_offset,
+							sizeof(header.dir));
+		SQUASHFS_INSWAP_DIR_INODE_HEADER(&header.dir);
+		inode->nlink = header.dir.nlink;
+		inode->size = header.dir.file_size;
+		inode->start = header.dir.start_block;
+		inode->offset = header.dir.offset;
+		break;
+	case SQUASHFS_LDIR_TYPE:
+		res = read_meta(reader, &header.ldir, &block, &block_offset,
+							sizeof(header.ldir));
+		SQUASHFS_INSWAP_LDIR_INODE_HEADER(&header.ldir);
+		inode->nlink = header.ldir.nlink;
+		inode->size = header.ldir.file_size;
+		inode->start = header.ldir.start_block;
+		inode->offset = header.ldir.offset;
+		inode->i_count = header.ldir.i_count;
+		inode->xattr = header.ldir.xattr;
+		break;
+	case SQUASHFS_FILE_TYPE:
+		res = read_meta(reader, &header.reg, &block, &block_offset,
+							sizeof(header.reg));
+		SQUASHFS_INSWAP_REG_INODE_HEADER(&header.reg);
+		inode->size = header.reg.file_size;
+		inode->start = header.reg.start_block;
+		inode->fragment = header.reg.fragment;
+		inode->offset = header.reg.offset;
+		break;
+	case SQUASHFS_LREG_TYPE:
+		res = read_meta(reader, &header.lreg, &block, &block_offset,
+							sizeof(header.lreg));
+		SQUASHFS_INSWAP_LREG_INODE_HEADER(&header.lreg);
+		inode->nlink = header.lreg.nlink;
+		inode->size = header.lreg.file_size;
+		inode->start = header.lreg.start_block;
+		inode->fragment = header.lreg.fragment;
+		inode->offset = header.lreg.offset;
+		inode->sparse = header.lreg.sparse != 0;
+		inode->xattr = header.lreg.xattr;
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		res = read_meta(reader, &header.symlink, &block, &block_offset,
+						sizeof(header.symlink));
+		SQUASHFS_INSWAP_SYMLINK_INODE_HEADER(&header.symlink);
+		inode->nlink = header.symlink.nlink;
+		inode->size = header.symlink.symlink_size;
+
+		/* the xattr follows the symlink target */
+		if(res == 0 && inode->type == SQUASHFS_LSYMLINK_TYPE) {
+			long long xattr_block = block;
+			int xattr_offset = block_offset, size = inode->size;
+
+			while(res == 0 && size) {
+				char buffer[256];
+				int bytes = size > 256 ? 256 : size;
+
+				res = read_meta(reader, buffer, &xattr_block,
+						&xattr_offset, bytes);
+				size -= bytes;
+			}
+
+			if(res == 0)
+				res = read_meta(reader, &inode->xattr,
+					&xattr_block, &xattr_offset,
+					sizeof(inode->xattr));
+			SQUASHFS_INSWAP_INTS(&inode->xattr, 1);
+		}
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE:
+		res = read_meta(reader, &header.dev, &block, &block_offset,
+							sizeof(header.dev));
+		SQUASHFS_INSWAP_DEV_INODE_HEADER(&header.dev);
+		inode->nlink = header.dev.nlink;
+		inode->rdev = header.dev.rdev;
+		break;
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		res = read_meta(reader, &header.ldev, &block, &block_offset,
+							sizeof(header.ldev));
+		SQUASHFS_INSWAP_LDEV_INODE_HEADER(&header.ldev);
+		inode->nlink = header.ldev.nlink;
+		inode->rdev = header.ldev.rdev;
+		inode->xattr = header.ldev.xattr;
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_SOCKET_TYPE:
+		res = read_meta(reader, &header.ipc, &block, &block_offset,
+							sizeof(header.ipc));
+		SQUASHFS_INSWAP_IPC_INODE_HEADER(&header.ipc);
+		inode->nlink = header.ipc.nlink;
+		break;
+	case SQUASHFS_LFIFO_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		res = read_meta(reader, &header.lipc, &block, &block_offset,
+							sizeof(header.lipc));
+		SQUASHFS_INSWAP_LIPC_INODE_HEADER(&header.lipc);
+		inode->nlink = header.lipc.nlink;
+		inode->xattr = header.lipc.xattr;
+		break;
+	}
+
+	inode->block = block;
+	inode->block_offset = block_offset;
+
+	return res;
+}
+
+
+void meta_opendir(struct meta_reader *reader, struct meta_inode *inode,
+	struct meta_dir *dir)
+{
+	dir->block = reader->sBlk->directory_table_start + inode->start;
+	dir->offset = inode->offset;
+	dir->bytes = 3;
+	dir->size = inode->size;
+	dir->count = 0;
+}
+
+
+/*
+ * Read the next entry of dir, returning 1, or 0 at the end of the
+ * directory.  Names are checked for '/', embedded nuls, "." and ".."
+ */
+int meta_readdir(struct meta_reader *reader, struct meta_dir *dir,
+	struct meta_dirent *dirent)
+{
+	struct squashfs_dir_entry dire;
+	int res;
+
+	while(dir->count == 0) {
+		struct squashfs_dir_header dirh;
+
+		if(dir->bytes >= dir->size)
+			return 0;
+
+		res = read_meta(reader, &dirh, &dir->block, &dir->offset,
+								sizeof(dirh));
+		if(res)
+			return res;
+
+		SQUASHFS_INSWAP_DIR_HEADER(&dirh);
+		dir->bytes += sizeof(dirh);
+		dir->count = dirh.count + 1;
+		dir->start_block = dirh.start_block;
+		dir->inode_number = dirh.inode_number;
+
+		if(dir->count > SQUASHFS_DIR_COUNT)
+			return -EIO;
+	}
+
+	res = read_meta(reader, &dire, &dir->block, &dir->offset,
+								sizeof(dire));
+	if(res)
+		return res;
+
+	SQUASHFS_INSWAP_DIR_ENTRY(&dire);
+	if(dire.size >= SQUASHFS_NAME_LEN || meta_type_mode(dire.type) == 0)
+		return -EIO;
+
+	res = read_meta(reader, dirent->name, &dir->block, &dir->offset,
+								dire.size + 1);
+	if(res)
+		return res;
+
+	dirent->name[dire.size + 1] = '\0';
+	if(strlen(dirent->name) != dire.size + 1 || strchr(dirent->name, '/')
+			|| strcmp(dirent->name, ".") == 0 ||
+			strcmp(dirent->name, "..") == 0)
+		return -EIO;
+
+	dirent->type = dire.type;
+	dirent->inode_number = dir->inode_number + dire.inode_number;
+	dirent->start_block = dir->start_block;
+	dirent->offset = dire.offset;
+
+	dir->bytes += sizeof(dire) + dire.size + 1;
+	dir->count --;
+
+	return 1;
+}
+
+
+/*
+ * Return in end the end of the fragment index.  It is followed by the
+ * metadata blocks of the export table, or if there isn't one the id table,
+ * and so is the first entry of that table's index
+ */
+static int fragment_index_end(struct meta_reader *reader, long long *end)
+{
+	struct squashfs_super_block *sBlk = reader->sBlk;
+	int res = read_bytes(reader, sBlk->lookup_table_start !=
+		SQUASHFS_INVALID_BLK ? sBlk->lookup_table_start :
+		sBlk->id_table_start, sizeof(*end), end);
+
+	SQUASHFS_INSWAP_LONG_LONGS(end, 1);
+	return res;
+}
+
+
+/*
+ * Read the fragment table into a malloced array, which is NULL if there are
+ * no fragments.  The fragment count is checked against the position of the
+ * following table before anything is allocated
+ */
+int read_meta_fragments(struct meta_reader *reader,
+	struct squashfs_fragment_entry **table)
+{
+	unsigned int i, fragments = reader->sBlk->fragments;
+	int res, indexes = SQUASHFS_FRAGMENT_INDEXES((long long) fragments);
+	long long bytes = SQUASHFS_FRAGMENT_BYTES((long long) fragments);
+	long long *index, end;
+
+	*table = NULL;
+	if(fragments == 0)
+		return 0;
+
+	/* the number of fragments should not exceed the number of inodes */
+	if(fragments > reader->sBlk->inodes)
+		return -EIO;
+
+	res = fragment_index_end(reader, &end);
+	if(res)
+		return res;
+
+	if(end - reader->sBlk->fragment_table_start !=
+			SQUASHFS_FRAGMENT_INDEX_BYTES((long long) fragments))
+		return -EIO;
+
+	index = malloc(indexes * sizeof(long long));
+	*table = malloc(bytes);
+	if(index == NULL || *table == NULL) {
+		res = -ENOMEM;
+		goto failed;
+	}
+
+	res = read_bytes(reader, reader->sBlk->fragment_table_start,
+			indexes * sizeof(long long), index);
+	if(res)
+		goto failed;
+
+	SQUASHFS_INSWAP_FRAGMENT_INDEXES(index, indexes);
+
+	for(i = 0; i < indexes; i++) {
+		int length = bytes > SQUASHFS_METADATA_SIZE ?
+				SQUASHFS_METADATA_SIZE : bytes;
+		long long block = index[i];
+		int offset = 0;
+
+		res = read_meta(reader, ((char *) *table) + (long long) i *
+			SQUASHFS_METADATA_SIZE, &block, &offset, length);
+		if(res)
+			goto failed;
+		bytes -= length;
+	}
+
+	for(i = 0; i < fragments; i++)
+		SQUASHFS_INSWAP_FRAGMENT_ENTRY(&(*table)[i]);
+
+	free(index);
+	return 0;
+
+failed:
+	free(index);
+	free(*table);
+	*table = NULL;
+	return res;
+}
+
+
+static int scan_inode(struct meta_reader *reader, char *pathname,
+	unsigned int start_block, unsigned int offset, int depth)
+{
+	struct meta_inode inode;
+	struct meta_dirent dirent;
+	struct meta_dir dir;
+	int res;
+
+	/*
+	 * A corrupted directory entry pointing back at a parent would
+	 * otherwise recurse until the stack overflows
+	 */
+	if(depth > META_MAX_DEPTH)
+		return -ELOOP;
+
+	res = read_meta_inode(reader, start_block, offset, &inode);
+	if(res)
+		return res;
+
+	if(S_ISREG(inode.mode))
+		reader->file(reader, pathname, &inode);
+
+	if(!S_ISDIR(inode.mode))
+		return 0;
+
+	meta_opendir(reader, &inode, &dir);
+
+	while((res = meta_readdir(reader, &dir, &dirent)) == 1) {
+		char *subpath = NULL;
+
+		if(reader->pathnames && asprintf(&subpath, "%s/%s", pathname,
+							dirent.name) == -1)
+			return -ENOMEM;
+
+		res = scan_inode(reader, subpath, dirent.start_block,
+						dirent.offset, depth + 1);
+		free(subpath);
+		if(res)
+			return res;
+	}
+
+	return res;
+}
+
+
+/*
+ * Walk the directory tree, calling file for each regular file.  If
+ * pathnames is set, each file is passed its pathname relative to the root
+ */
+int scan_meta(struct meta_reader *reader, int pathnames,
+	void (*file)(struct meta_reader *, char *, struct meta_inode *),
+	void *arg)
+{
+	reader->pathnames = pathnames;
+	reader->file = file;
+	reader->arg = arg;
+
+	return scan_inode(reader, pathnames ? "" : NULL,
+		SQUASHFS_INODE_BLK(reader->sBlk->root_inode),
+		SQUASHFS_INODE_OFFSET(reader->sBlk->root_inode), 1);
+}
@@ -0,0 +1,115 @@
+#ifndef READ_META_H
+#define READ_META_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * read_meta.h
+ */
+
+/* number of uncompressed metadata blocks cached by meta_reader_init() */
+#define META_CACHE_SIZE	64
+
+struct meta_block;
+
+/* an inode of any type */
+struct meta_inode {
+	int				type;
+	unsigned int			mode;		/* type and permissions */
+	unsigned int			uid;		/* index into id table */
+	unsigned int			gid;
+	unsigned int			mtime;
+	unsigned int			inode_number;
+	unsigned int			nlink;
+	long long			size;		/* file, dir or symlink */
+	long long			start;		/* data or dir start */
+	unsigned int			offset;		/* fragment or dir */
+	unsigned int			fragment;
+	unsigned int			i_count;	/* dir index count */
+	unsigned int			rdev;
+	unsigned int			xattr;
+	int				sparse;
+	/* the block list, directory index or symlink target that follows */
+	long long			block;
+	int				block_offset;
+};
+
+/*
+ * How the inode and directory tables are read.  Read copies length bytes
+ * of metadata at block/offset into buff, moving block/offset on, and
+ * returns 0 or -errno.  Apart from scan_meta() the decoding functions don't
+ * change the reader, and so can be used by many threads if read can be
+ */
+struct meta_reader {
+	struct squashfs_super_block	*sBlk;
+	int				(*read)(struct meta_reader *, void *,
+						long long *, int *, int);
+	void				*arg;		/* for read or file */
+
+	/* used by the reader set up by meta_reader_init() */
+	int				fd;
+	struct compressor		*comp;
+	struct meta_block		*cache;
+
+	/* used by scan_meta() */
+	int				pathnames;
+	void				(*file)(struct meta_reader *, char *,
+						struct meta_inode *);
+};
+
+/* position in a directory */
+struct meta_dir {
+	long long			block;
+	int				offset;
+	unsigned int			bytes;
+	unsigned int			size;
+	unsigned int			count;
+	unsigned int			start_block;
+	unsigned int			inode_number;
+};
+
+struct meta_dirent {
+	char				name[SQUASHFS_NAME_LEN + 1];
+	int				type;
+	unsigned int			inode_number;
+	unsigned int			start_block;
+	unsigned int			offset;
+};
+
+static inline int read_meta(struct meta_reader *reader, void *buff,
+	long long *block, int *offset, int length)
+{
+	return reader->read(reader, buff, block, offset, length);
+}
+
+extern int meta_reader_init(struct meta_reader *, int,
+	struct squashfs_super_block *, struct compressor *);
+extern void meta_reader_free(struct meta_reader *);
+extern unsigned int meta_type_mode(int);
+extern int read_meta_inode(struct meta_reader *, unsigned int, unsigned int,
+	struct meta_inode *);
+extern void meta_opendir(struct meta_reader *, struct meta_inode *,
+	struct meta_dir *);
+extern int meta_readdir(struct meta_reader *, struct meta_dir *,
+	struct meta_dirent *);
+extern int read_meta_fragments(struct meta_reader *,
+	struct squashfs_fragment_entry **);
+extern int scan_meta(struct meta_reader *, int, void (*)(struct meta_reader *,
+	char *, struct meta_inode *), void *);
+#endif
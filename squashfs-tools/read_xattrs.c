@@ -30,6 +30,7 @@
 #define FALSE 0
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_swap.h"
@@ -41,15 +42,43 @@
 extern int read_fs_bytes(int, long long, int, void *);
 extern int read_block(int, long long, long long *, int, void *);
 
-static struct hash_entry {
-	long long		start;
-	unsigned int		offset;
-	struct hash_entry	*next;
-} *hash_table[65536];
+/*
+ * Cache of uncompressed xattr metadata blocks.  The xattr metadata is read
+ * and decompressed on demand, rather than all of it up front, as often only
+ * a few files' xattrs are needed.  The cache is direct mapped on the location
+ * of the compressed block, and so is bounded in size
+ */
+static struct xattr_block {
+	long long	start;
+	long long	next;
+	int		length;
+	unsigned char	data[SQUASHFS_METADATA_SIZE];
+} *block_cache;
+
+/*
+ * Position within the xattr metadata, as the location of the compressed
+ * metadata block and the offset within the uncompressed block
+ */
+struct xattr_cursor {
+	long long	start;
+	unsigned int	offset;
+};
+
+/*
+ * Inodes with the same xattrs share the same xattr id, and so the xattr
+ * list of each id used is constructed once and shared
+ */
+struct xattr_set {
+	struct xattr_list	*xattr_list;
+	unsigned int		count;
+	int			failed;
+};
 
 static struct squashfs_xattr_id *xattr_ids;
-static void *xattrs = NULL;
-static long long xattr_table_start;
+static struct xattr_set **xattr_sets;
+static long long xattr_table_start, xattr_table_end;
+static int xattr_fd;
+static pthread_mutex_t xattr_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Prefix lookup table, storing mapping to/from prefix string and prefix id
@@ -62,45 +91,84 @@ struct prefix prefix_table[] = {
 };
 
 /*
- * store mapping from location of compressed block in fs ->
- * location of uncompressed block in memory
+ * Return the uncompressed xattr metadata block at location start in the fs,
+ * reading and decompressing it if it isn't in the cache
  */
-static int save_xattr_block(long long start, int offset)
+static struct xattr_block *get_xattr_block(long long start)
 {
-	struct hash_entry *hash_entry = malloc(sizeof(*hash_entry));
-	int hash = start & 0xffff;
+	int hash = (start ^ (start >> 13)) & (XATTR_BLOCK_CACHE_SIZE - 1);
+	struct xattr_block *block = &block_cache[hash];
 
-	TRACE("save_xattr_block: start %lld, offset %d\n", start, offset);
+	if(block->length && block->start == start)
+		return block;
 
-	if(hash_entry == NULL)
-		return FALSE;
+	TRACE("get_xattr_block: reading block @0x%llx\n", start);
 
-	hash_entry->start = start;
-	hash_entry->offset = offset;
-	hash_entry->next = hash_table[hash];
-	hash_table[hash] = hash_entry;
+	if(start < xattr_table_start || start >= xattr_table_end) {
+		ERROR("Xattr block at 0x%llx is outside the xattr table\n",
+			start);
+		return NULL;
+	}
 
-	return TRUE;
+	block->length = read_block(xattr_fd, start, &block->next, 0,
+		block->data);
+	if(block->length == 0) {
+		ERROR("Failed to read xattr block at 0x%llx\n", start);
+		return NULL;
+	}
+
+	/*
+	 * If this is not the last metadata block in the xattr metadata
+	 * then it should be SQUASHFS_METADATA_SIZE in size.
+	 */
+	if(block->next != xattr_table_end &&
+			block->length != SQUASHFS_METADATA_SIZE) {
+		ERROR("Xattr block at 0x%llx should be %d bytes in length, "
+			"it is %d bytes\n", start, SQUASHFS_METADATA_SIZE,
+			block->length);
+		block->length = 0;
+		return NULL;
+	}
+
+	block->start = start;
+	return block;
 }
 
 
 /*
- * map from location of compressed block in fs ->
- * location of uncompressed block in memory
+ * Copy bytes of xattr metadata at cursor to dest (or skip them if dest is
+ * NULL), and advance the cursor.  Xattrs can straddle metadata blocks, in
+ * which case the copy continues into the following block
  */
-static int get_xattr_block(long long start)
+static int read_xattr_bytes(struct xattr_cursor *cursor, int bytes, void *dest)
 {
-	int hash = start & 0xffff;
-	struct hash_entry *hash_entry = hash_table[hash];
+	while(bytes) {
+		struct xattr_block *block = get_xattr_block(cursor->start);
+		int size;
 
-	for(; hash_entry; hash_entry = hash_entry->next)
-		if(hash_entry->start == start)
-			break;
+		if(block == NULL)
+			return FALSE;
 
-	TRACE("get_xattr_block: start %lld, offset %d\n", start,
-		hash_entry ? hash_entry->offset : -1);
+		if(cursor->offset >= block->length) {
+			cursor->offset -= block->length;
+			cursor->start = block->next;
+			continue;
+		}
+
+		size = block->length - cursor->offset;
+		if(size > bytes)
+			size = bytes;
+
+		if(dest) {
+			memcpy(dest, block->data + cursor->offset, size);
+			dest += size;
+		}
+
+		cursor->offset += size;
+		bytes -= size;
+	}
 
-	return hash_entry ? hash_entry->offset : -1;
+	return TRUE;
 }
 
 
@@ -109,7 +177,7 @@ static int get_xattr_block(long long start)
  * mapping name and prefix into a full name
  */
 static int read_xattr_entry(struct xattr_list *xattr,
-	struct squashfs_xattr_entry *entry, void *name)
+	struct squashfs_xattr_entry *entry, struct xattr_cursor *cursor)
 {
 	int i, len, type = entry->type & XATTR_PREFIX_MASK;
 
@@ -119,7 +187,7 @@ static int read_xattr_entry(struct xattr_list *xattr,
 
 	if(prefix_table[i].type == -1) {
 		ERROR("read_xattr_entry: Unrecognised xattr type %d\n", type);
-		return 0;
+		return read_xattr_bytes(cursor, entry->size, NULL) ? 0 : -1;
 	}
 
 	len = strlen(prefix_table[i].prefix);
@@ -130,7 +198,12 @@ static int read_xattr_entry(struct xattr_list *xattr,
 	}
 
 	memcpy(xattr->full_name, prefix_table[i].prefix, len);
-	memcpy(xattr->full_name + len, name, entry->size);
+	if(read_xattr_bytes(cursor, entry->size, xattr->full_name + len) ==
+								FALSE) {
+		free(xattr->full_name);
+		return -1;
+	}
+
 	xattr->full_name[len + entry->size] = '\0';
 	xattr->name = xattr->full_name + len;
 	xattr->size = entry->size;
@@ -141,8 +214,37 @@ static int read_xattr_entry(struct xattr_list *xattr,
 
 
 /*
- * Read and decompress the xattr id table and the xattr metadata.
- * This is cached in memory for later use by get_xattr()
+ * Read the value at cursor into a newly allocated buffer
+ */
+static void *read_xattr_value(struct xattr_cursor *cursor, int *vsize)
+{
+	struct squashfs_xattr_val val;
+	void *value;
+
+	if(read_xattr_bytes(cursor, sizeof(val), &val) == FALSE)
+		return NULL;
+
+	SQUASHFS_INSWAP_XATTR_VAL(&val);
+
+	value = malloc(val.vsize ? val.vsize : 1);
+	if(value == NULL) {
+		ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
+		return NULL;
+	}
+
+	if(read_xattr_bytes(cursor, val.vsize, value) == FALSE) {
+		free(value);
+		return NULL;
+	}
+
+	*vsize = val.vsize;
+	return value;
+}
+
+
+/*
+ * Read the xattr id table.  The xattr metadata is read and decompressed
+ * on demand by get_xattr()
  */
 int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk, int flag, long long *table_start)
 {
@@ -156,7 +258,7 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk, int flag, l
 	int res, i, indexes, index_bytes;
 	unsigned int ids;
 	long long bytes;
-	long long *index, start, end;
+	long long *index;
 	struct squashfs_xattr_table id_table;
 
 	TRACE("read_xattrs_from_disk\n");
@@ -232,7 +334,10 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk, int flag, l
 	 */
 	bytes = SQUASHFS_XATTR_BYTES((long long) ids);
 	xattr_ids = malloc(bytes);
-	if(xattr_ids == NULL) {
+	xattr_sets = calloc(ids, sizeof(struct xattr_set *));
+	block_cache = calloc(XATTR_BLOCK_CACHE_SIZE,
+						sizeof(struct xattr_block));
+	if(xattr_ids == NULL || xattr_sets == NULL || block_cache == NULL) {
 		ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
 		return -1;
 	}
@@ -254,53 +359,12 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk, int flag, l
 	}
 
 	/*
-	 * Read and decompress the xattr metadata
-	 *
 	 * Note the first xattr id table metadata block is immediately after
 	 * the last xattr metadata block, so we can use index[0] to work out
 	 * the end of the xattr metadata
 	 */
-	start = xattr_table_start;
-	end = index[0];
-	for(i = 0; start < end; i++) {
-		int length, res;
-		xattrs = realloc(xattrs, (i + 1) * SQUASHFS_METADATA_SIZE);
-		if(xattrs == NULL) {
-			ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
-			return -1;
-		}
-
-		/* store mapping from location of compressed block in fs ->
-		 * location of uncompressed block in memory */
-		res = save_xattr_block(start, i * SQUASHFS_METADATA_SIZE);
-		if (res == FALSE) {
-			ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
-			return -1;
-		}
-
-		length = read_block(fd, start, &start, 0,
-			((unsigned char *) xattrs) +
-			(i * SQUASHFS_METADATA_SIZE));
-		TRACE("Read xattr block %d, length %d\n", i, length);
-		if(length == 0) {
-			ERROR("Failed to read xattr block %d\n", i);
-			goto failed3;
-		}
-
-		/*
-		 * If this is not the last metadata block in the xattr metadata
-		 * then it should be SQUASHFS_METADATA_SIZE in size.
-		 * Note, we can't use expected in read_block() above for this
-		 * because we don't know if this is the last block until
-		 * after reading.
-		 */
-		if(start != end && length != SQUASHFS_METADATA_SIZE) {
-			ERROR("Xattr block %d should be %d bytes in length, "
-				"it is %d bytes\n", i, SQUASHFS_METADATA_SIZE,
-				length);
-			goto failed3;
-		}
-	}
+	xattr_table_end = index[0];
+	xattr_fd = fd;
 
 	/* swap if necessary the xattr id entries */
 	for(i = 0; i < ids; i++)
@@ -310,10 +374,10 @@ int read_xattrs_from_disk(int fd, struct squashfs_super_block *sBlk, int flag, l
 
 	return ids;
 
-failed3:
-	free(xattrs);
 failed2:
 	free(xattr_ids);
+	free(xattr_sets);
+	free(block_cache);
 failed1:
 	free(index);
 
@@ -325,8 +389,10 @@ void free_xattr(struct xattr_list *xattr_list, int count)
 {
 	int i;
 
-	for(i = 0; i < count; i++)
+	for(i = 0; i < count; i++) {
 		free(xattr_list[i].full_name);
+		free(xattr_list[i].value);
+	}
 
 	free(xattr_list);
 }
@@ -338,7 +404,7 @@ void free_xattr(struct xattr_list *xattr_list, int count)
  *
  * There are two users for get_xattr(), Mksquashfs uses it to read the
  * xattrs from the filesystem on appending, and Unsquashfs uses it
- * to retrieve the xattrs for writing to disk.
+ * (via get_shared_xattr()) to retrieve the xattrs for writing to disk.
  *
  * Unfortunately, the two users disagree on what to do with unknown
  * xattr prefixes, Mksquashfs wants to treat this as fatal otherwise
@@ -354,10 +420,8 @@ void free_xattr(struct xattr_list *xattr_list, int count)
  */
 struct xattr_list *get_xattr(int i, unsigned int *count, int *failed)
 {
-	long long start;
+	struct xattr_cursor cursor;
 	struct xattr_list *xattr_list = NULL;
-	unsigned int offset;
-	void *xptr;
 	int j, n, res = 1;
 
 	TRACE("get_xattr\n");
@@ -370,72 +434,128 @@ struct xattr_list *get_xattr(int i, unsigned int *count, int *failed)
 	} else
 		*failed = FALSE;
 
-	start = SQUASHFS_XATTR_BLK(xattr_ids[i].xattr) + xattr_table_start;
-	offset = SQUASHFS_XATTR_OFFSET(xattr_ids[i].xattr);
-	xptr = xattrs + get_xattr_block(start) + offset;
+	cursor.start = SQUASHFS_XATTR_BLK(xattr_ids[i].xattr) +
+							xattr_table_start;
+	cursor.offset = SQUASHFS_XATTR_OFFSET(xattr_ids[i].xattr);
 
 	TRACE("get_xattr: xattr_id %d, count %d, start %lld, offset %d\n", i,
-			xattr_ids[i].count, start, offset);
+			xattr_ids[i].count, cursor.start, cursor.offset);
 
 	for(j = 0, n = 0; n < xattr_ids[i].count; n++) {
 		struct squashfs_xattr_entry entry;
 		struct squashfs_xattr_val val;
 
 		if(res != 0) {
-			xattr_list = realloc(xattr_list, (j + 1) *
+			struct xattr_list *list = realloc(xattr_list, (j + 1) *
 						sizeof(struct xattr_list));
-			if(xattr_list == NULL) {
+			if(list == NULL) {
 				ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
-				*failed = FALSE;
-				return NULL;
+				goto failed;
 			}
+			xattr_list = list;
 		}
-			
-		SQUASHFS_SWAP_XATTR_ENTRY(xptr, &entry);
-		xptr += sizeof(entry);
 
-		res = read_xattr_entry(&xattr_list[j], &entry, xptr);
+		if(read_xattr_bytes(&cursor, sizeof(entry), &entry) == FALSE)
+			goto failed;
+
+		SQUASHFS_INSWAP_XATTR_ENTRY(&entry);
+
+		res = read_xattr_entry(&xattr_list[j], &entry, &cursor);
 		if(res == 0) {
 			/* unknown type, skip, and set error flag */
-			xptr += entry.size;
-			SQUASHFS_SWAP_XATTR_VAL(xptr, &val);
-			xptr += sizeof(val) + val.vsize;
+			if(read_xattr_bytes(&cursor, sizeof(val), &val) ==
+								FALSE)
+				goto failed;
+			SQUASHFS_INSWAP_XATTR_VAL(&val);
+			if(read_xattr_bytes(&cursor, val.vsize, NULL) == FALSE)
+				goto failed;
 			*failed = TRUE;
 			continue;
-		} else if(res == -1) {
-			ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
-			*failed = FALSE;
-			return NULL;
-		}
+		} else if(res == -1)
+			goto failed;
 
-		xptr += entry.size;
-			
 		TRACE("get_xattr: xattr %d, type %d, size %d, name %s\n", j,
 			entry.type, entry.size, xattr_list[j].full_name); 
 
 		if(entry.type & SQUASHFS_XATTR_VALUE_OOL) {
+			struct xattr_cursor ool_cursor;
 			long long xattr;
-			void *ool_xptr;
-
-			xptr += sizeof(val);
-			SQUASHFS_SWAP_LONG_LONGS(xptr, &xattr, 1);
-			xptr += sizeof(xattr);	
-			start = SQUASHFS_XATTR_BLK(xattr) + xattr_table_start;
-			offset = SQUASHFS_XATTR_OFFSET(xattr);
-			ool_xptr = xattrs + get_xattr_block(start) + offset;
-			SQUASHFS_SWAP_XATTR_VAL(ool_xptr, &val);
-			xattr_list[j].value = ool_xptr + sizeof(val);
-		} else {
-			SQUASHFS_SWAP_XATTR_VAL(xptr, &val);
-			xattr_list[j].value = xptr + sizeof(val);
-			xptr += sizeof(val) + val.vsize;
+
+			if(read_xattr_bytes(&cursor, sizeof(val), NULL) ==
+								FALSE ||
+					read_xattr_bytes(&cursor,
+					sizeof(xattr), &xattr) == FALSE) {
+				free(xattr_list[j].full_name);
+				goto failed;
+			}
+
+			SQUASHFS_INSWAP_LONG_LONGS(&xattr, 1);
+			ool_cursor.start = SQUASHFS_XATTR_BLK(xattr) +
+							xattr_table_start;
+			ool_cursor.offset = SQUASHFS_XATTR_OFFSET(xattr);
+			xattr_list[j].value = read_xattr_value(&ool_cursor,
+							&xattr_list[j].vsize);
+		} else
+			xattr_list[j].value = read_xattr_value(&cursor,
+							&xattr_list[j].vsize);
+
+		if(xattr_list[j].value == NULL) {
+			free(xattr_list[j].full_name);
+			goto failed;
 		}
 
-		TRACE("get_xattr: xattr %d, vsize %d\n", j, val.vsize);
+		TRACE("get_xattr: xattr %d, vsize %d\n", j,
+							xattr_list[j].vsize);
 
-		xattr_list[j++].vsize = val.vsize;
+		j++;
 	}
 
 	*count = j;
 	return xattr_list;
+
+failed:
+	free_xattr(xattr_list, j);
+	*failed = FALSE;
+	return NULL;
+}
+
+
+/*
+ * As get_xattr(), but the list constructed for each xattr id is cached, and
+ * shared by all the inodes with that xattr id.  The list must not be freed.
+ * Can be called by multiple threads
+ */
+struct xattr_list *get_shared_xattr(int i, unsigned int *count, int *failed)
+{
+	struct xattr_set *set;
+
+	pthread_cleanup_push((void *) pthread_mutex_unlock, &xattr_mutex);
+	pthread_mutex_lock(&xattr_mutex);
+
+	set = xattr_sets[i];
+	if(set == NULL) {
+		set = malloc(sizeof(struct xattr_set));
+		if(set == NULL)
+			ERROR("FATAL ERROR: Out of memory (%s)\n", __func__);
+		else {
+			set->xattr_list = get_xattr(i, &set->count,
+							&set->failed);
+			if(set->xattr_list == NULL && set->failed == FALSE) {
+				free(set);
+				set = NULL;
+			} else
+				xattr_sets[i] = set;
+		}
+	}
+
+	pthread_cleanup_pop(1);
+
+	if(set == NULL) {
+		*failed = FALSE;
+		return NULL;
+	}
+
+	*count = set->count;
+	*failed = set->failed;
+	return set->xattr_list;
 }
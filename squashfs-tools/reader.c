@@ -38,6 +38,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include "squashfs_fs.h"
 #include "mksquashfs.h"
 #include "caches-queues-lists.h"
@@ -96,22 +97,6 @@ static char *pathname(struct dir_ent *dir_ent)
 }
 
 
-static inline int is_fragment(struct inode_info *inode)
-{
-	off_t file_size = inode->buf.st_size;
-
-	/*
-	 * If this block is to be compressed differently to the
-	 * fragment compression then it cannot be a fragment
-	 */
-	if(inode->noF != noF)
-		return FALSE;
-
-	return !inode->no_fragments && file_size && (file_size < block_size ||
-		(inode->always_use_fragments && file_size & (block_size - 1)));
-}
-
-
 static void put_file_buffer(struct file_buffer *file_buffer)
 {
 	/*
@@ -132,6 +117,159 @@ static void put_file_buffer(struct file_buffer *file_buffer)
 }
 
 
+/*
+ * Send a block which lies entirely within a hole in the source file
+ * directly to the main thread as a sparse block, without reading it, or
+ * sending it through the deflate threads to find it is all zeros
+ */
+static void put_sparse_buffer(struct file_buffer *file_buffer)
+{
+	file_buffer->c_byte = 0;
+	file_buffer->fragment = FALSE;
+	seq_queue_put(to_main, file_buffer);
+}
+
+
+/*
+ * Return TRUE if the size bytes at offset in file are entirely a hole.
+ * *data caches the start of the next data region found by SEEK_DATA, which
+ * is -1 if not yet known, and LLONG_MAX if there's no data after it.
+ * SEEK_DATA moves the file position, and so *seeked is set if the
+ * position needs to be restored before the next read.
+ */
+static int is_hole(int file, long long offset, int size, long long *data,
+	int *seeked)
+{
+#ifdef SEEK_DATA
+	if(*data == -2)
+		/* SEEK_DATA is not supported on this file */
+		return FALSE;
+
+	if(*data < offset) {
+		off_t res = lseek(file, offset, SEEK_DATA);
+
+		*seeked = TRUE;
+		if(res != -1)
+			*data = res;
+		else if(errno == ENXIO)
+			*data = LLONG_MAX;
+		else {
+			*data = -2;
+			return FALSE;
+		}
+	}
+
+	return *data >= offset + size;
+#else
+	return FALSE;
+#endif
+}
+
+
+/*
+ * Open a source file, applying the -noatime and -direct-io options.  These
+ * are dropped for files which don't allow them, O_NOATIME is only allowed
+ * on files we own, and not all filesystems support O_DIRECT
+ */
+static int open_source(char *pathname)
+{
+	int file, flags = O_RDONLY;
+
+#ifdef O_NOATIME
+	if(noatime)
+		flags |= O_NOATIME;
+#endif
+#ifdef O_DIRECT
+	if(direct_io)
+		flags |= O_DIRECT;
+#endif
+
+	while(1) {
+		file = open(pathname, flags);
+		if(file != -1)
+			break;
+		else if(errno == EINTR)
+			continue;
+#ifdef O_NOATIME
+		else if(errno == EPERM && (flags & O_NOATIME))
+			flags &= ~O_NOATIME;
+#endif
+#ifdef O_DIRECT
+		else if(errno == EINVAL && (flags & O_DIRECT))
+			flags &= ~O_DIRECT;
+#endif
+		else
+			return -1;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if(drop_caches)
+		posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	return file;
+}
+
+
+/*
+ * Read bytes from a source file.  With O_DIRECT a read which isn't
+ * aligned fails with EINVAL, which happens reading the tail of a file, and
+ * in that case O_DIRECT is turned off and the read carries on without it
+ */
+static int read_source(int file, char *buff, int bytes)
+{
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = read(file, buff + count, bytes - count);
+		if(res == 0)
+			break;
+		else if(res == -1) {
+#ifdef O_DIRECT
+			int flags = errno == EINVAL ? fcntl(file, F_GETFL) : -1;
+
+			if(flags != -1 && (flags & O_DIRECT) && fcntl(file,
+					F_SETFL, flags & ~O_DIRECT) == 0) {
+				res = 0;
+				continue;
+			}
+#endif
+			if(errno != EINTR) {
+				ERROR("Read failed because %s\n",
+							strerror(errno));
+				return -1;
+			}
+			res = 0;
+		}
+	}
+
+	return count;
+}
+
+
+/*
+ * With -drop-caches, drop the first bytes of a source file, which have been
+ * read, from the page cache, or all of it if bytes is 0.  The page cache
+ * may hold a file in large folios, which are only dropped if they're
+ * entirely in the range, and so the range always starts at the beginning
+ * of the file rather than being just the data last read
+ */
+static void drop_source(int file, long long bytes)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if(drop_caches)
+		posix_fadvise(file, 0, bytes, POSIX_FADV_DONTNEED);
+#endif
+}
+
+
+static void close_source(int file)
+{
+	drop_source(file, 0);
+	close(file);
+}
+
+
 static int seq = 0;
 static void reader_read_process(struct dir_ent *dir_ent)
 {
@@ -157,6 +295,7 @@ static void reader_read_process(struct dir_ent *dir_ent)
 		file_buffer = cache_get_nohash(reader_buffer);
 		file_buffer->sequence = seq ++;
 		file_buffer->noD = inode->noD;
+		file_buffer->incremental = NULL;
 
 		byte = read_bytes(file, file_buffer->data, block_size);
 		if(byte == -1)
@@ -211,7 +350,7 @@ static void reader_read_process(struct dir_ent *dir_ent)
 		seq --;
 	}
 	prev_buffer->file_size = bytes;
-	prev_buffer->fragment = is_fragment(inode);
+	prev_buffer->fragment = is_fragment_inode(inode);
 	put_file_buffer(prev_buffer);
 
 	return;
@@ -233,8 +372,8 @@ static void reader_read_file(struct dir_ent *dir_ent)
 {
 	struct stat *buf = &dir_ent->inode->buf, buf2;
 	struct file_buffer *file_buffer;
-	int blocks, file, res;
-	long long bytes, read_size;
+	int blocks, file, res, seeked, hole;
+	long long bytes, read_size, data;
 	struct inode_info *inode = dir_ent->inode;
 
 	if(inode->read)
@@ -245,13 +384,15 @@ again:
 	bytes = 0;
 	read_size = buf->st_size;
 	blocks = (read_size + block_size - 1) >> block_log;
+	seeked = hole = FALSE;
 
-	while(1) {
-		file = open(pathname(dir_ent), O_RDONLY);
-		if(file != -1 || errno != EINTR)
-			break;
-	}
+	/*
+	 * Only look for holes in files which have fewer blocks allocated
+	 * than their size, and only if sparse files are being created
+	 */
+	data = sparse_files && (buf->st_blocks << 9) < read_size ? -1 : -2;
 
+	file = open_source(pathname(dir_ent));
 	if(file == -1) {
 		file_buffer = cache_get_nohash(reader_buffer);
 		file_buffer->sequence = seq ++;
@@ -263,8 +404,33 @@ again:
 		file_buffer->file_size = read_size;
 		file_buffer->sequence = seq ++;
 		file_buffer->noD = inode->noD;
+		file_buffer->incremental = inode->incremental;
+		file_buffer->old_block = bytes >> block_log;
 		file_buffer->error = FALSE;
 
+		/*
+		 * Skip blocks which are entirely holes.  A tail block which
+		 * is going to be a fragment is always read, as the fragment
+		 * needs its data
+		 */
+		file_buffer->size = blocks > 1 ? block_size : read_size - bytes;
+		hole = (blocks > 1 || !is_fragment_inode(inode)) &&
+			is_hole(file, bytes, file_buffer->size, &data, &seeked);
+		if(hole) {
+			bytes += file_buffer->size;
+
+			/* the tail block is sent once EOF has been checked */
+			if(blocks > 1)
+				put_sparse_buffer(file_buffer);
+			continue;
+		}
+
+		if(seeked) {
+			if(lseek(file, bytes, SEEK_SET) == -1)
+				goto read_err;
+			seeked = FALSE;
+		}
+
 		/*
 		 * Always try to read block_size bytes from the file rather
 		 * than expected bytes (which will be less than the block_size
@@ -274,12 +440,14 @@ again:
 		 * case where the file is an exact multiple of the block_size
 		 * is dealt with later.
 		 */
-		file_buffer->size = read_bytes(file, file_buffer->data,
+		file_buffer->size = read_source(file, file_buffer->data,
 			block_size);
 		if(file_buffer->size == -1)
 			goto read_err;
 
 		bytes += file_buffer->size;
+		if(bytes % DROP_CACHES_CHUNK == 0)
+			drop_source(file, bytes);
 
 		if(blocks > 1) {
 			/* non-tail block should be exactly block_size */
@@ -295,16 +463,20 @@ again:
 	if(read_size != bytes)
 		goto restat;
 
-	if(read_size && read_size % block_size == 0) {
+	if(read_size && (read_size % block_size == 0 || hole)) {
 		/*
 		 * Special case where we've not tried to read past the end of
-		 * the file.  We expect to get EOF, i.e. the file isn't larger
-		 * than we expect.
+		 * the file (or the tail was a hole and wasn't read).  We
+		 * expect to get EOF, i.e. the file isn't larger than we
+		 * expect.
 		 */
 		char buffer;
 		int res;
 
-		res = read_bytes(file, &buffer, 1);
+		if(hole && lseek(file, read_size, SEEK_SET) == -1)
+			goto read_err;
+
+		res = read_source(file, &buffer, 1);
 		if(res == -1)
 			goto read_err;
 
@@ -312,10 +484,14 @@ again:
 			goto restat;
 	}
 
-	file_buffer->fragment = is_fragment(inode);
-	put_file_buffer(file_buffer);
+	if(hole)
+		put_sparse_buffer(file_buffer);
+	else {
+		file_buffer->fragment = is_fragment_inode(inode);
+		put_file_buffer(file_buffer);
+	}
 
-	close(file);
+	close_source(file);
 
 	return;
 
@@ -328,14 +504,14 @@ restat:
 	}
 
 	if(read_size != buf2.st_size) {
-		close(file);
+		close_source(file);
 		memcpy(buf, &buf2, sizeof(struct stat));
 		file_buffer->error = 2;
 		put_file_buffer(file_buffer);
 		goto again;
 	}
 read_err:
-	close(file);
+	close_source(file);
 read_err2:
 	file_buffer->error = TRUE;
 	put_file_buffer(file_buffer);
@@ -388,6 +564,7 @@ static void reader_read_data(struct dir_ent *dir_ent)
 		file_buffer->file_size = read_size;
 		file_buffer->sequence = seq ++;
 		file_buffer->noD = inode->noD;
+		file_buffer->incremental = NULL;
 		file_buffer->error = FALSE;
 
 		if(blocks > 1) {
@@ -409,11 +586,22 @@ static void reader_read_data(struct dir_ent *dir_ent)
 		}
 	} while(-- blocks > 0);
 
-	file_buffer->fragment = is_fragment(inode);
+	file_buffer->fragment = is_fragment_inode(inode);
 	put_file_buffer(file_buffer);
 }
 
 
+static void reader_read_regular(struct dir_ent *dir_ent)
+{
+	if(IS_PSEUDO_PROCESS(dir_ent->inode))
+		reader_read_process(dir_ent);
+	else if(IS_PSEUDO_DATA(dir_ent->inode))
+		reader_read_data(dir_ent);
+	else
+		reader_read_file(dir_ent);
+}
+
+
 void reader_scan(struct dir_info *dir)
 {
 	struct dir_ent *dir_ent = dir->list;
@@ -423,13 +611,9 @@ void reader_scan(struct dir_info *dir)
 		if(dir_ent->inode->root_entry)
 			continue;
 
-		if(IS_PSEUDO_PROCESS(dir_ent->inode)) {
-			reader_read_process(dir_ent);
-			continue;
-		}
-
-		if(IS_PSEUDO_DATA(dir_ent->inode)) {
-			reader_read_data(dir_ent);
+		if(IS_PSEUDO_PROCESS(dir_ent->inode) ||
+					IS_PSEUDO_DATA(dir_ent->inode)) {
+			reader_read_regular(dir_ent);
 			continue;
 		}
 
@@ -464,14 +648,11 @@ void *reader(void *arg)
 		read_tar_file();
 	else if(!sorted)
 		reader_scan(dir);
-	else{
-		int i;
-		struct priority_entry *entry;
-
-		for(i = 65535; i >= 0; i--)
-			for(entry = priority_list[i]; entry;
-							entry = entry->next)
-				reader_read_file(entry->dir);
+	else {
+		unsigned int i;
+
+		for(i = 0; i < priority_count; i++)
+			reader_read_regular(priority_list[i].dir);
 	}
 
 	pthread_exit(NULL);
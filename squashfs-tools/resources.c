@@ -0,0 +1,368 @@
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * resources.c
+ *
+ * Find the processors and memory available to Mksquashfs and Unsquashfs,
+ * taking into account the CPU affinity mask and any cgroup CPU quota and
+ * memory limit they're running under, and place threads on a set of
+ * processors.
+ *
+ * Errors are returned rather than reported, as this is used by both
+ * programs, which report errors in different ways.
+ */
+
+#define TRUE 1
+#define FALSE 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "resources.h"
+
+#ifdef linux
+#include <sched.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_HYBRID_ROOT "/sys/fs/cgroup/unified"
+
+struct cpu_list {
+	cpu_set_t	set;
+};
+
+
+/*
+ * Parse a list of processors in the format used by taskset(1) and
+ * /sys/devices/system/node/node<n>/cpulist, e.g. "0-3,8,10-11"
+ */
+static int parse_cpus(char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	while(*list != '\0' && *list != '\n') {
+		char *end;
+		long first, last;
+
+		first = last = strtol(list, &end, 10);
+		if(end == list || first < 0)
+			return FALSE;
+
+		if(*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if(end == list || last < first)
+				return FALSE;
+		}
+
+		if(last >= CPU_SETSIZE)
+			return FALSE;
+
+		for(; first <= last; first ++)
+			CPU_SET(first, set);
+
+		if(*end == ',')
+			end ++;
+		else if(*end != '\0' && *end != '\n')
+			return FALSE;
+
+		list = end;
+	}
+
+	return CPU_COUNT(set) != 0;
+}
+
+
+static int read_file(char *filename, char *buffer, int size)
+{
+	FILE *file = fopen(filename, "r");
+	int res;
+
+	if(file == NULL)
+		return FALSE;
+
+	res = fgets(buffer, size, file) != NULL;
+	fclose(file);
+	return res;
+}
+
+
+/*
+ * Parse a list of processors, or "node:<n>" meaning the processors of
+ * NUMA node <n>.  Returns NULL if the list is invalid, or has none of
+ * the processors we're allowed to run on.
+ */
+struct cpu_list *parse_cpu_list(char *arg)
+{
+	struct cpu_list *list = malloc(sizeof(struct cpu_list));
+	char buffer[4096];
+	int res;
+
+	if(list == NULL)
+		return NULL;
+
+	if(strncmp(arg, "node:", 5) == 0) {
+		char *filename, *end;
+		long node = strtol(arg + 5, &end, 10);
+
+		if(end == arg + 5 || *end != '\0' || node < 0)
+			goto failed;
+
+		res = asprintf(&filename, "/sys/devices/system/node/node%ld/"
+			"cpulist", node);
+		if(res == -1)
+			goto failed;
+
+		res = read_file(filename, buffer, sizeof(buffer));
+		free(filename);
+		if(res == FALSE)
+			goto failed;
+
+		arg = buffer;
+	}
+
+	if(parse_cpus(arg, &list->set)) {
+		cpu_set_t allowed;
+
+		/* Only keep the processors we're allowed to run on */
+		if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+			CPU_AND(&list->set, &list->set, &allowed);
+
+		if(CPU_COUNT(&list->set))
+			return list;
+	}
+
+failed:
+	free(list);
+	return NULL;
+}
+
+
+int cpu_list_count(struct cpu_list *list)
+{
+	return CPU_COUNT(&list->set);
+}
+
+
+/*
+ * Restrict thread to the processors in list.  A NULL list leaves the
+ * thread where it is
+ */
+int set_thread_cpus(pthread_t thread, struct cpu_list *list)
+{
+	if(list == NULL)
+		return TRUE;
+
+	return pthread_setaffinity_np(thread, sizeof(cpu_set_t),
+							&list->set) == 0;
+}
+
+
+/*
+ * Return the directory of our cgroup in the cgroup filesystem mounted at
+ * root.  If controller is NULL this is the cgroup v2 (unified) hierarchy,
+ * otherwise it is the cgroup v1 hierarchy with controller.  Returns NULL
+ * if we're not in one
+ */
+static char *cgroup_dir(char *root, char *controller)
+{
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	char buffer[4096], *dir = NULL;
+
+	if(file == NULL)
+		return NULL;
+
+	/* lines are "hierarchy-ID:controller-list:cgroup-path" */
+	while(fgets(buffer, sizeof(buffer), file) != NULL) {
+		char *controllers = strchr(buffer, ':'), *path, *name;
+		int found = FALSE;
+
+		if(controllers == NULL)
+			continue;
+
+		path = strchr(++ controllers, ':');
+		if(path == NULL || path[1] != '/')
+			continue;
+
+		*path ++ = '\0';
+		path[strcspn(path, "\n")] = '\0';
+
+		if(controller == NULL)
+			found = strcmp(controllers, "") == 0;
+		else
+			for(name = strtok(controllers, ","); name && !found;
+						name = strtok(NULL, ","))
+				found = strcmp(name, controller) == 0;
+
+		if(found) {
+			if(asprintf(&dir, "%s%s", root, strcmp(path, "/") ?
+							path : "") == -1)
+				dir = NULL;
+			break;
+		}
+	}
+
+	fclose(file);
+	return dir;
+}
+
+
+/*
+ * A cgroup is limited by the limits of its ancestors, so return the
+ * smallest value of file found walking up from dir to root, or -1 if
+ * there's no limit.  Values are "<limit> [<period>]", if a period is
+ * present the limit is divided by it and rounded up.  "max" is no limit.
+ */
+static long long cgroup_limit(char *dir, char *root, char *file)
+{
+	char *filename, buffer[128];
+	long long limit = -1;
+
+	if(dir == NULL)
+		return -1;
+
+	while(1) {
+		long long value, period;
+		int res;
+
+		if(asprintf(&filename, "%s/%s", dir, file) == -1)
+			break;
+
+		if(read_file(filename, buffer, sizeof(buffer))) {
+			res = sscanf(buffer, "%lld %lld", &value, &period);
+			if(res == 2 && period > 0)
+				value = (value + period - 1) / period;
+			if(res >= 1 && value > 0 && (limit == -1 ||
+							value < limit))
+				limit = value;
+		}
+
+		free(filename);
+
+		if(strcmp(dir, root) == 0)
+			break;
+		*strrchr(dir, '/') = '\0';
+	}
+
+	free(dir);
+	return limit;
+}
+
+
+/*
+ * The cgroup v2 hierarchy is mounted at CGROUP_ROOT, unless it is
+ * mounted alongside cgroup v1 hierarchies (hybrid mode)
+ */
+static char *unified_root()
+{
+	if(access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0)
+		return CGROUP_ROOT;
+	else
+		return CGROUP_HYBRID_ROOT;
+}
+
+
+static int cgroup_cpus()
+{
+	char *root = unified_root();
+
+	return cgroup_limit(cgroup_dir(root, NULL), root, "cpu.max");
+}
+
+
+/*
+ * Return the memory limit in bytes of our cgroup, or -1 if there isn't
+ * one.  Both cgroup v2 (memory.max) and cgroup v1 (memory.limit_in_bytes)
+ * are checked, as either or both may be in use
+ */
+long long memory_limit()
+{
+	char *root = unified_root();
+	long long limit, v1;
+
+	limit = cgroup_limit(cgroup_dir(root, NULL), root, "memory.max");
+
+	v1 = cgroup_limit(cgroup_dir(CGROUP_ROOT "/memory", "memory"),
+			CGROUP_ROOT "/memory", "memory.limit_in_bytes");
+
+	if(v1 != -1 && (limit == -1 || v1 < limit))
+		limit = v1;
+
+	return limit;
+}
+
+
+/*
+ * Return the number of processors we can usefully run threads on.  This
+ * is the online processors, limited by the CPU affinity mask (taskset,
+ * cpusets) and the cgroup CPU quota, if any
+ */
+int available_processors()
+{
+	int processors = sysconf(_SC_NPROCESSORS_ONLN), cpus;
+	cpu_set_t set;
+
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		cpus = CPU_COUNT(&set);
+		if(cpus && (processors < 1 || cpus < processors))
+			processors = cpus;
+	}
+
+	cpus = cgroup_cpus();
+	if(cpus != -1 && (processors < 1 || cpus < processors))
+		processors = cpus;
+
+	return processors < 1 ? 1 : processors;
+}
+#else
+struct cpu_list *parse_cpu_list(char *arg)
+{
+	/* Not supported */
+	return NULL;
+}
+
+
+int cpu_list_count(struct cpu_list *list)
+{
+	return 0;
+}
+
+
+int set_thread_cpus(pthread_t thread, struct cpu_list *list)
+{
+	return list == NULL;
+}
+
+
+int available_processors()
+{
+	int processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return processors < 1 ? 1 : processors;
+}
+
+
+long long memory_limit()
+{
+	return -1;
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * resources.h
+ */
+
+#include <pthread.h>
+
+struct cpu_list;
+
+extern struct cpu_list *parse_cpu_list(char *);
+extern int cpu_list_count(struct cpu_list *);
+extern int set_thread_cpus(pthread_t, struct cpu_list *);
+extern int available_processors();
+extern long long memory_limit();
+#endif
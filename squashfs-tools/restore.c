@@ -47,8 +47,10 @@
 #define TRUE 1
 
 extern pthread_t reader_thread, writer_thread, main_thread, order_thread;
+extern pthread_t metadata_thread;
 extern pthread_t *deflator_thread, *frag_deflator_thread, *frag_thread;
 extern struct queue *to_deflate, *to_writer, *to_frag, *to_process_frag;
+extern struct queue *to_metadata;
 extern struct seq_queue *to_main, *to_order;
 extern void restorefs();
 extern int processors;
@@ -121,6 +123,16 @@ void *restore_thrd(void *arg)
 		pthread_cancel(main_thread);
 		pthread_join(main_thread, NULL);
 
+		/*
+		 * then flush the main thread to metadata thread queue.  The
+		 * metadata thread will idle
+		 */
+		queue_flush(to_metadata);
+
+		/* now kill the metadata thread */
+		pthread_cancel(metadata_thread);
+		pthread_join(metadata_thread, NULL);
+
 		/* then flush the main thread to fragment deflator thread(s)
 		 * queue.  The fragment deflator thread(s) will idle
 		 */
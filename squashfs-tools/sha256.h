@@ -0,0 +1,38 @@
+#ifndef SHA256_H
+#define SHA256_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * sha256.h
+ */
+
+#define SHA256_DIGEST_SIZE	32
+
+struct sha256 {
+	unsigned int		state[8];
+	unsigned long long	length;
+	unsigned char		buffer[64];
+	int			used;
+};
+
+extern void sha256_init(struct sha256 *);
+extern void sha256_update(struct sha256 *, void *, long long);
+extern void sha256_final(struct sha256 *, unsigned char *);
+#endif
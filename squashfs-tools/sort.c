@@ -43,65 +43,83 @@
 #include "sort.h"
 #include "mksquashfs_error.h"
 #include "progressbar.h"
+#include "inode_hash.h"
 
 int mkisofs_style = -1;
 
-struct sort_info {
-	dev_t			st_dev;
-	ino_t			st_ino;
-	int			priority;
-	struct sort_info	*next;
-};
+/* sort file priorities, keyed on st_dev, st_ino */
+struct inode_hash *sort_info = NULL;
 
-struct sort_info *sort_info_list[65536];
-
-struct priority_entry *priority_list[65536];
+/*
+ * Files to be written, in the order they are to be written, highest
+ * priority first.  Built by generate_file_priorities(), and walked by
+ * both the reader thread and sort_files_and_write()
+ */
+struct priority_entry *priority_list = NULL;
+unsigned int priority_count = 0;
+static unsigned int priority_size = 0;
 
 extern int silent;
 extern char *pathname(struct dir_ent *dir_ent);
 
 
-void add_priority_list(struct dir_ent *dir, int priority)
+static void add_priority_list(struct dir_ent *dir, int priority)
 {
-	struct priority_entry *new_priority_entry;
+	if(priority_count == priority_size) {
+		priority_size = priority_size ? priority_size << 1 : 1024;
+		priority_list = realloc(priority_list, priority_size *
+			sizeof(struct priority_entry));
+		if(priority_list == NULL)
+			MEM_ERROR();
+	}
+
+	priority_list[priority_count].dir = dir;
+	priority_list[priority_count].priority = priority;
+	priority_list[priority_count].order = priority_count;
+	priority_count ++;
+}
 
-	priority += 32768;
-	new_priority_entry = malloc(sizeof(struct priority_entry));
-	if(new_priority_entry == NULL)
-		MEM_ERROR();
 
-	new_priority_entry->dir = dir;;
-	new_priority_entry->next = priority_list[priority];
-	priority_list[priority] = new_priority_entry;
+/*
+ * Highest priority first.  Files with the same priority are written
+ * in the reverse order to which they were found, which is the order
+ * previous releases wrote them in
+ */
+static int compare_priority(const void *a, const void *b)
+{
+	const struct priority_entry *pa = a, *pb = b;
+
+	if(pa->priority != pb->priority)
+		return pa->priority < pb->priority ? 1 : -1;
+
+	return pa->order < pb->order ? 1 : -1;
 }
 
 
 int get_priority(char *filename, struct stat *buf, int priority)
 {
-	int hash = buf->st_ino & 0xffff;
-	struct sort_info *s;
-
-	for(s = sort_info_list[hash]; s; s = s->next)
-		if((s->st_dev == buf->st_dev) && (s->st_ino == buf->st_ino)) {
-			TRACE("returning priority %d (%s)\n", s->priority,
-				filename);
-			return s->priority;
-		}
+	int *s = sort_info ? inode_hash_lookup(sort_info, buf->st_dev,
+							buf->st_ino) : NULL;
+
+	if(s) {
+		TRACE("returning priority %d (%s)\n", *s, filename);
+		return *s;
+	}
+
 	TRACE("returning priority %d (%s)\n", priority, filename);
 	return priority;
 }
 
 
 #define ADD_ENTRY(buf, priority) {\
-	int hash = buf.st_ino & 0xffff;\
-	struct sort_info *s;\
-	if((s = malloc(sizeof(struct sort_info))) == NULL) \
+	int *s;\
+	if(sort_info == NULL) \
+		sort_info = inode_hash_create(0); \
+	if((s = malloc(sizeof(int))) == NULL) \
 		MEM_ERROR(); \
-	s->st_dev = buf.st_dev;\
-	s->st_ino = buf.st_ino;\
-	s->priority = priority;\
-	s->next = sort_info_list[hash];\
-	sort_info_list[hash] = s;\
+	*s = priority;\
+	free(inode_hash_lookup(sort_info, buf.st_dev, buf.st_ino)); \
+	inode_hash_set(sort_info, buf.st_dev, buf.st_ino, s);\
 	}
 int add_sort_list(char *path, int priority, int source, char *source_path[])
 {
@@ -185,7 +203,14 @@ error:
 }
 
 
-void generate_file_priorities(struct dir_info *dir, int priority,
+void sort_hash_stats()
+{
+	if(sort_info)
+		inode_hash_stats(sort_info, "Sort file");
+}
+
+
+static void scan_file_priorities(struct dir_info *dir, int priority,
 	struct stat *buf)
 {
 	struct dir_ent *dir_ent = dir->list;
@@ -204,7 +229,7 @@ void generate_file_priorities(struct dir_info *dir, int priority,
 					priority));
 				break;
 			case S_IFDIR:
-				generate_file_priorities(dir_ent->dir,
+				scan_file_priorities(dir_ent->dir,
 					priority, buf);
 				break;
 		}
@@ -212,6 +237,16 @@ void generate_file_priorities(struct dir_info *dir, int priority,
 }
 
 
+void generate_file_priorities(struct dir_info *dir, int priority,
+	struct stat *buf)
+{
+	scan_file_priorities(dir, priority, buf);
+
+	qsort(priority_list, priority_count, sizeof(struct priority_entry),
+		compare_priority);
+}
+
+
 int read_sort_file(char *filename, int source, char *source_path[])
 {
 	FILE *fd;
@@ -335,38 +370,39 @@ failed:
 
 void sort_files_and_write(struct dir_info *dir)
 {
-	int i;
+	unsigned int i;
 	struct priority_entry *entry;
 	squashfs_inode inode;
 	int duplicate_file;
 	struct file_info *file;
 
-	for(i = 65535; i >= 0; i--)
-		for(entry = priority_list[i]; entry; entry = entry->next) {
-			TRACE("%d: %s\n", i - 32768, pathname(entry->dir));
-			if(entry->dir->inode->inode == SQUASHFS_INVALID_BLK) {
-				file = write_file(entry->dir, &duplicate_file);
-				inode = create_inode(NULL, entry->dir,
-					SQUASHFS_FILE_TYPE, file->file_size,
-					file->start, file->blocks,
-					file->block_list,
-					file->fragment, NULL,
-					file->sparse);
-				if(duplicate_checking == FALSE) {
-					free_fragment(file->fragment);
-					free(file->block_list);
-				}
-				INFO("file %s, uncompressed size %lld bytes %s"
-					"\n", pathname(entry->dir),
-					(long long)
-					entry->dir->inode->buf.st_size,
-					duplicate_file ? "DUPLICATE" : "");
-				entry->dir->inode->inode = inode;
-				entry->dir->inode->type = SQUASHFS_FILE_TYPE;
-			} else
-				INFO("file %s, uncompressed size %lld bytes "
-					"LINK\n", pathname(entry->dir),
-					(long long)
-					entry->dir->inode->buf.st_size);
-		}
+	for(i = 0; i < priority_count; i++) {
+		entry = &priority_list[i];
+		TRACE("%d: %s\n", entry->priority, pathname(entry->dir));
+		if(entry->dir->inode->inode == SQUASHFS_INVALID_BLK) {
+			file = write_file(entry->dir, &duplicate_file);
+			inode = create_inode(NULL, entry->dir,
+				SQUASHFS_FILE_TYPE, file->file_size,
+				file->start, file->blocks,
+				file->block_list,
+				file->fragment, NULL,
+				file->sparse);
+			if(duplicate_checking == FALSE) {
+				free_fragment(file->fragment);
+				free(file->block_list);
+			}
+			INFO("file %s, uncompressed size %lld bytes %s"
+				"\n", pathname(entry->dir),
+				(long long)
+				entry->dir->inode->buf.st_size,
+				duplicate_file ? "DUPLICATE" : "");
+			entry->dir->inode->inode = inode;
+			entry->dir->inode->type = SQUASHFS_FILE_TYPE;
+			entry->dir->inode->written = TRUE;
+		} else
+			INFO("file %s, uncompressed size %lld bytes "
+				"LINK\n", pathname(entry->dir),
+				(long long)
+				entry->dir->inode->buf.st_size);
+	}
 }
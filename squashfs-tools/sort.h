@@ -26,12 +26,15 @@
 
 struct priority_entry {
 	struct dir_ent *dir;
-	struct priority_entry *next;
+	int priority;
+	unsigned int order;
 };
 
 extern int read_sort_file(char *, int, char *[]);
 extern void sort_files_and_write(struct dir_info *);
 extern void generate_file_priorities(struct dir_info *, int priority,
 	struct stat *);
-extern struct  priority_entry *priority_list[65536];
+extern struct priority_entry *priority_list;
+extern unsigned int priority_count;
+extern void sort_hash_stats();
 #endif
@@ -0,0 +1,389 @@
+/*
+ * Benchmark libsquashfs-read against the kernel Squashfs filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * sqfsbench.c
+ *
+ * Every regular file in the filesystem is read sequentially, and then
+ * random reads are made from random files, first using libsquashfs-read,
+ * and then (if given) through the same filesystem mounted by the kernel.
+ * Each read looks up the file by pathname, as opening it would.
+ *
+ * The kernel page cache of each file is dropped before it is read
+ * sequentially, so both sequential reads start with nothing cached.
+ */
+
+#define TRUE 1
+#define FALSE 0
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "squashfs_read.h"
+
+struct file {
+	char		*pathname;
+	long long	size;
+};
+
+struct bench {
+	long long	(*read)(struct file *, long long, long long, char *,
+								int);
+	int		random;
+	unsigned int	seed;
+	long long	bytes;
+	long long	reads;
+};
+
+static struct sqfs *fs;
+static char *mountpoint = NULL;
+static struct file *file = NULL;
+static int files = 0, next_file;
+static long long total_bytes = 0;
+static int threads = 1, reads = 10000, read_size = 131072;
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void add_file(char *pathname, long long size)
+{
+	if(files % 1024 == 0) {
+		file = realloc(file, (files + 1024) * sizeof(struct file));
+		if(file == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	file[files].pathname = strdup(pathname);
+	file[files ++].size = size;
+	total_bytes += size;
+}
+
+
+static void scan_dir(struct sqfs_inode *dir_inode, char *pathname)
+{
+	struct sqfs_dir *dir;
+	struct sqfs_dirent dirent;
+	int res = sqfs_opendir(fs, dir_inode, &dir);
+
+	while(res == 0 && (res = sqfs_readdir(dir, &dirent)) == 1) {
+		struct sqfs_inode inode;
+		char *name;
+
+		if(!S_ISREG(dirent.mode) && !S_ISDIR(dirent.mode)) {
+			res = 0;
+			continue;
+		}
+
+		if(asprintf(&name, "%s/%s", pathname, dirent.name) == -1) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		res = sqfs_read_inode(fs, dirent.inode, &inode);
+		if(res == 0) {
+			if(S_ISDIR(inode.mode))
+				scan_dir(&inode, name);
+			else if(inode.size)
+				add_file(name, inode.size);
+		}
+
+		free(name);
+	}
+
+	if(dir)
+		sqfs_closedir(dir);
+
+	if(res < 0) {
+		fprintf(stderr, "Failed to scan directory %s, because %s\n",
+			pathname, strerror(-res));
+		exit(1);
+	}
+}
+
+
+static long long library_read(struct file *file, long long offset,
+	long long bytes, char *buffer, int sequential)
+{
+	struct sqfs_inode inode;
+	long long res, total = 0;
+
+	res = sqfs_stat(fs, file->pathname, &inode);
+
+	while(res == 0 && total < bytes) {
+		res = sqfs_pread(fs, &inode, buffer, bytes - total > read_size ?
+			read_size : bytes - total, offset + total);
+		if(res > 0) {
+			total += res;
+			res = 0;
+		} else if(res == 0)
+			break;
+	}
+
+	if(res < 0) {
+		fprintf(stderr, "Failed to read %s, because %s\n",
+			file->pathname, strerror(-res));
+		exit(1);
+	}
+
+	return total;
+}
+
+
+static long long kernel_read(struct file *file, long long offset,
+	long long bytes, char *buffer, int sequential)
+{
+	long long res, total = 0;
+	char *pathname;
+	int fd;
+
+	if(asprintf(&pathname, "%s/%s", mountpoint, file->pathname) == -1) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	fd = open(pathname, O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "Failed to open %s, because %s\n", pathname,
+			strerror(errno));
+		exit(1);
+	}
+
+	if(sequential)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	while(total < bytes) {
+		res = pread(fd, buffer, bytes - total > read_size ? read_size :
+			bytes - total, offset + total);
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read %s, because %s\n",
+				pathname, strerror(errno));
+			exit(1);
+		} else if(res == 0)
+			break;
+
+		total += res;
+	}
+
+	close(fd);
+	free(pathname);
+	return total;
+}
+
+
+static void *bench_thread(void *arg)
+{
+	struct bench *bench = arg;
+	char *buffer = malloc(read_size);
+	int i;
+
+	if(buffer == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if(bench->random) {
+		for(i = 0; i < reads / threads; i++) {
+			struct file *f = &file[rand_r(&bench->seed) % files];
+			long long offset = 0;
+
+			if(f->size > read_size)
+				offset = (((long long) rand_r(&bench->seed) <<
+					31) | rand_r(&bench->seed)) %
+					(f->size - read_size + 1);
+
+			bench->bytes += bench->read(f, offset, read_size,
+								buffer, FALSE);
+			bench->reads ++;
+		}
+	} else {
+		while(1) {
+			pthread_mutex_lock(&file_mutex);
+			i = next_file ++;
+			pthread_mutex_unlock(&file_mutex);
+
+			if(i >= files)
+				break;
+
+			bench->bytes += bench->read(&file[i], 0, file[i].size,
+								buffer, TRUE);
+			bench->reads ++;
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+
+static void run(char *name, long long (*read)(struct file *, long long,
+	long long, char *, int), int random)
+{
+	struct bench bench[threads];
+	pthread_t thread[threads];
+	struct timespec start, end;
+	long long bytes = 0, count = 0;
+	double secs;
+	int i;
+
+	next_file = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(i = 0; i < threads; i++) {
+		bench[i].read = read;
+		bench[i].random = random;
+		bench[i].seed = i + 1;
+		bench[i].bytes = bench[i].reads = 0;
+		if(pthread_create(&thread[i], NULL, bench_thread, &bench[i])) {
+			fprintf(stderr, "Failed to create thread\n");
+			exit(1);
+		}
+	}
+
+	for(i = 0; i < threads; i++) {
+		pthread_join(thread[i], NULL);
+		bytes += bench[i].bytes;
+		count += bench[i].reads;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) /
+								1e9;
+
+	printf("%-8s %-11s %10.1f Mbytes/s %12.0f %s/s\n", name, random ?
+		"random" : "sequential", bytes / secs / (1024 * 1024),
+		count / secs, random ? "reads" : "files");
+}
+
+
+static void print_options(FILE *stream, char *name)
+{
+	fprintf(stream, "SYNTAX: %s [OPTIONS] filesystem [mountpoint]\n\n",
+		name);
+	fprintf(stream, "Reads every file in filesystem sequentially, and then "
+		"makes random reads from\nrandom files, using "
+		"libsquashfs-read, and then if given through the same\n"
+		"filesystem mounted at mountpoint by the kernel.\n\n");
+	fprintf(stream, "Options are\n");
+	fprintf(stream, "-threads <number>\tnumber of threads reading, default "
+		"1\n");
+	fprintf(stream, "-reads <number>\t\tnumber of random reads, default "
+		"10000\n");
+	fprintf(stream, "-size <bytes>\t\tsize of each read, default 131072\n");
+	fprintf(stream, "-cache <size>\t\tset libsquashfs-read cache to <size> "
+		"Mbytes\n");
+	fprintf(stream, "-processors <number>\tuse <number> libsquashfs-read "
+		"decompression threads,\n\t\t\t0 for none.  By default will use "
+		"number of processors\n\t\t\tavailable\n");
+	fprintf(stream, "-help\t\t\toutput this options text to stdout\n");
+}
+
+
+static int get_number(int argc, char *argv[], int *i, int min)
+{
+	int number;
+
+	if(++ *i == argc || (number = atoi(argv[*i])) < min) {
+		fprintf(stderr, "%s: %s missing or invalid number\n", argv[0],
+			argv[*i - 1]);
+		exit(1);
+	}
+
+	return number;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct sqfs_inode root;
+	int i, res, cache = 0, processors = -1;
+
+	for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		if(strcmp(argv[i], "-threads") == 0)
+			threads = get_number(argc, argv, &i, 1);
+		else if(strcmp(argv[i], "-reads") == 0)
+			reads = get_number(argc, argv, &i, 1);
+		else if(strcmp(argv[i], "-size") == 0)
+			read_size = get_number(argc, argv, &i, 1);
+		else if(strcmp(argv[i], "-cache") == 0)
+			cache = get_number(argc, argv, &i, 1);
+		else if(strcmp(argv[i], "-processors") == 0)
+			processors = get_number(argc, argv, &i, 0);
+		else if(strcmp(argv[i], "-help") == 0 ||
+						strcmp(argv[i], "-h") == 0) {
+			print_options(stdout, argv[0]);
+			exit(0);
+		} else {
+			fprintf(stderr, "%s: invalid option\n\n", argv[0]);
+			print_options(stderr, argv[0]);
+			exit(1);
+		}
+	}
+
+	if(argc - i != 1 && argc - i != 2) {
+		print_options(stderr, argv[0]);
+		exit(1);
+	}
+
+	if(argc - i == 2)
+		mountpoint = argv[i + 1];
+
+	fs = sqfs_open(argv[i], 0, cache, processors);
+	if(fs == NULL) {
+		fprintf(stderr, "Failed to open %s, because %s\n", argv[i],
+			strerror(errno));
+		exit(1);
+	}
+
+	res = sqfs_root(fs, &root);
+	if(res) {
+		fprintf(stderr, "Failed to read root directory, because %s\n",
+			strerror(-res));
+		exit(1);
+	}
+
+	scan_dir(&root, "");
+	if(files == 0) {
+		fprintf(stderr, "%s has no files to read\n", argv[i]);
+		exit(1);
+	}
+
+	printf("%d files, %.1f Mbytes, %d threads, %d byte reads\n", files,
+		total_bytes / (1024.0 * 1024), threads, read_size);
+
+	run("library", library_read, FALSE);
+	if(mountpoint)
+		run("kernel", kernel_read, FALSE);
+
+	run("library", library_read, TRUE);
+	if(mountpoint)
+		run("kernel", kernel_read, TRUE);
+
+	sqfs_close(fs);
+	return 0;
+}
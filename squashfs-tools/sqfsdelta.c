@@ -0,0 +1,789 @@
+/*
+ * Create and apply block level deltas between two Squashfs filesystems.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * sqfsdelta.c
+ *
+ * A delta describes the new filesystem as a sequence of copies from the
+ * old filesystem, and literal data.  The compressed data blocks and fragment
+ * blocks of the new filesystem are located by walking its directory tree
+ * and fragment table, and each block which also exists (byte for byte)
+ * in the old filesystem is copied from there.  Everything else (the
+ * superblock, metadata and tables, and new blocks) is stored literally.
+ *
+ * The delta is generated and applied in a single pass, in new filesystem
+ * order, and so can be streamed to or from a pipe.  Applying the delta
+ * rebuilds the new filesystem bit for bit, which is verified using
+ * the SHA-256 digest of the new filesystem stored at the end of the delta.
+ */
+
+#define TRUE 1
+#define FALSE 0
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "compressor.h"
+#include "read_meta.h"
+#include "sha256.h"
+#include "unsquashfs_error.h"
+
+#define DELTA_MAGIC	"SQFSDLT2"
+#define DELTA_END	0
+#define DELTA_COPY	1
+#define DELTA_LITERAL	2
+
+/* Number of new filesystem blocks matched in parallel per batch */
+#define DELTA_BATCH	4096
+
+#define IO_SIZE		65536
+
+/*
+ * Blocks are indexed by a FNV-1a hash, candidate matches are then compared
+ * byte for byte
+ */
+#define FNV_OFFSET	14695981039346656037ULL
+#define FNV_PRIME	1099511628211ULL
+
+struct delta_header {
+	char				magic[8];
+	long long			old_size;
+	long long			new_size;
+	struct squashfs_super_block	old_sBlk;
+};
+
+struct delta_op {
+	unsigned int			type;
+	unsigned int			unused;
+	long long			length;
+	long long			offset;
+};
+
+/* a compressed data or fragment block */
+struct extent {
+	long long			start;
+	unsigned int			size;
+	int				next;
+	unsigned long long		hash;
+};
+
+struct image {
+	char				*name;
+	int				fd;
+	long long			size;
+	struct squashfs_super_block	sBlk;
+	struct compressor		*comp;
+	struct meta_reader		reader;
+	struct extent			*extent;
+	int				extents;
+	int				alloc;
+};
+
+struct thread_arg {
+	struct image			*image;
+	struct extent			*extent;
+	long long			*match;
+	int				first;
+	int				last;
+};
+
+static struct image old_image, new_image;
+static int *index_table;
+static unsigned int index_size;
+static int processors = -1;
+static int quiet = FALSE;
+static long long copied_bytes = 0, literal_bytes = 0;
+static int copied_blocks = 0;
+
+
+void progressbar_error(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+
+void progressbar_info(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+
+static unsigned long long hash_bytes(unsigned long long hash, unsigned char *buff,
+	int bytes)
+{
+	while(bytes --)
+		hash = (hash ^ *buff++) * FNV_PRIME;
+
+	return hash;
+}
+
+
+static void read_bytes(int fd, char *name, long long start, long long bytes,
+	void *buff)
+{
+	long long res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pread(fd, buff + count, bytes - count, start + count);
+		if(res < 1) {
+			if(res == 0)
+				BAD_ERROR("Unexpected EOF reading %s\n", name);
+			else if(errno != EINTR)
+				BAD_ERROR("Read on %s failed because %s\n", name,
+					strerror(errno));
+			res = 0;
+		}
+	}
+}
+
+
+/* read from a stream, returning FALSE on EOF */
+static int read_stream(int fd, void *buff, long long bytes)
+{
+	long long res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = read(fd, buff + count, bytes - count);
+		if(res < 1) {
+			if(res == 0)
+				return FALSE;
+			else if(errno != EINTR)
+				BAD_ERROR("Read on delta failed because %s\n",
+					strerror(errno));
+			res = 0;
+		}
+	}
+
+	return TRUE;
+}
+
+
+static void write_stream(int fd, void *buff, long long bytes)
+{
+	long long res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = write(fd, buff + count, bytes - count);
+		if(res == -1) {
+			if(errno != EINTR)
+				BAD_ERROR("Write failed because %s\n",
+					strerror(errno));
+			res = 0;
+		}
+	}
+}
+
+
+static void add_extent(struct image *image, long long start, unsigned int size)
+{
+	if(size > image->sBlk.block_size || start + size > image->size)
+		BAD_ERROR("Block at 0x%llx in %s out of range, filesystem "
+			"corrupted?\n", start, image->name);
+
+	if(image->extents == image->alloc) {
+		image->alloc = image->alloc ? image->alloc * 2 : 1024;
+		image->extent = realloc(image->extent, image->alloc *
+			sizeof(struct extent));
+		if(image->extent == NULL)
+			MEM_ERROR();
+	}
+
+	image->extent[image->extents].start = start;
+	image->extent[image->extents ++].size = size;
+}
+
+
+static void add_file(struct meta_reader *reader, char *pathname,
+	struct meta_inode *inode)
+{
+	struct image *image = reader->arg;
+	long long start = inode->start, block = inode->block;
+	int i, res, blocks, offset = inode->block_offset;
+	int block_log = image->sBlk.block_log;
+
+	if(inode->fragment == SQUASHFS_INVALID_FRAG)
+		blocks = (inode->size + image->sBlk.block_size - 1) >>
+								block_log;
+	else
+		blocks = inode->size >> block_log;
+
+	for(i = 0; i < blocks; i++) {
+		unsigned int c_byte;
+		int size;
+
+		res = read_meta(reader, &c_byte, &block, &offset,
+							sizeof(c_byte));
+		if(res)
+			BAD_ERROR("Failed to read block list in %s because "
+				"%s\n", image->name, strerror(-res));
+		SQUASHFS_INSWAP_INTS(&c_byte, 1);
+		size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+		if(size) {
+			add_extent(image, start, size);
+			start += size;
+		}
+	}
+}
+
+
+static void read_fragments(struct image *image)
+{
+	struct squashfs_fragment_entry *table;
+	int i, res = read_meta_fragments(&image->reader, &table);
+
+	if(res)
+		BAD_ERROR("Failed to read fragment table of %s because %s\n",
+			image->name, strerror(-res));
+
+	for(i = 0; i < image->sBlk.fragments; i++) {
+		int size = SQUASHFS_COMPRESSED_SIZE_BLOCK(table[i].size);
+
+		if(size)
+			add_extent(image, table[i].start_block, size);
+	}
+
+	free(table);
+}
+
+
+static int compare_extent(const void *a, const void *b)
+{
+	const struct extent *e1 = a, *e2 = b;
+
+	return e1->start < e2->start ? -1 : e1->start > e2->start;
+}
+
+
+static void open_image(struct image *image, char *name)
+{
+	struct stat buf;
+
+	image->name = name;
+	image->fd = open(name, O_RDONLY);
+	if(image->fd == -1)
+		BAD_ERROR("Could not open %s, because %s\n", name,
+			strerror(errno));
+
+	if(fstat(image->fd, &buf) == -1)
+		BAD_ERROR("Could not stat %s, because %s\n", name,
+			strerror(errno));
+
+	image->size = buf.st_size;
+	read_bytes(image->fd, name, SQUASHFS_START,
+				sizeof(struct squashfs_super_block), &image->sBlk);
+	SQUASHFS_INSWAP_SUPER_BLOCK(&image->sBlk);
+
+	if(image->sBlk.s_magic != SQUASHFS_MAGIC ||
+				image->sBlk.s_major != SQUASHFS_MAJOR)
+		BAD_ERROR("%s is not a Squashfs 4.0 filesystem\n", name);
+
+	if(image->sBlk.block_size > SQUASHFS_FILE_MAX_SIZE ||
+			image->sBlk.block_size != (1 << image->sBlk.block_log))
+		BAD_ERROR("%s has an invalid block size\n", name);
+
+	image->comp = lookup_compressor_id(image->sBlk.compression);
+	if(!image->comp->supported)
+		BAD_ERROR("%s uses %s compression, which is not supported by "
+			"this build\n", name, image->comp->name);
+}
+
+
+/*
+ * Find the compressed data and fragment blocks in the filesystem, sorted by
+ * position, with duplicates (hard links and duplicate files) removed
+ */
+static void scan_image(struct image *image)
+{
+	int i, j, res;
+
+	if(meta_reader_init(&image->reader, image->fd, &image->sBlk,
+								image->comp))
+		MEM_ERROR();
+
+	read_fragments(image);
+	res = scan_meta(&image->reader, FALSE, add_file, image);
+	if(res)
+		BAD_ERROR("Failed to scan %s because %s\n", image->name,
+			strerror(-res));
+	meta_reader_free(&image->reader);
+
+	qsort(image->extent, image->extents, sizeof(struct extent),
+		compare_extent);
+
+	for(i = 0, j = 0; i < image->extents; i++) {
+		if(j && image->extent[i].start < image->extent[j - 1].start +
+					image->extent[j - 1].size) {
+			if(image->extent[i].start != image->extent[j - 1].start
+					|| image->extent[i].size !=
+					image->extent[j - 1].size)
+				BAD_ERROR("Overlapping blocks in %s, filesystem "
+					"corrupted?\n", image->name);
+			continue;
+		}
+		image->extent[j++] = image->extent[i];
+	}
+
+	image->extents = j;
+}
+
+
+static void *hash_thread(void *arg)
+{
+	struct thread_arg *thread = arg;
+	struct image *image = thread->image;
+	char *buffer = malloc(image->sBlk.block_size);
+	int i;
+
+	if(buffer == NULL)
+		MEM_ERROR();
+
+	for(i = thread->first; i < thread->last; i++) {
+		struct extent *extent = &thread->extent[i];
+
+		read_bytes(image->fd, image->name, extent->start, extent->size,
+									buffer);
+		extent->hash = hash_bytes(FNV_OFFSET, (unsigned char *) buffer,
+								extent->size);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+
+static long long find_block(struct extent *extent, char *data, char *buffer)
+{
+	int i = index_table[extent->hash & (index_size - 1)];
+
+	for(; i != -1; i = old_image.extent[i].next) {
+		struct extent *old = &old_image.extent[i];
+
+		if(old->hash != extent->hash || old->size != extent->size)
+			continue;
+
+		read_bytes(old_image.fd, old_image.name, old->start, old->size,
+									buffer);
+		if(memcmp(data, buffer, old->size) == 0)
+			return old->start;
+	}
+
+	return -1;
+}
+
+
+static void *match_thread(void *arg)
+{
+	struct thread_arg *thread = arg;
+	int block_size = new_image.sBlk.block_size;
+	char *data = malloc(block_size), *buffer = malloc(old_image.sBlk.block_size);
+	int i;
+
+	if(data == NULL || buffer == NULL)
+		MEM_ERROR();
+
+	for(i = thread->first; i < thread->last; i++) {
+		struct extent *extent = &thread->extent[i];
+
+		read_bytes(new_image.fd, new_image.name, extent->start,
+							extent->size, data);
+		extent->hash = hash_bytes(FNV_OFFSET, (unsigned char *) data,
+								extent->size);
+		thread->match[i] = find_block(extent, data, buffer);
+	}
+
+	free(data);
+	free(buffer);
+	return NULL;
+}
+
+
+/*
+ * Run function over extents first to last, splitting the work between
+ * processors threads
+ */
+static void run_threads(void *(*function)(void *), struct image *image,
+	struct extent *extent, long long *match, int first, int last)
+{
+	pthread_t thread[processors];
+	struct thread_arg arg[processors];
+	int i, per_thread = (last - first + processors - 1) / processors;
+
+	for(i = 0; i < processors; i++) {
+		arg[i].image = image;
+		arg[i].extent = extent;
+		arg[i].match = match;
+		arg[i].first = first + i * per_thread;
+		arg[i].last = arg[i].first + per_thread > last ? last :
+			arg[i].first + per_thread;
+		if(arg[i].first > last)
+			arg[i].first = last;
+		if(pthread_create(&thread[i], NULL, function, &arg[i]) != 0)
+			BAD_ERROR("Failed to create thread\n");
+	}
+
+	for(i = 0; i < processors; i++)
+		pthread_join(thread[i], NULL);
+}
+
+
+static void build_index()
+{
+	int i;
+
+	for(index_size = 1; index_size < old_image.extents * 2; index_size <<= 1);
+
+	index_table = malloc(index_size * sizeof(int));
+	if(index_table == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < index_size; i++)
+		index_table[i] = -1;
+
+	if(old_image.extents)
+		run_threads(hash_thread, &old_image, old_image.extent, NULL, 0,
+			old_image.extents);
+
+	for(i = 0; i < old_image.extents; i++) {
+		int hash = old_image.extent[i].hash & (index_size - 1);
+
+		old_image.extent[i].next = index_table[hash];
+		index_table[hash] = i;
+	}
+}
+
+
+/*
+ * Delta output.  Adjacent copies from contiguous old filesystem data, and
+ * adjacent literals are merged into one operation
+ */
+static struct delta_op pending = { DELTA_END };
+static long long pending_start;
+static struct sha256 new_digest;
+
+
+static void flush_op(int out)
+{
+	struct delta_op op = pending;
+	long long start = pending_start, length = pending.length;
+	char buffer[IO_SIZE];
+
+	if(pending.type == DELTA_END)
+		return;
+
+	SQUASHFS_INSWAP_INTS(&op.type, 2);
+	SQUASHFS_INSWAP_LONG_LONGS(&op.length, 2);
+	write_stream(out, &op, sizeof(op));
+
+	while(length) {
+		int bytes = length > IO_SIZE ? IO_SIZE : length;
+
+		read_bytes(new_image.fd, new_image.name, start, bytes, buffer);
+		sha256_update(&new_digest, buffer, bytes);
+		if(pending.type == DELTA_LITERAL)
+			write_stream(out, buffer, bytes);
+		start += bytes;
+		length -= bytes;
+	}
+
+	if(pending.type == DELTA_COPY)
+		copied_bytes += pending.length;
+	else
+		literal_bytes += pending.length;
+
+	pending.type = DELTA_END;
+}
+
+
+static void add_op(int out, int type, long long start, long long length,
+	long long offset)
+{
+	if(length == 0)
+		return;
+
+	if(pending.type == type && pending_start + pending.length == start &&
+			(type == DELTA_LITERAL || pending.offset +
+			pending.length == offset)) {
+		pending.length += length;
+		return;
+	}
+
+	flush_op(out);
+
+	pending.type = type;
+	pending.length = length;
+	pending.offset = type == DELTA_COPY ? offset : 0;
+	pending_start = start;
+}
+
+
+static void create_delta(char *old_name, char *new_name, char *delta_name)
+{
+	struct delta_header header;
+	struct delta_op end = { DELTA_END };
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	long long pos = 0, *match;
+	int i, out;
+
+	open_image(&old_image, old_name);
+	open_image(&new_image, new_name);
+
+	scan_image(&old_image);
+	scan_image(&new_image);
+	build_index();
+	sha256_init(&new_digest);
+
+	if(strcmp(delta_name, "-") == 0)
+		out = STDOUT_FILENO;
+	else {
+		out = open(delta_name, O_CREAT | O_TRUNC | O_WRONLY,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if(out == -1)
+			BAD_ERROR("Could not create %s, because %s\n",
+				delta_name, strerror(errno));
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DELTA_MAGIC, 8);
+	header.old_size = old_image.size;
+	header.new_size = new_image.size;
+	read_bytes(old_image.fd, old_name, SQUASHFS_START,
+		sizeof(struct squashfs_super_block), &header.old_sBlk);
+	SQUASHFS_INSWAP_LONG_LONGS(&header.old_size, 2);
+	write_stream(out, &header, sizeof(header));
+
+	match = malloc(DELTA_BATCH * sizeof(long long));
+	if(match == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < new_image.extents; i += DELTA_BATCH) {
+		int j, last = i + DELTA_BATCH > new_image.extents ?
+			new_image.extents : i + DELTA_BATCH;
+
+		run_threads(match_thread, &new_image, new_image.extent + i,
+			match, 0, last - i);
+
+		for(j = i; j < last; j++) {
+			struct extent *extent = &new_image.extent[j];
+
+			add_op(out, DELTA_LITERAL, pos, extent->start - pos, 0);
+			if(match[j - i] == -1)
+				add_op(out, DELTA_LITERAL, extent->start,
+					extent->size, 0);
+			else {
+				add_op(out, DELTA_COPY, extent->start,
+					extent->size, match[j - i]);
+				copied_blocks ++;
+			}
+			pos = extent->start + extent->size;
+		}
+	}
+
+	add_op(out, DELTA_LITERAL, pos, new_image.size - pos, 0);
+	flush_op(out);
+
+	sha256_final(&new_digest, digest);
+	write_stream(out, &end, sizeof(end));
+	write_stream(out, digest, SHA256_DIGEST_SIZE);
+
+	if(out != STDOUT_FILENO && close(out) == -1)
+		BAD_ERROR("Failed to close %s, because %s\n", delta_name,
+			strerror(errno));
+
+	if(!quiet)
+		fprintf(stderr, "%d of %d blocks, %lld bytes copied from %s, "
+			"%lld bytes literal\n", copied_blocks, new_image.extents,
+			copied_bytes, old_name, literal_bytes);
+}
+
+
+static void apply_delta(char *old_name, char *delta_name, char *new_name)
+{
+	struct delta_header header;
+	struct squashfs_super_block sBlk;
+	struct delta_op op;
+	struct stat buf;
+	struct sha256 hash;
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	unsigned char expected[SHA256_DIGEST_SIZE];
+	char buffer[IO_SIZE];
+	int in, out, old;
+
+	if(strcmp(delta_name, "-") == 0)
+		in = STDIN_FILENO;
+	else {
+		in = open(delta_name, O_RDONLY);
+		if(in == -1)
+			BAD_ERROR("Could not open %s, because %s\n", delta_name,
+				strerror(errno));
+	}
+
+	if(read_stream(in, &header, sizeof(header)) == FALSE ||
+			memcmp(header.magic, DELTA_MAGIC, 8) != 0)
+		BAD_ERROR("%s is not a Squashfs delta\n", delta_name);
+	SQUASHFS_INSWAP_LONG_LONGS(&header.old_size, 2);
+
+	old = open(old_name, O_RDONLY);
+	if(old == -1)
+		BAD_ERROR("Could not open %s, because %s\n", old_name,
+			strerror(errno));
+
+	if(fstat(old, &buf) == -1)
+		BAD_ERROR("Could not stat %s, because %s\n", old_name,
+			strerror(errno));
+
+	read_bytes(old, old_name, SQUASHFS_START, sizeof(sBlk), &sBlk);
+	if(buf.st_size != header.old_size || memcmp(&sBlk, &header.old_sBlk,
+							sizeof(sBlk)) != 0)
+		BAD_ERROR("%s is not the filesystem the delta was created "
+			"from\n", old_name);
+
+	out = open(new_name, O_CREAT | O_TRUNC | O_WRONLY,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(out == -1)
+		BAD_ERROR("Could not create %s, because %s\n", new_name,
+			strerror(errno));
+
+	sha256_init(&hash);
+
+	while(1) {
+		long long offset;
+
+		if(read_stream(in, &op, sizeof(op)) == FALSE)
+			BAD_ERROR("Unexpected EOF reading delta\n");
+		SQUASHFS_INSWAP_INTS(&op.type, 2);
+		SQUASHFS_INSWAP_LONG_LONGS(&op.length, 2);
+
+		if(op.type == DELTA_END)
+			break;
+
+		if(op.type != DELTA_COPY && op.type != DELTA_LITERAL)
+			BAD_ERROR("Corrupted delta\n");
+
+		for(offset = op.offset; op.length; ) {
+			int bytes = op.length > IO_SIZE ? IO_SIZE : op.length;
+
+			if(op.type == DELTA_COPY) {
+				read_bytes(old, old_name, offset, bytes, buffer);
+				offset += bytes;
+			} else if(read_stream(in, buffer, bytes) == FALSE)
+				BAD_ERROR("Unexpected EOF reading delta\n");
+
+			sha256_update(&hash, buffer, bytes);
+			write_stream(out, buffer, bytes);
+			op.length -= bytes;
+		}
+	}
+
+	if(read_stream(in, expected, SHA256_DIGEST_SIZE) == FALSE)
+		BAD_ERROR("Unexpected EOF reading delta\n");
+
+	if(close(out) == -1)
+		BAD_ERROR("Failed to close %s, because %s\n", new_name,
+			strerror(errno));
+
+	sha256_final(&hash, digest);
+	if(memcmp(digest, expected, SHA256_DIGEST_SIZE) != 0) {
+		unlink(new_name);
+		BAD_ERROR("%s does not match the filesystem the delta was "
+			"created from\n", new_name);
+	}
+}
+
+
+static void print_options(FILE *stream, char *name)
+{
+	fprintf(stream, "SYNTAX: %s [OPTIONS] old_filesystem new_filesystem "
+		"delta\n", name);
+	fprintf(stream, "        %s -apply [OPTIONS] old_filesystem delta "
+		"new_filesystem\n\n", name);
+	fprintf(stream, "Creates a delta holding the blocks of new_filesystem "
+		"which are not in\nold_filesystem, or with -apply rebuilds "
+		"new_filesystem from old_filesystem\nand the delta.  The delta "
+		"can be \"-\" to write to stdout or read from stdin.\n\n");
+	fprintf(stream, "Options are\n");
+	fprintf(stream, "-apply\t\t\tapply delta rather than creating it\n");
+	fprintf(stream, "-processors <number>\tuse <number> processors to "
+		"create the delta.  By\n\t\t\tdefault will use number of "
+		"processors available\n");
+	fprintf(stream, "-quiet\t\t\tdon't print the delta summary\n");
+	fprintf(stream, "-help\t\t\toutput this options text to stdout\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int i, apply = FALSE;
+
+	for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		if(strcmp(argv[i], "-apply") == 0)
+			apply = TRUE;
+		else if(strcmp(argv[i], "-quiet") == 0)
+			quiet = TRUE;
+		else if(strcmp(argv[i], "-processors") == 0) {
+			if(++i == argc || (processors = atoi(argv[i])) < 1) {
+				ERROR("%s: -processors missing or invalid "
+					"processor number\n", argv[0]);
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-help") == 0 ||
+						strcmp(argv[i], "-h") == 0) {
+			print_options(stdout, argv[0]);
+			exit(0);
+		} else {
+			ERROR("%s: invalid option\n\n", argv[0]);
+			print_options(stderr, argv[0]);
+			exit(1);
+		}
+	}
+
+	if(argc - i != 3) {
+		print_options(stderr, argv[0]);
+		exit(1);
+	}
+
+	if(processors == -1) {
+		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		if(processors < 1)
+			processors = 1;
+	}
+
+	if(apply)
+		apply_delta(argv[i], argv[i + 1], argv[i + 2]);
+	else
+		create_delta(argv[i], argv[i + 1], argv[i + 2]);
+
+	return 0;
+}
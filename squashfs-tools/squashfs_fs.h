@@ -29,6 +29,7 @@
 #define SQUASHFS_MINOR			0
 #define SQUASHFS_MAGIC			0x73717368
 #define SQUASHFS_MAGIC_SWAP		0x68737173
+#define SQUASHFS_PATH_INDEX_MAGIC	0x78646970
 #define SQUASHFS_START			0
 
 /* size of metadata (inode and directory) blocks */
@@ -496,4 +497,36 @@ struct squashfs_xattr_table {
 	unsigned int		unused;
 };
 
+/*
+ * Optional path index, stored after the filesystem tables at bytes_used,
+ * and so ignored by the kernel and older tools.  The entries are the
+ * pathnames of the filesystem in directory order, packed into metadata
+ * blocks, with a block index of the first pathname in each block.
+ * Pathnames share their leading bytes with the previous entry in the
+ * same metadata block.
+ */
+struct squashfs_path_index_header {
+	unsigned int		magic;
+	unsigned int		entries;
+	unsigned int		blocks;
+	unsigned int		index_bytes;
+	long long		index_start;
+	long long		root_inode;
+};
+
+struct squashfs_path_index_entry {
+	unsigned int		start_block;
+	unsigned short		offset;
+	unsigned short		type;
+	unsigned short		shared;
+	unsigned short		size;
+	char			path[0];
+};
+
+struct squashfs_path_index {
+	unsigned int		start_block;
+	unsigned int		size;
+	char			path[0];
+};
+
 #endif
@@ -0,0 +1,1270 @@
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * squashfs_read.c
+ *
+ * libsquashfs-read.  Metadata and data blocks are read through a cache of
+ * decompressed blocks shared by all the threads using the filesystem.
+ * Blocks are decompressed outside of the cache lock, and so threads reading
+ * different blocks decompress them in parallel, while threads wanting a
+ * block which is being decompressed wait for it rather than decompressing
+ * it again.  Reads of more than one block are split between a pool of
+ * threads.
+ *
+ * Inodes and directories are decoded by read_meta.c, shared with the rest
+ * of Squashfs-tools, but read through the cache here.  Unlike the rest of
+ * Squashfs-tools, errors are returned to the caller rather than reported,
+ * and nothing is global.
+ */
+
+#define TRUE 1
+#define FALSE 0
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "compressor.h"
+#include "read_meta.h"
+#include "squashfs_read.h"
+
+#define CACHE_HASH_SIZE		4096
+#define CACHE_HASH(start)	(((start) ^ ((start) >> 12)) & \
+					(CACHE_HASH_SIZE - 1))
+
+/* default size of the block cache in Mbytes, and the minimum in blocks */
+#define DEFAULT_CACHE_SIZE	64
+#define MIN_CACHE_BLOCKS	32
+
+/*
+ * Number of block list entries read from the inode table at a time.  The
+ * position in the block list of every BLOCK_LIST_SIZE'th block of recently
+ * read large files is cached in BLOCK_INDEX_SLOTS block indexes, in the way
+ * the kernel's meta index does, so a read doesn't have to add up the sizes
+ * of all the blocks before it
+ */
+#define BLOCK_LIST_SIZE		128
+#define BLOCK_INDEX_SLOTS	64
+
+struct cache_entry {
+	long long		start;
+	long long		next;
+	int			length;		/* or -errno if the read failed */
+	int			used;
+	int			pending;
+	struct cache_entry	*hash_next;
+	struct cache_entry	*lru_prev;
+	struct cache_entry	*lru_next;
+	char			*data;
+};
+
+/* a read split into one job per block */
+struct read_request {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	int			outstanding;
+	int			error;
+};
+
+struct read_job {
+	struct read_request	*request;
+	long long		start;
+	unsigned int		c_byte;
+	int			offset;
+	int			bytes;
+	char			*dest;
+	struct read_job		*next;
+};
+
+/* position in the block list of block (n + 1) * BLOCK_LIST_SIZE */
+struct block_pos {
+	long long		list_block;
+	int			list_offset;
+	long long		start;
+};
+
+/* the cached block list positions of the file whose list is at key */
+struct block_index {
+	long long		key_block;
+	unsigned int		key_offset;
+	int			entries;
+	int			size;
+	struct block_pos	*pos;
+};
+
+struct sqfs {
+	int				fd;
+	long long			offset;
+	struct squashfs_super_block	sBlk;
+	struct compressor		*comp;
+	struct meta_reader		reader;
+	unsigned int			*id_table;
+	long long			*fragment_index;
+
+	/* cache of decompressed blocks */
+	pthread_mutex_t			cache_mutex;
+	pthread_cond_t			cache_cond;
+	struct cache_entry		*hash_table[CACHE_HASH_SIZE];
+	struct cache_entry		*lru_head;
+	struct cache_entry		*lru_tail;
+	struct cache_entry		*entry;
+	char				*cache_data;
+	int				entries;
+	int				max_entries;
+	int				entry_size;
+
+	/* block indexes of large files */
+	pthread_mutex_t			index_mutex;
+	struct block_index		index[BLOCK_INDEX_SLOTS];
+	int				next_index;
+
+	/* threads decompressing the blocks of large reads */
+	pthread_t			*thread;
+	int				threads;
+	pthread_mutex_t			job_mutex;
+	pthread_cond_t			job_cond;
+	struct read_job			*job_head;
+	struct read_job			*job_tail;
+	int				quit;
+};
+
+/*
+ * Position in a directory.  The metadata block being read is copied, so
+ * reading entries doesn't go through the shared cache
+ */
+struct sqfs_dir {
+	struct sqfs			*fs;
+	struct meta_reader		reader;
+	struct meta_dir			pos;
+	long long			data_block;
+	long long			next_block;
+	int				length;
+	char				data[SQUASHFS_METADATA_SIZE];
+};
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+
+
+static void make_buffer_key()
+{
+	pthread_key_create(&buffer_key, free);
+}
+
+
+/*
+ * Return this thread's buffer for reading compressed blocks into.  It is
+ * freed when the thread exits
+ */
+static char *get_buffer()
+{
+	char *buffer = pthread_getspecific(buffer_key);
+
+	if(buffer == NULL) {
+		buffer = malloc(SQUASHFS_FILE_MAX_SIZE);
+		if(buffer && pthread_setspecific(buffer_key, buffer) != 0) {
+			free(buffer);
+			buffer = NULL;
+		}
+	}
+
+	return buffer;
+}
+
+
+static int read_bytes(struct sqfs *fs, long long start, int bytes, void *buff)
+{
+	int res, count;
+
+	for(count = 0; count < bytes; count += res) {
+		res = pread(fs->fd, buff + count, bytes - count, fs->offset +
+								start + count);
+		if(res < 1) {
+			if(res == 0)
+				return -EIO;
+			else if(errno != EINTR)
+				return -errno;
+			res = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Read and decompress the block at entry->start, returning its length.
+ * Metadata blocks start with their compressed size, for data blocks it is
+ * passed in c_byte
+ */
+static int read_block(struct sqfs *fs, struct cache_entry *entry,
+	unsigned int c_byte, int metadata)
+{
+	long long start = entry->start;
+	int size, compressed, outlen, res, error;
+	char *buffer;
+
+	if(metadata) {
+		unsigned short c_short;
+
+		res = read_bytes(fs, start, 2, &c_short);
+		if(res)
+			return res;
+
+		SQUASHFS_INSWAP_SHORTS(&c_short, 1);
+		size = SQUASHFS_COMPRESSED_SIZE(c_short);
+		compressed = SQUASHFS_COMPRESSED(c_short);
+		outlen = SQUASHFS_METADATA_SIZE;
+		start += 2;
+	} else {
+		size = SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte);
+		compressed = SQUASHFS_COMPRESSED_BLOCK(c_byte);
+		outlen = fs->sBlk.block_size;
+	}
+
+	if(size > outlen || start + size > fs->sBlk.bytes_used)
+		return -EIO;
+
+	entry->next = start + size;
+
+	if(!compressed) {
+		res = read_bytes(fs, start, size, entry->data);
+		return res ? res : size;
+	}
+
+	buffer = get_buffer();
+	if(buffer == NULL)
+		return -ENOMEM;
+
+	res = read_bytes(fs, start, size, buffer);
+	if(res)
+		return res;
+
+	res = compressor_uncompress(fs->comp, entry->data, buffer, size,
+		outlen, &error);
+
+	return res == -1 ? -EIO : res;
+}
+
+
+static void lru_remove(struct sqfs *fs, struct cache_entry *entry)
+{
+	if(entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		fs->lru_head = entry->lru_next;
+
+	if(entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		fs->lru_tail = entry->lru_prev;
+}
+
+
+static void lru_add(struct sqfs *fs, struct cache_entry *entry, int head)
+{
+	if(head) {
+		entry->lru_prev = NULL;
+		entry->lru_next = fs->lru_head;
+		if(fs->lru_head)
+			fs->lru_head->lru_prev = entry;
+		else
+			fs->lru_tail = entry;
+		fs->lru_head = entry;
+	} else {
+		entry->lru_next = NULL;
+		entry->lru_prev = fs->lru_tail;
+		if(fs->lru_tail)
+			fs->lru_tail->lru_next = entry;
+		else
+			fs->lru_head = entry;
+		fs->lru_tail = entry;
+	}
+}
+
+
+static void hash_remove(struct sqfs *fs, struct cache_entry *entry)
+{
+	struct cache_entry **p = &fs->hash_table[CACHE_HASH(entry->start)];
+
+	for(; *p; p = &(*p)->hash_next)
+		if(*p == entry) {
+			*p = entry->hash_next;
+			break;
+		}
+}
+
+
+/*
+ * Return an unused cache entry, or NULL if they're all in use.  Entries
+ * are used in the order they were last released
+ */
+static struct cache_entry *get_free_entry(struct sqfs *fs)
+{
+	struct cache_entry *entry;
+
+	if(fs->entries < fs->max_entries) {
+		entry = &fs->entry[fs->entries];
+		entry->data = fs->cache_data + (long long) fs->entries ++ *
+								fs->entry_size;
+		return entry;
+	}
+
+	entry = fs->lru_head;
+	if(entry) {
+		lru_remove(fs, entry);
+		hash_remove(fs, entry);
+	}
+
+	return entry;
+}
+
+
+static struct cache_entry *cache_get(struct sqfs *fs, long long start,
+	unsigned int c_byte, int metadata)
+{
+	int hash = CACHE_HASH(start), length;
+	struct cache_entry *entry;
+
+	pthread_mutex_lock(&fs->cache_mutex);
+
+	while(1) {
+		for(entry = fs->hash_table[hash]; entry; entry = entry->hash_next)
+			if(entry->start == start)
+				break;
+
+		if(entry) {
+			if(entry->used ++ == 0)
+				lru_remove(fs, entry);
+
+			while(entry->pending)
+				pthread_cond_wait(&fs->cache_cond,
+							&fs->cache_mutex);
+
+			pthread_mutex_unlock(&fs->cache_mutex);
+			return entry;
+		}
+
+		entry = get_free_entry(fs);
+		if(entry)
+			break;
+
+		/*
+		 * All entries are in use.  Every thread holds at most one
+		 * entry, so wait for one to be released
+		 */
+		pthread_cond_wait(&fs->cache_cond, &fs->cache_mutex);
+	}
+
+	entry->start = start;
+	entry->used = 1;
+	entry->pending = TRUE;
+	entry->hash_next = fs->hash_table[hash];
+	fs->hash_table[hash] = entry;
+	pthread_mutex_unlock(&fs->cache_mutex);
+
+	length = read_block(fs, entry, c_byte, metadata);
+
+	pthread_mutex_lock(&fs->cache_mutex);
+	entry->length = length;
+	entry->pending = FALSE;
+	pthread_cond_broadcast(&fs->cache_cond);
+	pthread_mutex_unlock(&fs->cache_mutex);
+
+	return entry;
+}
+
+
+static void cache_put(struct sqfs *fs, struct cache_entry *entry)
+{
+	pthread_mutex_lock(&fs->cache_mutex);
+
+	if(-- entry->used == 0) {
+		/* blocks which failed to read are not kept */
+		if(entry->length < 0) {
+			hash_remove(fs, entry);
+			entry->start = -1;
+			lru_add(fs, entry, TRUE);
+		} else
+			lru_add(fs, entry, FALSE);
+
+		pthread_cond_broadcast(&fs->cache_cond);
+	}
+
+	pthread_mutex_unlock(&fs->cache_mutex);
+}
+
+
+/*
+ * Copy length bytes of metadata at block and offset to buff (or skip them
+ * if buff is NULL), and advance block and offset
+ */
+static int read_metadata(struct sqfs *fs, void *buff, long long *block,
+	int *offset, int length)
+{
+	while(length) {
+		struct cache_entry *entry = cache_get(fs, *block, 0, TRUE);
+		int avail = entry->length - *offset;
+
+		if(entry->length < 0 || avail < 0) {
+			int error = entry->length < 0 ? entry->length : -EIO;
+
+			cache_put(fs, entry);
+			return error;
+		}
+
+		if(avail == 0) {
+			*block = entry->next;
+			*offset = 0;
+			cache_put(fs, entry);
+			continue;
+		}
+
+		if(avail > length)
+			avail = length;
+
+		if(buff) {
+			memcpy(buff, entry->data + *offset, avail);
+			buff += avail;
+		}
+
+		cache_put(fs, entry);
+		*offset += avail;
+		length -= avail;
+	}
+
+	return 0;
+}
+
+
+/* read function of the reader used to decode inodes */
+static int read_inode_table(struct meta_reader *reader, void *buff,
+	long long *block, int *offset, int length)
+{
+	return read_metadata(reader->arg, buff, block, offset, length);
+}
+
+
+/*
+ * Copy bytes at offset in the data block at start to dest
+ */
+static int read_data(struct sqfs *fs, long long start, unsigned int c_byte,
+	int offset, int bytes, char *dest)
+{
+	struct cache_entry *entry;
+	int res = 0;
+
+	/* sparse block */
+	if(SQUASHFS_COMPRESSED_SIZE_BLOCK(c_byte) == 0) {
+		memset(dest, 0, bytes);
+		return 0;
+	}
+
+	entry = cache_get(fs, start, c_byte, FALSE);
+
+	if(entry->length < 0)
+		res = entry->length;
+	else if(offset + bytes > entry->length)
+		res = -EIO;
+	else
+		memcpy(dest, entry->data + offset, bytes);
+
+	cache_put(fs, entry);
+	return res;
+}
+
+
+static void do_job(struct sqfs *fs, struct read_job *job)
+{
+	struct read_request *request = job->request;
+	int res = read_data(fs, job->start, job->c_byte, job->offset,
+		job->bytes, job->dest);
+
+	pthread_mutex_lock(&request->mutex);
+	if(res)
+		request->error = res;
+	if(-- request->outstanding == 0)
+		pthread_cond_signal(&request->cond);
+	pthread_mutex_unlock(&request->mutex);
+}
+
+
+static void *worker(void *arg)
+{
+	struct sqfs *fs = arg;
+
+	while(1) {
+		struct read_job *job;
+
+		pthread_mutex_lock(&fs->job_mutex);
+		while(fs->job_head == NULL && !fs->quit)
+			pthread_cond_wait(&fs->job_cond, &fs->job_mutex);
+
+		job = fs->job_head;
+		if(job) {
+			fs->job_head = job->next;
+			if(fs->job_head == NULL)
+				fs->job_tail = NULL;
+		}
+		pthread_mutex_unlock(&fs->job_mutex);
+
+		if(job == NULL)
+			return NULL;
+
+		do_job(fs, job);
+	}
+}
+
+
+/*
+ * Do the jobs of a read, queueing all but the last for the worker threads,
+ * and doing the last ourselves
+ */
+static int do_jobs(struct sqfs *fs, struct read_job *job, int jobs)
+{
+	struct read_request request;
+	int i;
+
+	pthread_mutex_init(&request.mutex, NULL);
+	pthread_cond_init(&request.cond, NULL);
+	request.outstanding = jobs;
+	request.error = 0;
+
+	for(i = 0; i < jobs; i++)
+		job[i].request = &request;
+
+	if(fs->threads && jobs > 1) {
+		pthread_mutex_lock(&fs->job_mutex);
+		for(i = 0; i < jobs - 1; i++) {
+			job[i].next = NULL;
+			if(fs->job_tail)
+				fs->job_tail->next = &job[i];
+			else
+				fs->job_head = &job[i];
+			fs->job_tail = &job[i];
+		}
+		pthread_cond_broadcast(&fs->job_cond);
+		pthread_mutex_unlock(&fs->job_mutex);
+
+		do_job(fs, &job[jobs - 1]);
+	} else
+		for(i = 0; i < jobs; i++)
+			do_job(fs, &job[i]);
+
+	pthread_mutex_lock(&request.mutex);
+	while(request.outstanding)
+		pthread_cond_wait(&request.cond, &request.mutex);
+	pthread_mutex_unlock(&request.mutex);
+
+	pthread_mutex_destroy(&request.mutex);
+	pthread_cond_destroy(&request.cond);
+
+	return request.error;
+}
+
+
+static int read_table(struct sqfs *fs, long long start, int indexes,
+	int bytes, void *table)
+{
+	long long index[indexes];
+	int offset = 0, res;
+
+	res = read_bytes(fs, start, indexes * sizeof(long long), index);
+	if(res)
+		return res;
+
+	SQUASHFS_INSWAP_LONG_LONGS(index, indexes);
+
+	/*
+	 * The table metadata blocks are consecutive, and so reading from
+	 * the first block continues into the rest
+	 */
+	return read_metadata(fs, table, &index[0], &offset, bytes);
+}
+
+
+static int read_fragment(struct sqfs *fs, unsigned int fragment,
+	struct squashfs_fragment_entry *entry)
+{
+	long long block;
+	int offset, res;
+
+	if(fragment >= fs->sBlk.fragments)
+		return -EIO;
+
+	block = fs->fragment_index[SQUASHFS_FRAGMENT_INDEX(fragment)];
+	offset = SQUASHFS_FRAGMENT_INDEX_OFFSET(fragment);
+
+	res = read_metadata(fs, entry, &block, &offset, sizeof(*entry));
+	if(res == 0)
+		SQUASHFS_INSWAP_FRAGMENT_ENTRY(entry);
+
+	return res;
+}
+
+
+struct sqfs *sqfs_open(char *filename, long long offset, int cache_mbytes,
+	int threads)
+{
+	struct sqfs *fs = calloc(1, sizeof(struct sqfs));
+	int i, res, error = ENOMEM;
+
+	if(fs == NULL)
+		return NULL;
+
+	pthread_once(&buffer_once, make_buffer_key);
+	pthread_mutex_init(&fs->cache_mutex, NULL);
+	pthread_cond_init(&fs->cache_cond, NULL);
+	pthread_mutex_init(&fs->job_mutex, NULL);
+	pthread_cond_init(&fs->job_cond, NULL);
+	pthread_mutex_init(&fs->index_mutex, NULL);
+
+	fs->offset = offset;
+	fs->fd = open(filename, O_RDONLY);
+	if(fs->fd == -1) {
+		error = errno;
+		goto failed;
+	}
+
+	res = read_bytes(fs, SQUASHFS_START, sizeof(struct squashfs_super_block),
+		&fs->sBlk);
+	if(res) {
+		error = -res;
+		goto failed;
+	}
+
+	SQUASHFS_INSWAP_SUPER_BLOCK(&fs->sBlk);
+
+	error = EINVAL;
+	if(fs->sBlk.s_magic != SQUASHFS_MAGIC ||
+				fs->sBlk.s_major != SQUASHFS_MAJOR ||
+				fs->sBlk.block_size > SQUASHFS_FILE_MAX_SIZE ||
+				fs->sBlk.block_size != (1 << fs->sBlk.block_log))
+		goto failed;
+
+	fs->comp = lookup_compressor_id(fs->sBlk.compression);
+	if(!fs->comp->supported) {
+		error = EOPNOTSUPP;
+		goto failed;
+	}
+
+	fs->reader.sBlk = &fs->sBlk;
+	fs->reader.read = read_inode_table;
+	fs->reader.arg = fs;
+
+	/*
+	 * Metadata blocks are cached alongside data blocks, and so entries
+	 * must be large enough for either
+	 */
+	fs->entry_size = fs->sBlk.block_size > SQUASHFS_METADATA_SIZE ?
+		fs->sBlk.block_size : SQUASHFS_METADATA_SIZE;
+	fs->max_entries = ((long long) (cache_mbytes > 0 ? cache_mbytes :
+		DEFAULT_CACHE_SIZE) << 20) / fs->entry_size;
+	if(fs->max_entries < MIN_CACHE_BLOCKS)
+		fs->max_entries = MIN_CACHE_BLOCKS;
+
+	error = ENOMEM;
+	fs->entry = calloc(fs->max_entries, sizeof(struct cache_entry));
+	fs->cache_data = malloc((long long) fs->max_entries * fs->entry_size);
+	fs->id_table = malloc(SQUASHFS_ID_BYTES(fs->sBlk.no_ids));
+	fs->fragment_index = malloc(SQUASHFS_FRAGMENT_INDEX_BYTES(
+							fs->sBlk.fragments));
+	if(fs->entry == NULL || fs->cache_data == NULL ||
+			fs->id_table == NULL || (fs->sBlk.fragments &&
+			fs->fragment_index == NULL))
+		goto failed;
+
+	res = read_table(fs, fs->sBlk.id_table_start,
+		SQUASHFS_ID_BLOCKS(fs->sBlk.no_ids),
+		SQUASHFS_ID_BYTES(fs->sBlk.no_ids), fs->id_table);
+	if(res) {
+		error = -res;
+		goto failed;
+	}
+
+	SQUASHFS_INSWAP_INTS(fs->id_table, fs->sBlk.no_ids);
+
+	if(fs->sBlk.fragments) {
+		res = read_bytes(fs, fs->sBlk.fragment_table_start,
+			SQUASHFS_FRAGMENT_INDEX_BYTES(fs->sBlk.fragments),
+			fs->fragment_index);
+		if(res) {
+			error = -res;
+			goto failed;
+		}
+
+		SQUASHFS_INSWAP_FRAGMENT_INDEXES(fs->fragment_index,
+			SQUASHFS_FRAGMENT_INDEXES(fs->sBlk.fragments));
+	}
+
+	if(threads < 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(threads > 0) {
+		fs->thread = malloc(threads * sizeof(pthread_t));
+		if(fs->thread == NULL)
+			goto failed;
+
+		for(i = 0; i < threads; i++, fs->threads ++) {
+			res = pthread_create(&fs->thread[i], NULL, worker, fs);
+			if(res) {
+				error = res;
+				goto failed;
+			}
+		}
+	}
+
+	return fs;
+
+failed:
+	sqfs_close(fs);
+	errno = error;
+	return NULL;
+}
+
+
+void sqfs_close(struct sqfs *fs)
+{
+	int i;
+
+	pthread_mutex_lock(&fs->job_mutex);
+	fs->quit = TRUE;
+	pthread_cond_broadcast(&fs->job_cond);
+	pthread_mutex_unlock(&fs->job_mutex);
+
+	for(i = 0; i < fs->threads; i++)
+		pthread_join(fs->thread[i], NULL);
+
+	if(fs->fd != -1)
+		close(fs->fd);
+
+	for(i = 0; i < BLOCK_INDEX_SLOTS; i++)
+		free(fs->index[i].pos);
+
+	free(fs->thread);
+	free(fs->entry);
+	free(fs->cache_data);
+	free(fs->id_table);
+	free(fs->fragment_index);
+	free(fs);
+}
+
+
+/*
+ * Read the inode at ref, which is in the format of squashfs_inode, the
+ * block (relative to the inode table start) and offset of the inode
+ */
+int sqfs_read_inode(struct sqfs *fs, long long ref, struct sqfs_inode *inode)
+{
+	struct meta_inode meta;
+	int res = read_meta_inode(&fs->reader, SQUASHFS_INODE_BLK(ref),
+		SQUASHFS_INODE_OFFSET(ref), &meta);
+
+	if(res)
+		return res;
+
+	inode->inode_number = meta.inode_number;
+	inode->mode = meta.mode;
+	inode->uid = fs->id_table[meta.uid];
+	inode->gid = fs->id_table[meta.gid];
+	inode->nlink = meta.nlink;
+	inode->mtime = meta.mtime;
+	inode->size = meta.size;
+	inode->rdev = meta.rdev;
+	inode->xattr = meta.xattr;
+	inode->start = meta.start;
+	inode->offset = meta.offset;
+	/* for directories fragment is the directory index count */
+	inode->fragment = S_ISDIR(meta.mode) ? meta.i_count : meta.fragment;
+	inode->list_block = meta.block;
+	inode->list_offset = meta.block_offset;
+
+	return 0;
+}
+
+
+int sqfs_root(struct sqfs *fs, struct sqfs_inode *inode)
+{
+	return sqfs_read_inode(fs, fs->sBlk.root_inode, inode);
+}
+
+
+/*
+ * As read_metadata(), but reading from the copy of the current directory
+ * block in dir
+ */
+static int read_directory(struct meta_reader *reader, void *buff,
+	long long *block, int *offset, int length)
+{
+	struct sqfs_dir *dir = reader->arg;
+
+	while(length) {
+		int avail;
+
+		if(*block != dir->data_block) {
+			struct cache_entry *entry = cache_get(dir->fs, *block,
+								0, TRUE);
+
+			dir->length = entry->length;
+			if(entry->length > 0) {
+				memcpy(dir->data, entry->data, entry->length);
+				dir->data_block = *block;
+				dir->next_block = entry->next;
+			}
+			cache_put(dir->fs, entry);
+
+			if(dir->length < 0)
+				return dir->length;
+		}
+
+		avail = dir->length - *offset;
+		if(avail < 0)
+			return -EIO;
+
+		if(avail == 0) {
+			*block = dir->next_block;
+			*offset = 0;
+			continue;
+		}
+
+		if(avail > length)
+			avail = length;
+
+		memcpy(buff, dir->data + *offset, avail);
+		buff += avail;
+		*offset += avail;
+		length -= avail;
+	}
+
+	return 0;
+}
+
+
+static int open_dir(struct sqfs *fs, struct sqfs_inode *inode,
+	struct sqfs_dir *dir)
+{
+	struct meta_inode meta;
+
+	if(!S_ISDIR(inode->mode))
+		return -ENOTDIR;
+
+	meta.start = inode->start;
+	meta.offset = inode->offset;
+	meta.size = inode->size;
+
+	dir->fs = fs;
+	dir->reader.sBlk = &fs->sBlk;
+	dir->reader.read = read_directory;
+	dir->reader.arg = dir;
+	dir->data_block = -1;
+	meta_opendir(&dir->reader, &meta, &dir->pos);
+
+	return 0;
+}
+
+
+int sqfs_opendir(struct sqfs *fs, struct sqfs_inode *inode,
+	struct sqfs_dir **dir)
+{
+	int res;
+
+	*dir = malloc(sizeof(struct sqfs_dir));
+	if(*dir == NULL)
+		return -ENOMEM;
+
+	res = open_dir(fs, inode, *dir);
+	if(res) {
+		free(*dir);
+		*dir = NULL;
+	}
+
+	return res;
+}
+
+
+void sqfs_closedir(struct sqfs_dir *dir)
+{
+	free(dir);
+}
+
+
+int sqfs_readdir(struct sqfs_dir *dir, struct sqfs_dirent *dirent)
+{
+	struct meta_dirent meta;
+	int res = meta_readdir(&dir->reader, &dir->pos, &meta);
+
+	if(res != 1)
+		return res;
+
+	strcpy(dirent->name, meta.name);
+	dirent->mode = meta_type_mode(meta.type);
+	dirent->inode_number = meta.inode_number;
+	dirent->inode = ((long long) meta.start_block << 16) | meta.offset;
+
+	return 1;
+}
+
+
+/*
+ * Large directories have an index of the first name in each metadata block
+ * of the directory.  Use it to skip to the block name would be in
+ */
+static int skip_to_index(struct sqfs *fs, struct sqfs_inode *inode,
+	struct sqfs_dir *dir, char *name)
+{
+	long long block = inode->list_block;
+	int offset = inode->list_offset, i, res;
+
+	for(i = 0; i < inode->fragment; i++) {
+		struct squashfs_dir_index index;
+		char index_name[SQUASHFS_NAME_LEN + 1];
+
+		res = read_metadata(fs, &index, &block, &offset, sizeof(index));
+		if(res)
+			return res;
+
+		SQUASHFS_INSWAP_DIR_INDEX(&index);
+		if(index.size >= SQUASHFS_NAME_LEN)
+			return -EIO;
+
+		res = read_metadata(fs, index_name, &block, &offset,
+							index.size + 1);
+		if(res)
+			return res;
+
+		index_name[index.size + 1] = '\0';
+		if(strcmp(index_name, name) > 0)
+			break;
+
+		dir->pos.block = fs->sBlk.directory_table_start +
+							index.start_block;
+		dir->pos.offset = (inode->offset + index.index) %
+							SQUASHFS_METADATA_SIZE;
+		dir->pos.bytes = 3 + index.index;
+	}
+
+	return 0;
+}
+
+
+int sqfs_lookup(struct sqfs *fs, struct sqfs_inode *inode, char *name,
+	struct sqfs_inode *result)
+{
+	struct sqfs_dir dir;
+	struct sqfs_dirent dirent;
+	int res = open_dir(fs, inode, &dir);
+
+	if(res == 0 && inode->fragment)
+		res = skip_to_index(fs, inode, &dir, name);
+
+	if(res)
+		return res;
+
+	while((res = sqfs_readdir(&dir, &dirent)) == 1) {
+		int cmp = strcmp(dirent.name, name);
+
+		if(cmp == 0)
+			return sqfs_read_inode(fs, dirent.inode, result);
+
+		/* directories are sorted */
+		if(cmp > 0)
+			break;
+	}
+
+	return res < 0 ? res : -ENOENT;
+}
+
+
+/*
+ * Look up pathname from the root directory.  Symlinks are not followed
+ */
+int sqfs_stat(struct sqfs *fs, char *pathname, struct sqfs_inode *inode)
+{
+	struct sqfs_inode *parent = NULL;
+	int depth = 0, size = 0;
+	int res = sqfs_root(fs, inode);
+
+	while(res == 0) {
+		char name[SQFS_NAME_LEN + 1];
+		int len;
+
+		while(*pathname == '/')
+			pathname ++;
+
+		if(*pathname == '\0')
+			break;
+
+		len = strcspn(pathname, "/");
+		if(len > SQFS_NAME_LEN) {
+			res = -ENAMETOOLONG;
+			break;
+		}
+
+		memcpy(name, pathname, len);
+		name[len] = '\0';
+		pathname += len;
+
+		if(!S_ISDIR(inode->mode)) {
+			res = -ENOTDIR;
+			break;
+		}
+
+		if(strcmp(name, ".") == 0)
+			continue;
+
+		if(strcmp(name, "..") == 0) {
+			if(depth)
+				*inode = parent[-- depth];
+			continue;
+		}
+
+		if(depth == size) {
+			struct sqfs_inode *p = realloc(parent, (size += 16) *
+						sizeof(struct sqfs_inode));
+			if(p == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			parent = p;
+		}
+
+		parent[depth ++] = *inode;
+		res = sqfs_lookup(fs, &parent[depth - 1], name, inode);
+	}
+
+	free(parent);
+	return res;
+}
+
+
+static struct block_index *lookup_block_index(struct sqfs *fs,
+	struct sqfs_inode *inode)
+{
+	int i;
+
+	for(i = 0; i < BLOCK_INDEX_SLOTS; i++)
+		if(fs->index[i].pos && fs->index[i].key_block ==
+					inode->list_block &&
+					fs->index[i].key_offset ==
+					inode->list_offset)
+			return &fs->index[i];
+
+	return NULL;
+}
+
+
+/*
+ * Find the nearest cached position at or before block in the block list of
+ * inode, which has blocks blocks, and return its block number, or 0 if there
+ * is none, in which case pos is the start of the block list
+ */
+static int find_block_pos(struct sqfs *fs, struct sqfs_inode *inode,
+	int blocks, int block, struct block_pos *pos)
+{
+	struct block_index *index;
+	int n = 0;
+
+	if(blocks > BLOCK_LIST_SIZE) {
+		pthread_mutex_lock(&fs->index_mutex);
+		index = lookup_block_index(fs, inode);
+		if(index) {
+			n = block / BLOCK_LIST_SIZE;
+			if(n > index->entries)
+				n = index->entries;
+			if(n)
+				*pos = index->pos[n - 1];
+		}
+		pthread_mutex_unlock(&fs->index_mutex);
+	}
+
+	if(n == 0) {
+		pos->list_block = inode->list_block;
+		pos->list_offset = inode->list_offset;
+		pos->start = inode->start;
+	}
+
+	return n * BLOCK_LIST_SIZE;
+}
+
+
+/*
+ * Cache the position of block, a multiple of BLOCK_LIST_SIZE, in the block
+ * list of inode, which has blocks blocks.  Positions are added in order,
+ * and a file not yet indexed replaces the oldest block index
+ */
+static void add_block_pos(struct sqfs *fs, struct sqfs_inode *inode,
+	int blocks, int block, struct block_pos *pos)
+{
+	struct block_index *index;
+	int n = block / BLOCK_LIST_SIZE;
+
+	pthread_mutex_lock(&fs->index_mutex);
+	index = lookup_block_index(fs, inode);
+	if(index == NULL && n == 1) {
+		int size = blocks / BLOCK_LIST_SIZE;
+		struct block_pos *new = malloc(size * sizeof(struct block_pos));
+
+		if(new) {
+			index = &fs->index[fs->next_index];
+			fs->next_index = (fs->next_index + 1) % BLOCK_INDEX_SLOTS;
+			free(index->pos);
+			index->key_block = inode->list_block;
+			index->key_offset = inode->list_offset;
+			index->entries = 0;
+			index->size = size;
+			index->pos = new;
+		}
+	}
+
+	if(index && index->entries == n - 1 && n <= index->size)
+		index->pos[index->entries ++] = *pos;
+	pthread_mutex_unlock(&fs->index_mutex);
+}
+
+
+long long sqfs_pread(struct sqfs *fs, struct sqfs_inode *inode, void *buff,
+	long long bytes, long long offset)
+{
+	int block_log = fs->sBlk.block_log, block_size = fs->sBlk.block_size;
+	int i, first, last, blocks, jobs = 0, res = 0;
+	unsigned int list[BLOCK_LIST_SIZE];
+	struct read_job *job;
+	struct block_pos pos;
+
+	if(S_ISDIR(inode->mode))
+		return -EISDIR;
+	else if(!S_ISREG(inode->mode) || offset < 0 || bytes < 0)
+		return -EINVAL;
+
+	if(offset >= inode->size || bytes == 0)
+		return 0;
+
+	if(bytes > inode->size - offset)
+		bytes = inode->size - offset;
+
+	/*
+	 * Blocks in the block list, if the file has a fragment the tail
+	 * end of the file is stored in it
+	 */
+	if(inode->fragment == SQUASHFS_INVALID_FRAG)
+		blocks = (inode->size + block_size - 1) >> block_log;
+	else
+		blocks = inode->size >> block_log;
+
+	first = offset >> block_log;
+	last = (offset + bytes - 1) >> block_log;
+
+	job = malloc((last - first + 1) * sizeof(struct read_job));
+	if(job == NULL)
+		return -ENOMEM;
+
+	/*
+	 * The location of a block is found by adding up the sizes of the
+	 * blocks before it, starting from the nearest cached position
+	 */
+	i = find_block_pos(fs, inode, blocks, first, &pos);
+
+	while(i <= last && i < blocks) {
+		int n = (last < blocks ? last + 1 : blocks) - i, j;
+
+		if(i && i % BLOCK_LIST_SIZE == 0)
+			add_block_pos(fs, inode, blocks, i, &pos);
+
+		if(n > BLOCK_LIST_SIZE)
+			n = BLOCK_LIST_SIZE;
+
+		res = read_metadata(fs, list, &pos.list_block,
+				&pos.list_offset, n * sizeof(unsigned int));
+		if(res)
+			goto failed;
+
+		SQUASHFS_INSWAP_INTS(list, n);
+
+		for(j = 0; j < n; j++, i++) {
+			if(i >= first) {
+				long long file_pos = (long long) i << block_log;
+				int block_offset = i == first ? offset -
+								file_pos : 0;
+				long long end = file_pos + block_size;
+
+				if(end > offset + bytes)
+					end = offset + bytes;
+
+				job[jobs].start = pos.start;
+				job[jobs].c_byte = list[j];
+				job[jobs].offset = block_offset;
+				job[jobs].bytes = end - file_pos - block_offset;
+				job[jobs].dest = buff + file_pos + block_offset -
+									offset;
+				jobs ++;
+			}
+
+			pos.start += SQUASHFS_COMPRESSED_SIZE_BLOCK(list[j]);
+		}
+	}
+
+	if(last >= blocks) {
+		struct squashfs_fragment_entry entry;
+		long long pos = (long long) last << block_log;
+		int block_offset = last == first ? offset - pos : 0;
+
+		res = read_fragment(fs, inode->fragment, &entry);
+		if(res)
+			goto failed;
+
+		job[jobs].start = entry.start_block;
+		job[jobs].c_byte = entry.size;
+		job[jobs].offset = inode->offset + block_offset;
+		job[jobs].bytes = offset + bytes - pos - block_offset;
+		job[jobs].dest = buff + pos + block_offset - offset;
+		jobs ++;
+	}
+
+	res = do_jobs(fs, job, jobs);
+
+failed:
+	free(job);
+	return res ? res : bytes;
+}
+
+
+int sqfs_readlink(struct sqfs *fs, struct sqfs_inode *inode, char *buff,
+	int size)
+{
+	long long block = inode->list_block;
+	int offset = inode->list_offset, res;
+
+	if(!S_ISLNK(inode->mode))
+		return -EINVAL;
+
+	if(size > inode->size)
+		size = inode->size;
+
+	res = read_metadata(fs, buff, &block, &offset, size);
+
+	return res ? res : size;
+}
@@ -0,0 +1,98 @@
+#ifndef SQUASHFS_READ_H
+#define SQUASHFS_READ_H
+/*
+ * Squashfs
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * squashfs_read.h
+ *
+ * libsquashfs-read, read files from a Squashfs 4.0 filesystem in-process,
+ * without mounting it or running Unsquashfs.
+ *
+ * All state is held in the struct sqfs returned by sqfs_open(), and all
+ * functions can be called concurrently by multiple threads on the same
+ * struct sqfs.  Errors are returned as negative errno values.
+ *
+ * Only the sqfs_* symbols are exported.  Programs using the library link
+ * with -lsquashfs-read -lpthread -lm, and the libraries of the compressors
+ * Squashfs-tools was built with (-lz for gzip, -llzma for xz and lzma,
+ * -llzo2 for lzo, -llz4 for lz4 and -lzstd for zstd).
+ */
+
+#include <time.h>
+
+#define SQFS_NAME_LEN	256
+
+struct sqfs;
+struct sqfs_dir;
+
+struct sqfs_inode {
+	unsigned int	inode_number;
+	unsigned int	mode;		/* file type and permissions */
+	unsigned int	uid;
+	unsigned int	gid;
+	unsigned int	nlink;
+	time_t		mtime;
+	long long	size;		/* file, directory or symlink size */
+	unsigned int	rdev;		/* encoded as in the filesystem */
+	unsigned int	xattr;		/* xattr id or SQUASHFS_INVALID_XATTR */
+
+	/* private */
+	long long	start;
+	unsigned int	offset;
+	unsigned int	fragment;
+	long long	list_block;
+	unsigned int	list_offset;
+};
+
+struct sqfs_dirent {
+	char		name[SQFS_NAME_LEN + 1];
+	unsigned int	mode;		/* file type only */
+	unsigned int	inode_number;
+	long long	inode;		/* pass to sqfs_read_inode() */
+};
+
+/*
+ * Open the filesystem in filename, starting offset bytes into the file.
+ * Cache_mbytes is the size of the cache of decompressed blocks shared by
+ * all threads (0 for the default), and threads is the number of threads
+ * used to decompress the blocks of large reads in parallel (-1 for one per
+ * processor, 0 for none).  Returns NULL with errno set on failure
+ */
+extern struct sqfs *sqfs_open(char *filename, long long offset,
+	int cache_mbytes, int threads);
+extern void sqfs_close(struct sqfs *);
+
+extern int sqfs_root(struct sqfs *, struct sqfs_inode *);
+extern int sqfs_read_inode(struct sqfs *, long long, struct sqfs_inode *);
+extern int sqfs_lookup(struct sqfs *, struct sqfs_inode *, char *,
+	struct sqfs_inode *);
+extern int sqfs_stat(struct sqfs *, char *, struct sqfs_inode *);
+
+/* sqfs_readdir() returns 1 for each entry, and 0 at the end */
+extern int sqfs_opendir(struct sqfs *, struct sqfs_inode *,
+	struct sqfs_dir **);
+extern int sqfs_readdir(struct sqfs_dir *, struct sqfs_dirent *);
+extern void sqfs_closedir(struct sqfs_dir *);
+
+/* as pread(2) and readlink(2) */
+extern long long sqfs_pread(struct sqfs *, struct sqfs_inode *, void *,
+	long long, long long);
+extern int sqfs_readlink(struct sqfs *, struct sqfs_inode *, char *, int);
+#endif
@@ -233,6 +233,28 @@ extern void inswap_le64_num(long long *, int);
 	SWAP_FUNC(32, s, d, xattr_ids, struct squashfs_xattr_table);\
 }
 
+#define _SQUASHFS_SWAP_PATH_INDEX_HEADER(s, d, SWAP_FUNC) {\
+	SWAP_FUNC(32, s, d, magic, struct squashfs_path_index_header);\
+	SWAP_FUNC(32, s, d, entries, struct squashfs_path_index_header);\
+	SWAP_FUNC(32, s, d, blocks, struct squashfs_path_index_header);\
+	SWAP_FUNC(32, s, d, index_bytes, struct squashfs_path_index_header);\
+	SWAP_FUNC(64, s, d, index_start, struct squashfs_path_index_header);\
+	SWAP_FUNC(64, s, d, root_inode, struct squashfs_path_index_header);\
+}
+
+#define _SQUASHFS_SWAP_PATH_INDEX_ENTRY(s, d, SWAP_FUNC) {\
+	SWAP_FUNC(32, s, d, start_block, struct squashfs_path_index_entry);\
+	SWAP_FUNC(16, s, d, offset, struct squashfs_path_index_entry);\
+	SWAP_FUNC(16, s, d, type, struct squashfs_path_index_entry);\
+	SWAP_FUNC(16, s, d, shared, struct squashfs_path_index_entry);\
+	SWAP_FUNC(16, s, d, size, struct squashfs_path_index_entry);\
+}
+
+#define _SQUASHFS_SWAP_PATH_INDEX(s, d, SWAP_FUNC) {\
+	SWAP_FUNC(32, s, d, start_block, struct squashfs_path_index);\
+	SWAP_FUNC(32, s, d, size, struct squashfs_path_index);\
+}
+
 /* big endian architecture copy and swap macros */
 #define SQUASHFS_SWAP_SUPER_BLOCK(s, d)	\
 			_SQUASHFS_SWAP_SUPER_BLOCK(s, d, SWAP_LE)
@@ -272,6 +294,12 @@ extern void inswap_le64_num(long long *, int);
 			 _SQUASHFS_SWAP_XATTR_ID(s, d, SWAP_LE)
 #define SQUASHFS_SWAP_XATTR_TABLE(s, d) \
 			_SQUASHFS_SWAP_XATTR_TABLE(s, d, SWAP_LE)
+#define SQUASHFS_SWAP_PATH_INDEX_HEADER(s, d) \
+			_SQUASHFS_SWAP_PATH_INDEX_HEADER(s, d, SWAP_LE)
+#define SQUASHFS_SWAP_PATH_INDEX_ENTRY(s, d) \
+			_SQUASHFS_SWAP_PATH_INDEX_ENTRY(s, d, SWAP_LE)
+#define SQUASHFS_SWAP_PATH_INDEX(s, d) \
+			_SQUASHFS_SWAP_PATH_INDEX(s, d, SWAP_LE)
 #define SWAP_LE(bits, s, d, field, type) \
 			SWAP_LE##bits(((void *)(s)) + offsetof(type, field), \
 				((void *)(d)) + offsetof(type, field))
@@ -382,6 +410,12 @@ extern void inswap_le64_num(long long *, int);
 		SQUASHFS_MEMCPY(s, d, sizeof(struct squashfs_xattr_id))
 #define SQUASHFS_SWAP_XATTR_TABLE(s, d) \
 		SQUASHFS_MEMCPY(s, d, sizeof(struct squashfs_xattr_table))
+#define SQUASHFS_SWAP_PATH_INDEX_HEADER(s, d) \
+		SQUASHFS_MEMCPY(s, d, sizeof(struct squashfs_path_index_header))
+#define SQUASHFS_SWAP_PATH_INDEX_ENTRY(s, d) \
+		SQUASHFS_MEMCPY(s, d, sizeof(struct squashfs_path_index_entry))
+#define SQUASHFS_SWAP_PATH_INDEX(s, d) \
+		SQUASHFS_MEMCPY(s, d, sizeof(struct squashfs_path_index))
 #define SQUASHFS_SWAP_INODE_T(s, d) SQUASHFS_SWAP_LONG_LONGS(s, d, 1)
 #define SQUASHFS_SWAP_FRAGMENT_INDEXES(s, d, n) \
 			SQUASHFS_SWAP_LONG_LONGS(s, d, n)
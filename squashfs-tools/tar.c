@@ -239,6 +239,8 @@ static struct inode_info *new_inode(struct tar_file *tar_file)
 		memcpy(&inode->symlink, tar_file->link, bytes);
 	memcpy(&inode->buf, &tar_file->buf, sizeof(struct stat));
 	inode->read = FALSE;
+	inode->written = FALSE;
+	inode->incremental = NULL;
 	inode->root_entry = FALSE;
 	inode->tar_file = tar_file;
 	inode->inode = SQUASHFS_INVALID_BLK;
@@ -258,8 +260,7 @@ static struct inode_info *new_inode(struct tar_file *tar_file)
 	inode->noD = noD;
 	inode->noF = noF;
 
-	inode->next = inode_info[0];
-	inode_info[0] = inode;
+	add_inode_hash(inode);
 
 	return inode;
 }
@@ -589,6 +590,7 @@ static void read_tar_data(struct tar_file *tar_file)
 		file_buffer->tar_file = tar_file;
 		file_buffer->sequence = seq ++;
 		file_buffer->noD = noD;
+		file_buffer->incremental = NULL;
 		file_buffer->error = FALSE;
 
 		if((block + 1) < blocks) {
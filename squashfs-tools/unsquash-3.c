@@ -664,6 +664,8 @@ static int read_filesystem_tables()
 		goto corrupted;
 	}
 
+	directory_table_end = table_start;
+
 	alloc_index_table(0);
 	salloc_index_table(0);
 
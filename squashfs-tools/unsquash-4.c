@@ -26,11 +26,28 @@
 #include "squashfs_swap.h"
 #include "xattr.h"
 #include "compressor.h"
+#include "read_meta.h"
 
 static struct squashfs_fragment_entry *fragment_table;
 static unsigned int *id_table;
 static squashfs_operations ops;
 
+static int read_inode_table(struct meta_reader *, void *, long long *, int *,
+	int);
+static int read_directory_table(struct meta_reader *, void *, long long *,
+	int *, int);
+
+/* inodes and directories are decoded by read_meta.c */
+static struct meta_reader inode_reader = {
+	.sBlk = &sBlk.s,
+	.read = read_inode_table
+};
+
+static struct meta_reader directory_reader = {
+	.sBlk = &sBlk.s,
+	.read = read_directory_table
+};
+
 static void read_block_list(unsigned int *block_list, long long start,
 					unsigned int offset, int blocks)
 {
@@ -125,198 +142,98 @@ static void read_fragment(unsigned int fragment, long long *start_block, int *si
 }
 
 
-static struct inode *read_inode(unsigned int start_block, unsigned int offset)
+static int read_inode_table(struct meta_reader *reader, void *buff,
+	long long *block, int *offset, int length)
 {
-	static union squashfs_inode_header header;
-	long long start = sBlk.s.inode_table_start + start_block;
-	long long st = start;
-	unsigned int off = offset;
-	static struct inode i;
-	int res;
-
-	TRACE("read_inode: reading inode [%d:%d]\n", start_block,  offset);
-
-	res = read_inode_data(&header.base, &st, &off, sizeof(header.base));
-	if(res == FALSE)
-		EXIT_UNSQUASH("read_inode: failed to read inode %lld:%d\n", st, off);
+	unsigned int off = *offset;
+	int res = read_inode_data(buff, block, &off, length);
 
-	SQUASHFS_INSWAP_BASE_INODE_HEADER(&header.base);
-
-	i.uid = (uid_t) id_table[header.base.uid];
-	i.gid = (uid_t) id_table[header.base.guid];
-	i.mode = lookup_type[header.base.inode_type] | header.base.mode;
-	i.type = header.base.inode_type;
-	i.time = header.base.mtime;
-	i.inode_number = header.base.inode_number;
-
-	switch(header.base.inode_type) {
-		case SQUASHFS_DIR_TYPE: {
-			struct squashfs_dir_inode_header *inode = &header.dir;
-
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
-
-			SQUASHFS_INSWAP_DIR_INODE_HEADER(inode);
+	*offset = off;
+	return res == FALSE ? -EIO : 0;
+}
 
-			i.data = inode->file_size;
-			i.offset = inode->offset;
-			i.start = inode->start_block;
-			i.xattr = SQUASHFS_INVALID_XATTR;
-			break;
-		}
-		case SQUASHFS_LDIR_TYPE: {
-			struct squashfs_ldir_inode_header *inode = &header.ldir;
 
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
+static int read_directory_table(struct meta_reader *reader, void *buff,
+	long long *block, int *offset, int length)
+{
+	unsigned int off = *offset;
+	int res = read_directory_data(buff, block, &off, length);
 
-			SQUASHFS_INSWAP_LDIR_INODE_HEADER(inode);
+	*offset = off;
+	return res == FALSE ? -EIO : 0;
+}
 
-			i.data = inode->file_size;
-			i.offset = inode->offset;
-			i.start = inode->start_block;
-			i.xattr = inode->xattr;
-			break;
-		}
-		case SQUASHFS_FILE_TYPE: {
-			struct squashfs_reg_inode_header *inode = &header.reg;
 
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
+static struct inode *read_inode(unsigned int start_block, unsigned int offset)
+{
+	struct meta_inode inode;
+	static struct inode i;
+	int res;
 
-			SQUASHFS_INSWAP_REG_INODE_HEADER(inode);
+	TRACE("read_inode: reading inode [%d:%d]\n", start_block,  offset);
 
-			i.data = inode->file_size;
-			i.frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG
-				?  0 : inode->file_size % sBlk.s.block_size;
-			i.fragment = inode->fragment;
-			i.offset = inode->offset;
-			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ?
-				(i.data + sBlk.s.block_size - 1) >>
-				sBlk.s.block_log :
-				i.data >> sBlk.s.block_log;
-			i.start = inode->start_block;
-			i.block_start = start;
-			i.block_offset = offset;
-			i.sparse = 0;
-			i.xattr = SQUASHFS_INVALID_XATTR;
+	res = read_meta_inode(&inode_reader, start_block, offset, &inode);
+	if(res)
+		EXIT_UNSQUASH("read_inode: failed to read inode %d:%d\n",
+			start_block, offset);
+
+	i.uid = (uid_t) id_table[inode.uid];
+	i.gid = (uid_t) id_table[inode.gid];
+	i.mode = inode.mode;
+	i.type = inode.type;
+	i.time = inode.mtime;
+	i.inode_number = inode.inode_number;
+	i.xattr = inode.xattr;
+
+	switch(inode.type) {
+		case SQUASHFS_DIR_TYPE:
+		case SQUASHFS_LDIR_TYPE:
+			i.data = inode.size;
+			i.offset = inode.offset;
+			i.start = inode.start;
 			break;
-		}	
-		case SQUASHFS_LREG_TYPE: {
-			struct squashfs_lreg_inode_header *inode = &header.lreg;
-
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
-
-			SQUASHFS_INSWAP_LREG_INODE_HEADER(inode);
-
-			i.data = inode->file_size;
-			i.frag_bytes = inode->fragment == SQUASHFS_INVALID_FRAG
-				?  0 : inode->file_size % sBlk.s.block_size;
-			i.fragment = inode->fragment;
-			i.offset = inode->offset;
-			i.blocks = inode->fragment == SQUASHFS_INVALID_FRAG ?
-				(inode->file_size + sBlk.s.block_size - 1) >>
+		case SQUASHFS_FILE_TYPE:
+		case SQUASHFS_LREG_TYPE:
+			i.data = inode.size;
+			i.frag_bytes = inode.fragment == SQUASHFS_INVALID_FRAG
+				?  0 : inode.size % sBlk.s.block_size;
+			i.fragment = inode.fragment;
+			i.offset = inode.offset;
+			i.blocks = inode.fragment == SQUASHFS_INVALID_FRAG ?
+				(inode.size + sBlk.s.block_size - 1) >>
 				sBlk.s.block_log :
-				inode->file_size >> sBlk.s.block_log;
-			i.start = inode->start_block;
-			i.block_start = start;
-			i.block_offset = offset;
-			i.sparse = inode->sparse != 0;
-			i.xattr = inode->xattr;
+				inode.size >> sBlk.s.block_log;
+			i.start = inode.start;
+			i.block_start = inode.block;
+			i.block_offset = inode.block_offset;
+			i.sparse = inode.sparse;
 			break;
-		}	
 		case SQUASHFS_SYMLINK_TYPE:
 		case SQUASHFS_LSYMLINK_TYPE: {
-			struct squashfs_symlink_inode_header *inode = &header.symlink;
+			long long start = inode.block;
+			unsigned int off = inode.block_offset;
 
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
-
-			SQUASHFS_INSWAP_SYMLINK_INODE_HEADER(inode);
-
-			i.symlink = malloc(inode->symlink_size + 1);
+			i.symlink = malloc(inode.size + 1);
 			if(i.symlink == NULL)
 				MEM_ERROR();
 
-			res = read_inode_data(i.symlink, &start, &offset, inode->symlink_size);
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode symbolic link %lld:%d\n", start, offset);
-
-			i.symlink[inode->symlink_size] = '\0';
-			i.data = inode->symlink_size;
-
-			if(header.base.inode_type == SQUASHFS_LSYMLINK_TYPE) {
-				res = read_inode_data(&i.xattr, &start, &offset, sizeof(unsigned int));
-				SQUASHFS_INSWAP_INTS(&i.xattr, 1);
-			} else
-				i.xattr = SQUASHFS_INVALID_XATTR;
-			break;
-		}
- 		case SQUASHFS_BLKDEV_TYPE:
-	 	case SQUASHFS_CHRDEV_TYPE: {
-			struct squashfs_dev_inode_header *inode = &header.dev;
-
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
-
-			SQUASHFS_INSWAP_DEV_INODE_HEADER(inode);
-
-			i.data = inode->rdev;
-			i.xattr = SQUASHFS_INVALID_XATTR;
-			break;
-		}
- 		case SQUASHFS_LBLKDEV_TYPE:
-	 	case SQUASHFS_LCHRDEV_TYPE: {
-			struct squashfs_ldev_inode_header *inode = &header.ldev;
-
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
+			res = read_inode_data(i.symlink, &start, &off, inode.size);
 			if(res == FALSE)
 				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
-
-			SQUASHFS_INSWAP_LDEV_INODE_HEADER(inode);
+					"inode symbolic link %lld:%d\n", start, off);
 
-			i.data = inode->rdev;
-			i.xattr = inode->xattr;
+			i.symlink[inode.size] = '\0';
+			i.data = inode.size;
 			break;
 		}
-		case SQUASHFS_FIFO_TYPE:
-		case SQUASHFS_SOCKET_TYPE:
-			i.data = 0;
-			i.xattr = SQUASHFS_INVALID_XATTR;
-			break;
-		case SQUASHFS_LFIFO_TYPE:
-		case SQUASHFS_LSOCKET_TYPE: {
-			struct squashfs_lipc_inode_header *inode = &header.lipc;
-
-			res = read_inode_data(inode, &start, &offset, sizeof(*inode));
-			if(res == FALSE)
-				EXIT_UNSQUASH("read_inode: failed to read "
-					"inode %lld:%d\n", start, offset);
-
-			SQUASHFS_INSWAP_LIPC_INODE_HEADER(inode);
-
-			i.data = 0;
-			i.xattr = inode->xattr;
+		case SQUASHFS_BLKDEV_TYPE:
+		case SQUASHFS_CHRDEV_TYPE:
+		case SQUASHFS_LBLKDEV_TYPE:
+		case SQUASHFS_LCHRDEV_TYPE:
+			i.data = inode.rdev;
 			break;
-		}
 		default:
-			EXIT_UNSQUASH("Unknown inode type %d in read_inode!\n",
-				header.base.inode_type);
+			i.data = 0;
 	}
 	return &i;
 }
@@ -325,12 +242,10 @@ static struct inode *read_inode(unsigned int start_block, unsigned int offset)
 static struct dir *squashfs_opendir(unsigned int block_start, unsigned int offset,
 	struct inode **i)
 {
-	struct squashfs_dir_header dirh;
-	char buffer[sizeof(struct squashfs_dir_entry) + SQUASHFS_NAME_LEN + 1]
-		__attribute__((aligned));
-	struct squashfs_dir_entry *dire = (struct squashfs_dir_entry *) buffer;
-	long long start;
-	int bytes = 0, dir_count, size, res;
+	struct meta_inode inode;
+	struct meta_dirent dirent;
+	struct meta_dir pos;
+	int res;
 	struct dir_ent *ent, *cur_ent = NULL;
 	struct dir *dir;
 
@@ -361,77 +276,36 @@ static struct dir *squashfs_opendir(unsigned int block_start, unsigned int offse
 		 */
 		return dir;
 
-	start = sBlk.s.directory_table_start + (*i)->start;
-	offset = (*i)->offset;
-	size = (*i)->data + bytes - 3;
-
-	while(bytes < size) {			
-		res = read_directory_data(&dirh, &start, &offset, sizeof(dirh));
-		if(res == FALSE)
-			goto corrupted;
-
-		SQUASHFS_INSWAP_DIR_HEADER(&dirh);
-	
-		dir_count = dirh.count + 1;
-		TRACE("squashfs_opendir: Read directory header @ byte position "
-			"%d, %d directory entries\n", bytes, dir_count);
-		bytes += sizeof(dirh);
-
-		/* dir_count should never be larger than SQUASHFS_DIR_COUNT */
-		if(dir_count > SQUASHFS_DIR_COUNT) {
-			ERROR("File system corrupted: too many entries in directory\n");
-			goto corrupted;
-		}
-
-		while(dir_count--) {
-			res = read_directory_data(dire, &start, &offset, sizeof(*dire));
-			if(res == FALSE)
-				goto corrupted;
-
-			SQUASHFS_INSWAP_DIR_ENTRY(dire);
-
-			bytes += sizeof(*dire);
-
-			/* size should never be SQUASHFS_NAME_LEN or larger */
-			if(dire->size >= SQUASHFS_NAME_LEN) {
-				ERROR("File system corrupted: filename too long\n");
-				goto corrupted;
-			}
-
-			res = read_directory_data(dire->name, &start, &offset,
-								dire->size + 1);
-			if(res == FALSE)
-				goto corrupted;
-
-			dire->name[dire->size + 1] = '\0';
-
-			/* check name for invalid characters (i.e /, ., ..) */
-			if(check_name(dire->name, dire->size + 1) == FALSE) {
-				ERROR("File system corrupted: invalid characters in name\n");
-				goto corrupted;
-			}
-
-			TRACE("squashfs_opendir: directory entry %s, inode "
-				"%d:%d, type %d\n", dire->name,
-				dirh.start_block, dire->offset, dire->type);
-
-			ent = malloc(sizeof(struct dir_ent));
-			if(ent == NULL)
-				MEM_ERROR();
+	inode.start = (*i)->start;
+	inode.offset = (*i)->offset;
+	inode.size = (*i)->data;
+	meta_opendir(&directory_reader, &inode, &pos);
+
+	while((res = meta_readdir(&directory_reader, &pos, &dirent)) == 1) {
+		TRACE("squashfs_opendir: directory entry %s, inode "
+			"%d:%d, type %d\n", dirent.name,
+			dirent.start_block, dirent.offset, dirent.type);
+
+		ent = malloc(sizeof(struct dir_ent));
+		if(ent == NULL)
+			MEM_ERROR();
+
+		ent->name = strdup(dirent.name);
+		ent->start_block = dirent.start_block;
+		ent->offset = dirent.offset;
+		ent->type = dirent.type;
+		ent->next = NULL;
+		if(cur_ent == NULL)
+			dir->dirs = ent;
+		else
+			cur_ent->next = ent;
+		cur_ent = ent;
+		dir->dir_count ++;
+	}
 
-			ent->name = strdup(dire->name);
-			ent->start_block = dirh.start_block;
-			ent->offset = dire->offset;
-			ent->type = dire->type;
-			ent->next = NULL;
-			if(cur_ent == NULL)
-				dir->dirs = ent;
-			else
-				cur_ent->next = ent;
-			cur_ent = ent;
-			dir->dir_count ++;
-			bytes += dire->size + 1;
-		}
+	if(res) {
+		ERROR("File system corrupted: failed to read directory\n");
+		goto corrupted;
 	}
 
 	/* check directory for duplicate names and sorting */
@@ -651,6 +525,8 @@ static int read_filesystem_tables()
 	if(no_xattrs)
 		sBlk.s.xattr_id_table_start = SQUASHFS_INVALID_BLK;
 
+	directory_table_end = table_start;
+
 	alloc_index_table(0);
 
 	return TRUE;
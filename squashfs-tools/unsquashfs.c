@@ -31,6 +31,7 @@
 #include "unsquashfs_info.h"
 #include "stdarg.h"
 #include "fnmatch_compat.h"
+#include "resources.h"
 
 #include <sys/sysinfo.h>
 #include <sys/sysmacros.h>
@@ -42,12 +43,21 @@
 
 struct cache *fragment_cache, *data_cache;
 struct queue *to_reader, *to_inflate, *to_writer, *from_writer;
-pthread_t *thread, *inflator_thread;
+struct queue **to_creator, *from_creator;
+pthread_t *thread, *inflator_thread, *creator_thread;
+pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+int creators = 0;
+
+/* directory attributes set once everything else has been created */
+struct squashfs_file **dir_fixup = NULL;
+int dir_fixups = 0;
 pthread_mutex_t	fragment_mutex;
-static long long start_offset = 0;
+long long start_offset = 0;
 
 /* user options that control parallelisation */
 int processors = -1;
+struct cpu_list *worker_cpus = NULL;
+struct cpu_list *io_cpus = NULL;
 
 struct super_block sBlk;
 squashfs_operations *s_ops;
@@ -56,12 +66,16 @@ struct compressor *comp;
 int bytes = 0, swap, file_count = 0, dir_count = 0, sym_count = 0,
 	dev_count = 0, fifo_count = 0, socket_count = 0;
 struct hash_table_entry *inode_table_hash[65536], *directory_table_hash[65536];
+long long directory_table_end = 0;
 int fd;
 unsigned int cached_frag = SQUASHFS_INVALID_FRAG;
 unsigned int block_size;
 unsigned int block_log;
 int lsonly = FALSE, info = FALSE, force = FALSE, short_ls = TRUE;
 int concise = FALSE, quiet = FALSE, numeric = FALSE;
+int json_ls = FALSE, nul_ls = FALSE;
+struct id_name *user_names[ID_NAME_HASH_SIZE];
+struct id_name *group_names[ID_NAME_HASH_SIZE];
 int use_regex = FALSE;
 char **created_inode;
 int root_process;
@@ -91,6 +105,7 @@ int mkfs_time_opt = FALSE;
 int cat_files = FALSE;
 int fragment_buffer_size = FRAGMENT_BUFFER_DEFAULT;
 int data_buffer_size = DATA_BUFFER_DEFAULT;
+long long memory_budget = -1;
 char *dest = "squashfs-root";
 struct pathnames *extracts = NULL, *excludes = NULL;
 struct pathname *extract = NULL, *exclude = NULL;
@@ -529,48 +544,197 @@ char *modestr(char *str, int mode)
 }
 
 
+/*
+ * Return the user (or group) name of id, or id as a number if it hasn't
+ * got one, or numeric is set.  Looking names up can be slow (they may be
+ * looked up over the network), and so they are cached
+ */
+static char *id_name(struct id_name **table, unsigned int id, int group)
+{
+	int hash = id & (ID_NAME_HASH_SIZE - 1);
+	struct id_name *entry;
+	char *name = NULL;
+
+	for(entry = table[hash]; entry; entry = entry->next)
+		if(entry->id == id)
+			return entry->name;
+
+	if(!numeric) {
+		if(group) {
+			struct group *grp = getgrgid(id);
+
+			if(grp)
+				name = strdup(grp->gr_name);
+		} else {
+			struct passwd *user = getpwuid(id);
+
+			if(user)
+				name = strdup(user->pw_name);
+		}
+	}
+
+	if(name == NULL && asprintf(&name, "%u", id) == -1)
+		name = NULL;
+
+	entry = malloc(sizeof(struct id_name));
+	if(entry == NULL || name == NULL)
+		MEM_ERROR();
+
+	entry->id = id;
+	entry->name = name;
+	entry->next = table[hash];
+	table[hash] = entry;
+
+	return name;
+}
+
+
+/*
+ * Return time formatted for listing.  Files often share the same time, and
+ * so the last one is remembered
+ */
+static char *time_str(time_t time)
+{
+	static char str[64];
+	static time_t last;
+	static int valid = FALSE;
+	struct tm tm, *t;
+
+	if(valid && time == last)
+		return str;
+
+	t = use_localtime ? localtime_r(&time, &tm) : gmtime_r(&time, &tm);
+	if(t == NULL)
+		memset(&tm, 0, sizeof(tm));
+
+	snprintf(str, sizeof(str), "%d-%02d-%02d %02d:%02d", tm.tm_year + 1900,
+		tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
+	last = time;
+	valid = TRUE;
+
+	return str;
+}
+
+
+/*
+ * Print str as a JSON string.  Bytes which aren't control characters are
+ * output as is, and so names which aren't valid UTF-8 remain so
+ */
+static void print_json_string(char *str)
+{
+	putchar('"');
+
+	while(*str) {
+		int len = 0;
+
+		while(str[len] && str[len] != '"' && str[len] != '\\' &&
+				(unsigned char) str[len] >= 0x20)
+			len ++;
+
+		fwrite(str, 1, len, stdout);
+		str += len;
+
+		if(*str == '"' || *str == '\\')
+			printf("\\%c", *str++);
+		else if(*str)
+			printf("\\u%04x", (unsigned char) *str++);
+	}
+
+	putchar('"');
+}
+
+
+static char *type_name(int mode)
+{
+	switch(mode & S_IFMT) {
+	case S_IFREG:
+		return "file";
+	case S_IFDIR:
+		return "dir";
+	case S_IFLNK:
+		return "symlink";
+	case S_IFCHR:
+		return "chardev";
+	case S_IFBLK:
+		return "blockdev";
+	case S_IFIFO:
+		return "fifo";
+	case S_IFSOCK:
+		return "socket";
+	default:
+		return "unknown";
+	}
+}
+
+
+/*
+ * Print pathname and its attributes as a JSON object on one line
+ */
+static void print_json(char *pathname, struct inode *inode)
+{
+	printf("{\"path\":");
+	print_json_string(pathname);
+	printf(",\"type\":\"%s\",\"mode\":\"%04o\",\"inode\":%u,"
+		"\"uid\":%u,\"gid\":%u", type_name(inode->mode),
+		inode->mode & 07777, inode->inode_number, inode->uid,
+		inode->gid);
+
+	if(!numeric) {
+		printf(",\"user\":");
+		print_json_string(id_name(user_names, inode->uid, FALSE));
+		printf(",\"group\":");
+		print_json_string(id_name(group_names, inode->gid, TRUE));
+	}
+
+	switch(inode->mode & S_IFMT) {
+	case S_IFCHR:
+	case S_IFBLK:
+		/* Based on new_decode_dev() in kernel source */
+		printf(",\"major\":%u,\"minor\":%u",
+			(unsigned int) (inode->data & 0xfff00) >> 8,
+			(unsigned int) ((inode->data & 0xff) |
+			((inode->data >> 12) & 0xfff00)));
+		break;
+	default:
+		printf(",\"size\":%lld", inode->data);
+	}
+
+	printf(",\"mtime\":%lld", (long long) inode->time);
+
+	if((inode->mode & S_IFMT) == S_IFLNK) {
+		printf(",\"target\":");
+		print_json_string(inode->symlink);
+	}
+
+	printf("}\n");
+}
+
+
 #define TOTALCHARS  25
 void print_filename(char *pathname, struct inode *inode)
 {
-	char str[11], dummy[12], dummy2[12]; /* overflow safe */
+	char str[11];
 	char *userstr, *groupstr;
 	int padchars;
-	struct passwd *user;
-	struct group *group;
-	struct tm *t;
+
+	if(nul_ls) {
+		fputs(pathname, stdout);
+		putchar('\0');
+		return;
+	}
+
+	if(json_ls) {
+		print_json(pathname, inode);
+		return;
+	}
 
 	if(short_ls) {
 		printf("%s\n", pathname);
 		return;
 	}
 
-	user = numeric ? NULL : getpwuid(inode->uid);
-	if(user == NULL) {
-		int res = snprintf(dummy, 12, "%u", inode->uid);
-		if(res < 0)
-			EXIT_UNSQUASH("snprintf failed in print_filename()\n");
-		else if(res >= 12)
-			/* unsigned int shouldn't ever need more than 11 bytes
-			 * (including terminating '\0') to print in base 10 */
-			userstr = "*";
-		else
-			userstr = dummy;
-	} else
-		userstr = user->pw_name;
-		 
-	group = numeric ? NULL : getgrgid(inode->gid);
-	if(group == NULL) {
-		int res = snprintf(dummy2, 12, "%u", inode->gid);
-		if(res < 0)
-			EXIT_UNSQUASH("snprintf failed in print_filename()\n");
-		else if(res >= 12)
-			/* unsigned int shouldn't ever need more than 11 bytes
-			 * (including terminating '\0') to print in base 10 */
-			groupstr = "*";
-		else
-			groupstr = dummy2;
-	} else
-		groupstr = group->gr_name;
+	userstr = id_name(user_names, inode->uid, FALSE);
+	groupstr = id_name(group_names, inode->gid, TRUE);
 
 	printf("%s %s/%s ", modestr(str, inode->mode), userstr, groupstr);
 
@@ -597,13 +761,11 @@ void print_filename(char *pathname, struct inode *inode)
 			break;
 	}
 
-	t = use_localtime ? localtime(&inode->time) : gmtime(&inode->time);
-
-	printf("%d-%02d-%02d %02d:%02d %s", t->tm_year + 1900, t->tm_mon + 1,
-		t->tm_mday, t->tm_hour, t->tm_min, pathname);
 	if((inode->mode & S_IFMT) == S_IFLNK)
-		printf(" -> %s", inode->symlink);
-	printf("\n");
+		printf("%s %s -> %s\n", time_str(inode->time), pathname,
+			inode->symlink);
+	else
+		printf("%s %s\n", time_str(inode->time), pathname);
 }
 	
 
@@ -649,7 +811,8 @@ int read_block(int fd, long long start, long long *next, int expected,
 	unsigned short c_byte;
 	int offset = 2, res, compressed;
 	int outlen = expected ? expected : SQUASHFS_METADATA_SIZE;
-	static char *buffer = NULL;
+	/* per thread, as xattrs are read by the writer and creator threads */
+	static __thread char *buffer = NULL;
 
 	if(outlen > SQUASHFS_METADATA_SIZE)
 		return FALSE;
@@ -818,19 +981,267 @@ int read_directory_data(void *buffer, long long *blk, unsigned int *off, int len
 }
 
 
-int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time,
-	unsigned int xattr, unsigned int set_mode)
+struct metadata_block {
+	long long	start;
+	long long	next;
+	char		*data;
+	int		size;
+	int		compressed;
+	int		length;
+	void		*buffer;
+};
+
+struct metadata_prefetch {
+	struct metadata_block	*blocks;
+	int			count;
+	int			thread;
+	int			threads;
+};
+
+
+static void *metadata_inflator(void *arg)
+{
+	struct metadata_prefetch *prefetch = arg;
+	int i;
+
+	for(i = prefetch->thread; i < prefetch->count; i += prefetch->threads) {
+		struct metadata_block *block = &prefetch->blocks[i];
+		int error;
+
+		block->buffer = malloc(SQUASHFS_METADATA_SIZE);
+		if(block->buffer == NULL)
+			MEM_ERROR();
+
+		if(block->compressed)
+			block->length = compressor_uncompress(comp,
+				block->buffer, block->data, block->size,
+				SQUASHFS_METADATA_SIZE, &error);
+		else {
+			memcpy(block->buffer, block->data, block->size);
+			block->length = block->size;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * If we're in a cgroup with a memory limit, shrink the data and fragment
+ * caches to fit in half of it, rather than risk getting OOM killed.  The
+ * rest is left for the inode and directory tables, the amount being
+ * recorded in memory_budget
+ */
+static void check_memory_limit()
+{
+	long long limit = memory_limit();
+	long long total = (long long) data_buffer_size + fragment_buffer_size;
+	long long mem;
+
+	if(limit == -1)
+		return;
+
+	mem = limit >> 21;
+	if(mem < 2)
+		mem = 2;
+
+	if(total > mem) {
+		data_buffer_size = data_buffer_size * mem / total;
+		fragment_buffer_size = fragment_buffer_size * mem / total;
+		if(data_buffer_size == 0)
+			data_buffer_size = 1;
+		if(fragment_buffer_size == 0)
+			fragment_buffer_size = 1;
+
+		ERROR("Warning: Data and fragment queues (%lldM) are larger "
+			"than the cgroup memory limit allows.  Reducing them "
+			"to %dM and %dM\n", total, data_buffer_size,
+			fragment_buffer_size);
+		total = data_buffer_size + fragment_buffer_size;
+	}
+
+	memory_budget = limit - (total << 20);
+}
+
+
+/*
+ * When the whole filesystem is going to be traversed, every inode and
+ * directory table block will be read.  Rather than reading and
+ * decompressing them one at a time on demand from the main thread, read
+ * both tables with one read, and decompress the blocks in parallel,
+ * adding them to the metadata hash tables ahead of the traversal.
+ *
+ * Any block that fails to decompress is left out, and will be reported
+ * when it is read on demand.
+ */
+void prefetch_metadata()
+{
+	long long start = sBlk.s.inode_table_start;
+	long long bytes = directory_table_end - start;
+	struct metadata_prefetch *prefetch;
+	struct metadata_block *blocks = NULL;
+	int offset = SQUASHFS_CHECK_DATA(sBlk.s.flags) ? 3 : 2;
+	int i, count = 0, threads = processors;
+	pthread_t *prefetch_thread;
+	long long pos;
+	char *table;
+
+	if(directory_table_end == 0 || bytes <= 0 || bytes > INT_MAX)
+		return;
+
+	table = malloc(bytes);
+	if(table == NULL) {
+		/* not fatal, the tables will be read on demand */
+		ERROR("prefetch_metadata: out of memory, not prefetching\n");
+		return;
+	}
+
+	if(read_fs_bytes(fd, start, bytes, table) == FALSE)
+		goto failed;
+
+	for(pos = 0; pos + offset <= bytes; count ++) {
+		unsigned short c_byte;
+
+		if((count & 1023) == 0) {
+			blocks = realloc(blocks, (count + 1024) *
+				sizeof(struct metadata_block));
+			if(blocks == NULL)
+				MEM_ERROR();
+		}
+
+		memcpy(&c_byte, table + pos, 2);
+		if(swap)
+			c_byte = (c_byte >> 8) | ((c_byte & 0xff) << 8);
+
+		blocks[count].start = start + pos;
+		blocks[count].compressed = SQUASHFS_COMPRESSED(c_byte);
+		blocks[count].size = SQUASHFS_COMPRESSED_SIZE(c_byte);
+		blocks[count].data = table + pos + offset;
+
+		pos += offset + blocks[count].size;
+		blocks[count].next = start + pos;
+
+		/* stop at anything corrupted, it'll be reported on demand */
+		if(blocks[count].size > SQUASHFS_METADATA_SIZE || pos > bytes)
+			break;
+	}
+
+	/*
+	 * If the tables and their decompressed blocks won't fit in the
+	 * memory left by the cgroup limit, don't read them all at once
+	 */
+	if(memory_budget != -1 && bytes + (long long) count *
+					SQUASHFS_METADATA_SIZE > memory_budget) {
+		ERROR("prefetch_metadata: cgroup memory limit too small, not "
+			"prefetching\n");
+		goto failed;
+	}
+
+	if(threads < 1)
+		threads = worker_cpus ? cpu_list_count(worker_cpus) :
+						available_processors();
+	if(threads > count)
+		threads = count ? count : 1;
+
+	prefetch = malloc(threads * sizeof(struct metadata_prefetch));
+	prefetch_thread = malloc(threads * sizeof(pthread_t));
+	if(prefetch == NULL || prefetch_thread == NULL)
+		MEM_ERROR();
+
+	for(i = 0; i < threads; i++) {
+		prefetch[i].blocks = blocks;
+		prefetch[i].count = count;
+		prefetch[i].thread = i;
+		prefetch[i].threads = threads;
+
+		if(pthread_create(&prefetch_thread[i], NULL, metadata_inflator,
+							&prefetch[i]) != 0)
+			EXIT_UNSQUASH("Failed to create thread\n");
+		if(!set_thread_cpus(prefetch_thread[i], worker_cpus))
+			EXIT_UNSQUASH("Failed to set the processors of the "
+				"metadata threads\n");
+	}
+
+	for(i = 0; i < threads; i++)
+		pthread_join(prefetch_thread[i], NULL);
+
+	for(i = 0; i < count; i++) {
+		struct hash_table_entry *entry, **hash_table;
+		int hash = TABLE_HASH(blocks[i].start);
+
+		if(blocks[i].length <= 0) {
+			free(blocks[i].buffer);
+			continue;
+		}
+
+		hash_table = blocks[i].start < sBlk.s.directory_table_start ?
+			inode_table_hash : directory_table_hash;
+
+		entry = malloc(sizeof(struct hash_table_entry));
+		if(entry == NULL)
+			MEM_ERROR();
+
+		entry->start = blocks[i].start;
+		entry->length = blocks[i].length;
+		entry->buffer = blocks[i].buffer;
+		entry->next_index = blocks[i].next;
+		entry->next = hash_table[hash];
+		hash_table[hash] = entry;
+	}
+
+	free(prefetch);
+	free(prefetch_thread);
+
+failed:
+	free(blocks);
+	free(table);
+}
+
+
+static int change_mode(int fd, int dir_fd, char *name, mode_t mode)
+{
+	if(fd != -1)
+		return fchmod(fd, mode);
+	else
+		return fchmodat(dir_fd, name, mode, 0);
+}
+
+
+/*
+ * Set the attributes of pathname.  If fd isn't -1, the file is open and
+ * the attributes are set on fd, otherwise they're set on name relative to
+ * the directory dir_fd (which may be AT_FDCWD, with name the pathname).
+ * Pathname is used in error messages, and for the xattrs of files that
+ * aren't open
+ */
+int set_attributes(char *pathname, int fd, int dir_fd, char *name, int mode,
+	uid_t uid, gid_t guid, time_t time, unsigned int xattr,
+	unsigned int set_mode)
 {
-	struct utimbuf times = { time, time };
+	struct timespec times[2] = {
+		{ time, 0 },
+		{ time, 0 }
+	};
+	int res;
+
+	if(fd != -1)
+		res = futimens(fd, times);
+	else
+		res = utimensat(dir_fd, name, times, 0);
 
-	if(utime(pathname, &times) == -1) {
+	if(res == -1) {
 		EXIT_UNSQUASH_STRICT("set_attributes: failed to set time on "
 			"%s, because %s\n", pathname, strerror(errno));
 		return FALSE;
 	}
 
 	if(root_process) {
-		if(chown(pathname, uid, guid) == -1) {
+		if(fd != -1)
+			res = fchown(fd, uid, guid);
+		else
+			res = fchownat(dir_fd, name, uid, guid, 0);
+
+		if(res == -1) {
 			EXIT_UNSQUASH_STRICT("set_attributes: failed to change"
 				" uid and gids on %s, because %s\n", pathname,
 				strerror(errno));
@@ -839,8 +1250,8 @@ int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time,
 	} else
 		mode &= ~06000;
 
-	if((set_mode || (mode & 07000)) &&
-					chmod(pathname, (mode_t) mode) == -1) {
+	if((set_mode || (mode & 07000)) && change_mode(fd, dir_fd, name,
+						(mode_t) mode) == -1) {
 		/*
 		 * Some filesystems require root privileges to use the sticky
 		 * bit. If we're not root and chmod() failed with EPERM when the
@@ -848,7 +1259,8 @@ int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time,
 		 * sticky bit. Otherwise, fail with an error message.
 		 */
 		if (root_process || errno != EPERM || !(mode & 01000) ||
-				chmod(pathname, (mode_t) (mode & ~01000)) == -1) {
+				change_mode(fd, dir_fd, name,
+				(mode_t) (mode & ~01000)) == -1) {
 			EXIT_UNSQUASH_STRICT("set_attributes: failed to change"
 				" mode %s, because %s\n", pathname,
 				strerror(errno));
@@ -856,7 +1268,29 @@ int set_attributes(char *pathname, int mode, uid_t uid, gid_t guid, time_t time,
 		}
 	}
 
-	return write_xattr(pathname, xattr);
+	return write_xattr(pathname, fd, xattr);
+}
+
+
+/*
+ * Set the attributes of directory file->pathname.  The directory is opened
+ * so its attributes and xattrs are set on the fd, rather than looking up
+ * the pathname for each of them.  If it can't be opened (e.g. we're out
+ * of file descriptors), the pathname is used
+ */
+static int set_dir_attributes(struct squashfs_file *file)
+{
+	int fd = open(file->pathname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	int res;
+
+	res = set_attributes(file->pathname, fd, AT_FDCWD, file->pathname,
+		file->mode, file->uid, file->gid, file->time, file->xattr,
+		TRUE);
+
+	if(fd != -1)
+		close(fd);
+
+	return res;
 }
 
 
@@ -925,20 +1359,81 @@ failure:
 }
 
 
+#ifdef linux
+int copy_range_broken = FALSE;
+#else
+int copy_range_broken = TRUE;
+#endif
+char *copy_data = NULL;
+
+/*
+ * Copy an uncompressed data block straight from the filesystem to the
+ * output file.  Copy_file_range() lets the kernel do the copy without
+ * passing the data through user space, and on filesystems which support
+ * it (XFS, Btrfs), share the extents rather than copy them.  If it isn't
+ * supported between the filesystem and the output file, fall back to
+ * reading and writing the data
+ */
+int copy_block(int file_fd, long long start, int size, long long hole,
+	int sparse)
+{
+	loff_t off = start_offset + start;
+
+	if(write_block(file_fd, NULL, 0, hole, sparse) == FALSE)
+		return FALSE;
+
+#ifdef linux
+	while(copy_range_broken == FALSE && size) {
+		ssize_t res = copy_file_range(fd, &off, file_fd, NULL, size, 0);
+
+		if(res > 0)
+			size -= res;
+		else if(res == 0) {
+			ERROR("Copy from filesystem failed because EOF\n");
+			return FALSE;
+		} else if(errno == EXDEV || errno == ENOSYS ||
+				errno == EINVAL || errno == EOPNOTSUPP ||
+				errno == EBADF)
+			copy_range_broken = TRUE;
+		else if(errno != EINTR) {
+			ERROR("Copy from filesystem failed because %s\n",
+				strerror(errno));
+			return FALSE;
+		}
+	}
+#endif
+
+	if(size == 0)
+		return TRUE;
+
+	if(copy_data == NULL) {
+		copy_data = malloc(block_size);
+		if(copy_data == NULL)
+			MEM_ERROR();
+	}
+
+	if(read_fs_bytes(fd, off - start_offset, size, copy_data) == FALSE)
+		return FALSE;
+
+	return write_bytes(file_fd, copy_data, size) != -1;
+}
+
+
 pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t dir_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t open_empty = PTHREAD_COND_INITIALIZER;
-int open_unlimited, open_count;
+int open_unlimited, open_count, open_total;
 #define OPEN_FILE_MARGIN 10
 
 
 void open_init(int count)
 {
-	open_count = count;
+	open_count = open_total = count;
 	open_unlimited = count == -1;
 }
 
 
-int open_wait(char *pathname, int flags, mode_t mode)
+int open_wait(int dir_fd, char *pathname, int flags, mode_t mode)
 {
 	if (!open_unlimited) {
 		pthread_mutex_lock(&open_mutex);
@@ -948,13 +1443,14 @@ int open_wait(char *pathname, int flags, mode_t mode)
 		pthread_mutex_unlock(&open_mutex);
 	}
 
-	return open(pathname, flags, mode);
+	return openat(dir_fd, pathname, flags, mode);
 }
 
 
 void close_wake(int fd)
 {
-	close(fd);
+	if (fd != -1)
+		close(fd);
 
 	if (!open_unlimited) {
 		pthread_mutex_lock(&open_mutex);
@@ -965,6 +1461,70 @@ void close_wake(int fd)
 }
 
 
+/*
+ * Open the directory pathname relative to dir_fd, so the files in it can
+ * be created relative to it, rather than by pathname.  Unlike files,
+ * the directories being extracted are held open while their contents are
+ * extracted, and so to ensure there are always open files available for
+ * the files, directories only use the first half.  Returns NULL if the
+ * directory couldn't be opened, and the pathname is to be used
+ */
+struct open_dir *open_dir(int dir_fd, char *pathname)
+{
+	struct open_dir *dir;
+	int res;
+
+	if (!open_unlimited) {
+		pthread_mutex_lock(&open_mutex);
+		res = open_count > open_total / 2;
+		if (res)
+			open_count --;
+		pthread_mutex_unlock(&open_mutex);
+
+		if (res == FALSE)
+			return NULL;
+	}
+
+	res = openat(dir_fd, pathname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (res == -1) {
+		close_wake(-1);
+		return NULL;
+	}
+
+	dir = malloc(sizeof(struct open_dir));
+	if(dir == NULL)
+		MEM_ERROR();
+
+	dir->fd = res;
+	dir->count = 1;
+
+	return dir;
+}
+
+
+static void get_dir(struct open_dir *dir)
+{
+	pthread_mutex_lock(&dir_mutex);
+	dir->count ++;
+	pthread_mutex_unlock(&dir_mutex);
+}
+
+
+static void put_dir(struct open_dir *dir)
+{
+	int count;
+
+	pthread_mutex_lock(&dir_mutex);
+	count = -- dir->count;
+	pthread_mutex_unlock(&dir_mutex);
+
+	if(count == 0) {
+		close_wake(dir->fd);
+		free(dir);
+	}
+}
+
+
 void queue_file(char *pathname, int file_fd, struct inode *inode)
 {
 	struct squashfs_file *file = malloc(sizeof(struct squashfs_file));
@@ -998,11 +1558,27 @@ void queue_dir(char *pathname, struct dir *dir)
 	file->time = dir->mtime;
 	file->pathname = strdup(pathname);
 	file->xattr = dir->xattr;
-	queue_put(to_writer, file);
+
+	/*
+	 * If creator threads are making the directory's symlinks and
+	 * devices, they may not have finished yet, and so the attributes
+	 * are set once they're all done
+	 */
+	if(creators) {
+		if(dir_fixups % 1024 == 0) {
+			dir_fixup = realloc(dir_fixup, (dir_fixups + 1024) *
+				sizeof(struct squashfs_file *));
+			if(dir_fixup == NULL)
+				MEM_ERROR();
+		}
+
+		dir_fixup[dir_fixups ++] = file;
+	} else
+		queue_put(to_writer, file);
 }
 
 
-int write_file(struct inode *inode, char *pathname)
+int write_file(struct inode *inode, int dir_fd, char *name, char *pathname)
 {
 	unsigned int file_fd, i;
 	unsigned int *block_list = NULL;
@@ -1011,7 +1587,7 @@ int write_file(struct inode *inode, char *pathname)
 
 	TRACE("write_file: regular file, blocks %d\n", inode->blocks);
 
-	file_fd = open_wait(pathname, O_CREAT | O_WRONLY |
+	file_fd = open_wait(dir_fd, name, O_CREAT | O_WRONLY |
 		(force ? O_TRUNC : 0), (mode_t) inode->mode & 0777);
 	if(file_fd == -1) {
 		EXIT_UNSQUASH_IGNORE("write_file: failed to create file %s,"
@@ -1045,9 +1621,16 @@ int write_file(struct inode *inode, char *pathname)
 		block->offset = 0;
 		block->size = i == file_end ? inode->data & (block_size - 1) :
 			block_size;
+		block->start = 0;
 		if(block_list[i] == 0) /* sparse block */
 			block->buffer = NULL;
-		else {
+		else if(!SQUASHFS_COMPRESSED_BLOCK(block_list[i]) &&
+							c_byte == block->size) {
+			/* uncompressed block, copy directly */
+			block->buffer = NULL;
+			block->start = start;
+			start += c_byte;
+		} else {
 			block->buffer = cache_get(data_cache, start,
 				block_list[i]);
 			start += c_byte;
@@ -1140,36 +1723,49 @@ int cat_file(struct inode *inode, char *pathname)
 }
 
 
-int create_inode(char *pathname, struct inode *i)
+static void count_inode(int *count)
 {
-	int res;
-	int failed = FALSE;
-
-	TRACE("create_inode: pathname %s\n", pathname);
+	pthread_mutex_lock(&count_mutex);
+	(*count) ++;
+	pthread_mutex_unlock(&count_mutex);
+}
 
-	if(created_inode[i->inode_number - 1]) {
-		TRACE("create_inode: hard link\n");
-		if(force)
-			unlink(pathname);
 
-		if(link(created_inode[i->inode_number - 1], pathname) == -1) {
-			EXIT_UNSQUASH_IGNORE("create_inode: failed to create"
-				" hardlink, because %s\n", strerror(errno));
-			return FALSE;
-		}
+/*
+ * The link being created is name relative to the directory dir_fd (which
+ * may be AT_FDCWD, with name the pathname)
+ */
+static int create_link(int dir_fd, char *name, char *target)
+{
+	TRACE("create_inode: hard link\n");
+	if(force)
+		unlinkat(dir_fd, name, 0);
 
-		return TRUE;
+	if(linkat(AT_FDCWD, target, dir_fd, name, 0) == -1) {
+		EXIT_UNSQUASH_IGNORE("create_inode: failed to create"
+			" hardlink, because %s\n", strerror(errno));
+		return FALSE;
 	}
 
+	return TRUE;
+}
+
+
+static int make_inode(int dir_fd, char *name, char *pathname,
+	struct inode *i)
+{
+	int res;
+	int failed = FALSE;
+
 	switch(i->type) {
 		case SQUASHFS_FILE_TYPE:
 		case SQUASHFS_LREG_TYPE:
 			TRACE("create_inode: regular file, file_size %lld, "
 				"blocks %d\n", i->data, i->blocks);
 
-			res = write_file(i, pathname);
+			res = write_file(i, dir_fd, name, pathname);
 			if(res == FALSE)
-				goto failed;
+				return FALSE;
 
 			file_count ++;
 			break;
@@ -1184,17 +1780,17 @@ int create_inode(char *pathname, struct inode *i)
 				i->data);
 
 			if(force)
-				unlink(pathname);
+				unlinkat(dir_fd, name, 0);
 
-			res = symlink(i->symlink, pathname);
+			res = symlinkat(i->symlink, dir_fd, name);
 			if(res == -1) {
 				EXIT_UNSQUASH_STRICT("create_inode: failed to"
 					" create symlink %s, because %s\n",
 					pathname, strerror(errno));
-				goto failed;
+				return FALSE;
 			}
 
-			res = utimensat(AT_FDCWD, pathname, times,
+			res = utimensat(dir_fd, name, times,
 					AT_SYMLINK_NOFOLLOW);
 			if(res == -1) {
 				EXIT_UNSQUASH_STRICT("create_inode: failed to"
@@ -1202,12 +1798,13 @@ int create_inode(char *pathname, struct inode *i)
 					pathname, strerror(errno));
 			}
 
-			res = write_xattr(pathname, i->xattr);
+			res = write_xattr(pathname, -1, i->xattr);
 			if(res == FALSE)
 				failed = TRUE;
 	
 			if(root_process) {
-				res = lchown(pathname, i->uid, i->gid);
+				res = fchownat(dir_fd, name, i->uid, i->gid,
+							AT_SYMLINK_NOFOLLOW);
 				if(res == -1) {
 					EXIT_UNSQUASH_STRICT("create_inode: "
 						"failed to change uid and "
@@ -1218,9 +1815,9 @@ int create_inode(char *pathname, struct inode *i)
 			}
 
 			if(failed)
-				goto failed;
+				return FALSE;
 
-			sym_count ++;
+			count_inode(&sym_count);
 			break;
 		}
  		case SQUASHFS_BLKDEV_TYPE:
@@ -1236,14 +1833,14 @@ int create_inode(char *pathname, struct inode *i)
 			TRACE("create_inode: dev, rdev 0x%llx\n", i->data);
 			if(root_process) {
 				if(force)
-					unlink(pathname);
+					unlinkat(dir_fd, name, 0);
 
 				/* Based on new_decode_dev() in kernel source */
 				major = (i->data & 0xfff00) >> 8;
 				minor = (i->data & 0xff) | ((i->data >> 12)
 								& 0xfff00);
 
-				res = mknod(pathname, chrdev ? S_IFCHR :
+				res = mknodat(dir_fd, name, chrdev ? S_IFCHR :
 						S_IFBLK, makedev(major, minor));
 				if(res == -1) {
 					EXIT_UNSQUASH_STRICT("create_inode: "
@@ -1251,20 +1848,21 @@ int create_inode(char *pathname, struct inode *i)
 						"%s, because %s\n", chrdev ?
 						"character" : "block", pathname,
 						strerror(errno));
-					goto failed;
+					return FALSE;
 				}
-				res = set_attributes(pathname, i->mode, i->uid,
-					i->gid, i->time, i->xattr, TRUE);
+				res = set_attributes(pathname, -1, dir_fd, name,
+					i->mode, i->uid, i->gid, i->time,
+					i->xattr, TRUE);
 				if(res == FALSE)
-					goto failed;
+					return FALSE;
 
-				dev_count ++;
+				count_inode(&dev_count);
 			} else {
 				EXIT_UNSQUASH_STRICT("create_inode: could not"
 					" create %s device %s, because you're"
 					" not superuser!\n", chrdev ?
 					"character" : "block", pathname);
-				goto failed;
+				return FALSE;
 			}
 			break;
 		}
@@ -1273,39 +1871,41 @@ int create_inode(char *pathname, struct inode *i)
 			TRACE("create_inode: fifo\n");
 
 			if(force)
-				unlink(pathname);
+				unlinkat(dir_fd, name, 0);
 
-			res = mknod(pathname, S_IFIFO, 0);
+			res = mknodat(dir_fd, name, S_IFIFO, 0);
 			if(res == -1) {
 				ERROR("create_inode: failed to create fifo %s, "
 					"because %s\n", pathname,
 					strerror(errno));
-				goto failed;
+				return FALSE;
 			}
-			res = set_attributes(pathname, i->mode, i->uid, i->gid,
-				i->time, i->xattr, TRUE);
+			res = set_attributes(pathname, -1, dir_fd, name,
+				i->mode, i->uid, i->gid, i->time, i->xattr,
+				TRUE);
 			if(res == FALSE)
-				goto failed;
+				return FALSE;
 
-			fifo_count ++;
+			count_inode(&fifo_count);
 			break;
 		case SQUASHFS_SOCKET_TYPE:
 		case SQUASHFS_LSOCKET_TYPE:
 			TRACE("create_inode: socket\n");
 
-			res = mknod(pathname, S_IFSOCK, 0);
+			res = mknodat(dir_fd, name, S_IFSOCK, 0);
 			if (res == -1) {
 				ERROR("create_inode: failed to create socket "
 					"%s, because %s\n", pathname,
 					strerror(errno));
-				goto failed;
+				return FALSE;
 			}
-			res = set_attributes(pathname, i->mode, i->uid, i->gid,
-				i->time, i->xattr, TRUE);
+			res = set_attributes(pathname, -1, dir_fd, name,
+				i->mode, i->uid, i->gid, i->time, i->xattr,
+				TRUE);
 			if(res == FALSE)
-				goto failed;
+				return FALSE;
 
-			socket_count++;
+			count_inode(&socket_count);
 			break;
 		default:
 			EXIT_UNSQUASH_STRICT("Unknown inode type %d in "
@@ -1313,11 +1913,73 @@ int create_inode(char *pathname, struct inode *i)
 			return FALSE;
 	}
 
-	created_inode[i->inode_number - 1] = strdup(pathname);
-
 	return TRUE;
+}
+
+
+static int is_regular(struct inode *i)
+{
+	return i->type == SQUASHFS_FILE_TYPE || i->type == SQUASHFS_LREG_TYPE;
+}
+
+
+/*
+ * Queue a symlink, device, fifo or socket (or a hard link to one) to a
+ * creator thread.  All links to an inode go to the same creator thread,
+ * which makes them in order, and so the inode always exists before it
+ * is linked to.
+ */
+static void queue_create(struct open_dir *dir, char *name, char *pathname,
+	char *link, struct inode *i)
+{
+	struct create_entry *entry = malloc(sizeof(struct create_entry));
+	if(entry == NULL)
+		MEM_ERROR();
+
+	if(dir)
+		get_dir(dir);
+
+	entry->dir = dir;
+	entry->name = dir ? strdup(name) : NULL;
+	entry->pathname = strdup(pathname);
+	entry->link = link ? strdup(link) : NULL;
+	entry->inode = *i;
+	if(i->type == SQUASHFS_SYMLINK_TYPE ||
+				i->type == SQUASHFS_LSYMLINK_TYPE)
+		entry->inode.symlink = strdup(i->symlink);
+
+	queue_put(to_creator[(i->inode_number - 1) % creators], entry);
+}
+
+
+/*
+ * Create pathname, which is name relative to the open directory dir, or
+ * if dir is NULL, name is the pathname
+ */
+int create_inode(struct open_dir *dir, char *name, char *pathname,
+	struct inode *i)
+{
+	int res, dir_fd = dir ? dir->fd : AT_FDCWD;
+
+	TRACE("create_inode: pathname %s\n", pathname);
+
+	if(created_inode[i->inode_number - 1]) {
+		if(creators && !is_regular(i)) {
+			queue_create(dir, name, pathname,
+				created_inode[i->inode_number - 1], i);
+			return TRUE;
+		}
+
+		return create_link(dir_fd, name,
+				created_inode[i->inode_number - 1]);
+	}
+
+	if(creators && !is_regular(i)) {
+		queue_create(dir, name, pathname, NULL, i);
+		res = TRUE;
+	} else
+		res = make_inode(dir_fd, name, pathname, i);
 
-failed:
 	/*
 	 * Mark the file as created (even though it may not have been), so
 	 * any future hard links to it fail with a file not found, which
@@ -1330,7 +1992,94 @@ failed:
 	 */
 	created_inode[i->inode_number - 1] = strdup(pathname);
 
-	return FALSE;
+	return res;
+}
+
+
+/*
+ * creator thread.  This makes the symlinks, devices, fifos and sockets
+ * queued by dir_scan(), so these syscalls run in parallel with each other
+ * and with the directory scan.
+ */
+void *creator(void *arg)
+{
+	struct queue *queue = arg;
+	long exit_code = FALSE;
+
+	while(1) {
+		struct create_entry *entry = queue_get(queue);
+		int res, dir_fd;
+		char *name;
+
+		if(entry == NULL) {
+			queue_put(from_creator, (void *) exit_code);
+			exit_code = FALSE;
+			continue;
+		}
+
+		if(entry->dir) {
+			dir_fd = entry->dir->fd;
+			name = entry->name;
+		} else {
+			dir_fd = AT_FDCWD;
+			name = entry->pathname;
+		}
+
+		if(entry->link)
+			res = create_link(dir_fd, name, entry->link);
+		else
+			res = make_inode(dir_fd, name, entry->pathname,
+							&entry->inode);
+
+		if(entry->dir)
+			put_dir(entry->dir);
+
+		if(res == FALSE)
+			exit_code = TRUE;
+
+		if(entry->link == NULL && (entry->inode.type ==
+				SQUASHFS_SYMLINK_TYPE || entry->inode.type ==
+				SQUASHFS_LSYMLINK_TYPE))
+			free(entry->inode.symlink);
+		free(entry->pathname);
+		free(entry->name);
+		free(entry->link);
+		free(entry);
+	}
+}
+
+
+/*
+ * Wait for the creator threads to finish everything queued, and then
+ * set the attributes of the directories.  Returns TRUE if anything
+ * failed.
+ */
+int finish_creators()
+{
+	int i, failed = FALSE;
+
+	for(i = 0; i < creators; i++)
+		queue_put(to_creator[i], NULL);
+
+	for(i = 0; i < creators; i++)
+		if((long) queue_get(from_creator) == TRUE)
+			failed = TRUE;
+
+	for(i = 0; i < dir_fixups; i++) {
+		struct squashfs_file *file = dir_fixup[i];
+
+		if(set_dir_attributes(file) == FALSE)
+			failed = TRUE;
+
+		free(file->pathname);
+		free(file);
+	}
+
+	free(dir_fixup);
+	dir_fixup = NULL;
+	dir_fixups = 0;
+
+	return failed;
 }
 
 
@@ -2064,11 +2813,20 @@ int pre_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 }
 
 
-int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
+/*
+ * Extract the directory parent_name, which is dir_name relative to the
+ * directory parent_fd (which may be AT_FDCWD, with dir_name the pathname).
+ * The directory is held open while it is extracted, and its contents are
+ * created relative to it, rather than by pathname.  Its attributes are
+ * set by pathname once its contents are all created
+ */
+int dir_scan(char *parent_name, int parent_fd, char *dir_name,
+	unsigned int start_block, unsigned int offset,
 	struct pathnames *extracts, struct pathnames *excludes, int depth)
 {
 	unsigned int type;
-	int scan_res = TRUE;
+	int scan_res = TRUE, dir_fd = AT_FDCWD;
+	struct open_dir *open = NULL;
 	char *name;
 	struct pathnames *newt, *newc = NULL;
 	struct inode *i;
@@ -2090,7 +2848,7 @@ int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 		 * write/execute permission.  These are fixed up later in
 		 * set_attributes().
 		 */
-		int res = mkdir(parent_name, S_IRUSR|S_IWUSR|S_IXUSR);
+		int res = mkdirat(parent_fd, dir_name, S_IRUSR|S_IWUSR|S_IXUSR);
 		if(res == -1) {
 			/*
 			 * Skip directory if mkdir fails, unless we're
@@ -2108,7 +2866,8 @@ int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 			 * Try to change permissions of existing directory so
 			 * that we can write to it
 			 */
-			res = chmod(parent_name, S_IRUSR|S_IWUSR|S_IXUSR);
+			res = fchmodat(parent_fd, dir_name,
+						S_IRUSR|S_IWUSR|S_IXUSR, 0);
 			if (res == -1) {
 				EXIT_UNSQUASH_IGNORE("dir_scan: failed to "
 					"change permissions for directory %s,"
@@ -2118,12 +2877,16 @@ int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 				return FALSE;
 			}
 		}
+
+		open = open_dir(parent_fd, dir_name);
+		if(open)
+			dir_fd = open->fd;
 	}
 
 	if(max_depth == -1 || depth <= max_depth) {
 		while(squashfs_readdir(dir, &name, &start_block, &offset,
 								&type)) {
-			char *pathname;
+			char *pathname, *child;
 			int res;
 
 			TRACE("dir_scan: name %s, start_block %d, offset %d,"
@@ -2142,9 +2905,12 @@ int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 			if(res == -1)
 				MEM_ERROR();
 
+			child = dir_fd == AT_FDCWD ? pathname : name;
+
 			if(type == SQUASHFS_DIR_TYPE) {
-				res = dir_scan(pathname, start_block, offset,
-							newt, newc, depth + 1);
+				res = dir_scan(pathname, dir_fd, child,
+					start_block, offset, newt, newc,
+					depth + 1);
 				if(res == FALSE)
 					scan_res = FALSE;
 				free(pathname);
@@ -2157,7 +2923,8 @@ int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 					print_filename(pathname, i);
 
 				if(!lsonly) {
-					res = create_inode(pathname, i);
+					res = create_inode(open, child,
+							pathname, i);
 					if(res == FALSE)
 						scan_res = FALSE;
 				}
@@ -2178,6 +2945,9 @@ int dir_scan(char *parent_name, unsigned int start_block, unsigned int offset,
 		}
 	}
 
+	if(open)
+		put_dir(open);
+
 	if(!lsonly)
 		queue_dir(parent_name, dir);
 
@@ -2424,9 +3194,7 @@ void *writer(void *arg)
 			continue;
 		} else if(file->fd == -1) {
 			/* write attributes for directory file->pathname */
-			res = set_attributes(file->pathname, file->mode,
-				file->uid, file->gid, file->time, file->xattr,
-				TRUE);
+			res = set_dir_attributes(file);
 			if(res == FALSE)
 				exit_code = TRUE;
 			free(file->pathname);
@@ -2441,12 +3209,29 @@ void *writer(void *arg)
 		for(i = 0; i < file->blocks; i++, cur_blocks ++) {
 			struct file_entry *block = queue_get(to_writer);
 
-			if(block->buffer == 0) { /* sparse file */
+			if(block->buffer == 0 && block->start == 0) {
+				/* sparse file */
 				hole += block->size;
 				free(block);
 				continue;
 			}
 
+			if(block->buffer == 0) {
+				/* uncompressed block */
+				if(local_fail == FALSE && copy_block(file_fd,
+						block->start, block->size,
+						hole, file->sparse) == FALSE) {
+					EXIT_UNSQUASH_IGNORE("writer: failed "
+						"to copy file %s\n",
+						file->pathname);
+					exit_code = local_fail = TRUE;
+				}
+
+				hole = 0;
+				free(block);
+				continue;
+			}
+
 			cache_block_wait(block->buffer);
 
 			if(block->buffer->error) {
@@ -2503,15 +3288,21 @@ void *writer(void *arg)
 			}
 		}
 
-		close_wake(file_fd);
+		/*
+		 * Set the attributes on the open file, rather than
+		 * looking up its pathname again
+		 */
 		if(local_fail == FALSE) {
-			res = set_attributes(file->pathname, file->mode,
-				file->uid, file->gid, file->time, file->xattr,
-				force);
+			res = set_attributes(file->pathname, file_fd, AT_FDCWD,
+				file->pathname, file->mode, file->uid,
+				file->gid, file->time, file->xattr, force);
 			if(res == FALSE)
 				exit_code = TRUE;
-		} else
+			close_wake(file_fd);
+		} else {
+			close_wake(file_fd);
 			unlink(file->pathname);
+		}
 		free(file->pathname);
 		free(file);
 
@@ -2724,7 +3515,10 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size, int cat_
 			processors = 1;
 		}
 #else
-		processors = sysconf(_SC_NPROCESSORS_ONLN);
+		if(worker_cpus)
+			processors = cpu_list_count(worker_cpus);
+		else
+			processors = available_processors();
 #endif
 	}
 
@@ -2849,14 +3643,40 @@ void initialise_threads(int fragment_buffer_size, int data_buffer_size, int cat_
 	else {
 		pthread_create(&thread[1], NULL, writer, NULL);
 		init_info();
+
+		creators = processors;
+		creator_thread = malloc(creators * sizeof(pthread_t));
+		to_creator = malloc(creators * sizeof(struct queue *));
+		if(creator_thread == NULL || to_creator == NULL)
+			MEM_ERROR();
+
+		from_creator = queue_init(creators);
+
+		for(i = 0; i < creators; i++) {
+			to_creator[i] = queue_init(CREATOR_QUEUE_SIZE);
+			if(pthread_create(&creator_thread[i], NULL, creator,
+						to_creator[i]) != 0)
+				EXIT_UNSQUASH("Failed to create thread\n");
+			if(!set_thread_cpus(creator_thread[i], io_cpus))
+				EXIT_UNSQUASH("Failed to set the processors of "
+					"the creator threads\n");
+		}
 	}
 
+	if(!set_thread_cpus(thread[0], io_cpus) ||
+				!set_thread_cpus(thread[1], io_cpus))
+		EXIT_UNSQUASH("Failed to set the processors of the reader and "
+			"writer threads\n");
+
 	pthread_mutex_init(&fragment_mutex, NULL);
 
 	for(i = 0; i < processors; i++) {
 		if(pthread_create(&inflator_thread[i], NULL, inflator, NULL) !=
 				 0)
 			EXIT_UNSQUASH("Failed to create thread\n");
+		if(!set_thread_cpus(inflator_thread[i], worker_cpus))
+			EXIT_UNSQUASH("Failed to set the processors of the "
+				"inflator threads\n");
 	}
 
 	if(pthread_sigmask(SIG_SETMASK, &old_mask, NULL) != 0)
@@ -3672,7 +4492,7 @@ int generate_pseudo(char *pseudo_file)
 {
 	int i, res;
 
-	writer_fd = open_wait(pseudo_file, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	writer_fd = open_wait(AT_FDCWD, pseudo_file, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 	if(writer_fd == -1)
 		EXIT_UNSQUASH("generate_pseudo: failed to create pseudo file %s,"
 			" because %s\n", pseudo_file, strerror(errno));
@@ -3740,6 +4560,13 @@ static void print_cat_options(FILE *stream, char *name)
 	fprintf(stream, "\t-p[rocessors] <number>\tuse <number> processors.  ");
 	fprintf(stream, "By default will use\n");
 	fprintf(stream, "\t\t\t\tnumber of processors available\n");
+	fprintf(stream, "\t-cpu[-set] <cpus>\trun the decompressor threads on ");
+	fprintf(stream, "<cpus>, a list\n\t\t\t\tsuch as 0-3,8, or node:<n> for ");
+	fprintf(stream, "the processors\n\t\t\t\tof NUMA node <n>.  By default ");
+	fprintf(stream, "the number of\n\t\t\t\tprocessors used is the number in ");
+	fprintf(stream, "<cpus>\n");
+	fprintf(stream, "\t-io[-cpu-set] <cpus>\trun the reader and writer threads ");
+	fprintf(stream, "on <cpus>\n");
 	fprintf(stream, "\t-o[ffset] <bytes>\tskip <bytes> at start of <dest>.  ");
 	fprintf(stream, "Optionally a\n\t\t\t\tsuffix of K, M or G can be given to ");
 	fprintf(stream, "specify\n\t\t\t\tKbytes, Mbytes or Gbytes respectively ");
@@ -3794,6 +4621,13 @@ static void print_options(FILE *stream, char *name)
 	fprintf(stream, "\t-p[rocessors] <number>\tuse <number> processors.  ");
 	fprintf(stream, "By default will use\n");
 	fprintf(stream, "\t\t\t\tnumber of processors available\n");
+	fprintf(stream, "\t-cpu[-set] <cpus>\trun the decompressor threads on ");
+	fprintf(stream, "<cpus>, a list\n\t\t\t\tsuch as 0-3,8, or node:<n> for ");
+	fprintf(stream, "the processors\n\t\t\t\tof NUMA node <n>.  By default ");
+	fprintf(stream, "the number of\n\t\t\t\tprocessors used is the number in ");
+	fprintf(stream, "<cpus>\n");
+	fprintf(stream, "\t-io[-cpu-set] <cpus>\trun the reader and writer threads ");
+	fprintf(stream, "on <cpus>\n");
 	fprintf(stream, "\t-i[nfo]\t\t\tprint files as they are unsquashed\n");
 	fprintf(stream, "\t-li[nfo]\t\tprint files as they are unsquashed with file\n");
 	fprintf(stream, "\t\t\t\tattributes (like ls -l output)\n");
@@ -3806,6 +4640,12 @@ static void print_options(FILE *stream, char *name)
 	fprintf(stream, "\t-llc\t\t\tlist filesystem concisely with file ");
 	fprintf(stream, "attributes,\n\t\t\t\tdisplaying only files and empty ");
 	fprintf(stream, "directories.\n\t\t\t\tDon't unsquash\n");
+	fprintf(stream, "\t-lj[son]\t\tlist filesystem as JSON lines, one ");
+	fprintf(stream, "object per\n\t\t\t\tfile with its attributes.  Don't ");
+	fprintf(stream, "unsquash\n");
+	fprintf(stream, "\t-ls0\t\t\tlist filesystem with filenames separated ");
+	fprintf(stream, "by\n\t\t\t\tNUL characters rather than newlines.  ");
+	fprintf(stream, "Don't\n\t\t\t\tunsquash\n");
 	fprintf(stream, "\t-o[ffset] <bytes>\tskip <bytes> at start of <dest>.  ");
 	fprintf(stream, "Optionally a\n\t\t\t\tsuffix of K, M or G can be given to ");
 	fprintf(stream, "specify\n\t\t\t\tKbytes, Mbytes or Gbytes respectively ");
@@ -3918,6 +4758,22 @@ int parse_cat_options(int argc, char *argv[])
 				strcmp(argv[i], "-v") == 0) {
 			print_cat_version();
 			version = TRUE;
+		} else if(strcmp(argv[i], "-cpu-set") == 0 ||
+				strcmp(argv[i], "-cpu") == 0 ||
+				strcmp(argv[i], "-io-cpu-set") == 0 ||
+				strcmp(argv[i], "-io") == 0) {
+			struct cpu_list *list;
+
+			if((++i == argc) || (list = parse_cpu_list(argv[i])) ==
+									NULL) {
+				ERROR("%s: %s missing or invalid processor "
+					"list\n", argv[0], argv[i - 1]);
+				exit(1);
+			}
+			if(strncmp(argv[i - 1], "-cpu", 4) == 0)
+				worker_cpus = list;
+			else
+				io_cpus = list;
 		} else if(strcmp(argv[i], "-processors") == 0 ||
 				strcmp(argv[i], "-p") == 0) {
 			if((++i == argc) ||
@@ -4101,6 +4957,22 @@ int parse_options(int argc, char *argv[])
 				exit(1);
 			}
 			dest = argv[i];
+		} else if(strcmp(argv[i], "-cpu-set") == 0 ||
+				strcmp(argv[i], "-cpu") == 0 ||
+				strcmp(argv[i], "-io-cpu-set") == 0 ||
+				strcmp(argv[i], "-io") == 0) {
+			struct cpu_list *list;
+
+			if((++i == argc) || (list = parse_cpu_list(argv[i])) ==
+									NULL) {
+				ERROR("%s: %s missing or invalid processor "
+					"list\n", argv[0], argv[i - 1]);
+				exit(1);
+			}
+			if(strncmp(argv[i - 1], "-cpu", 4) == 0)
+				worker_cpus = list;
+			else
+				io_cpus = list;
 		} else if(strcmp(argv[i], "-processors") == 0 ||
 				strcmp(argv[i], "-p") == 0) {
 			if((++i == argc) || 
@@ -4174,6 +5046,14 @@ int parse_options(int argc, char *argv[])
 			lsonly = TRUE;
 			short_ls = FALSE;
 			concise = TRUE;
+		} else if(strcmp(argv[i], "-ljson") == 0 ||
+				strcmp(argv[i], "-lj") == 0) {
+			lsonly = TRUE;
+			short_ls = FALSE;
+			json_ls = TRUE;
+		} else if(strcmp(argv[i], "-ls0") == 0) {
+			lsonly = TRUE;
+			nul_ls = TRUE;
 		} else if(strcmp(argv[i], "-linfo") == 0 ||
 				strcmp(argv[i], "-li") == 0) {
 			info = TRUE;
@@ -4217,9 +5097,16 @@ int parse_options(int argc, char *argv[])
 	if(lsonly || info)
 		progress = FALSE;
 
-	if(lsonly)
+	if(lsonly) {
 		quiet = TRUE;
 
+		/*
+		 * Listings can be millions of lines, so buffer them in one
+		 * large buffer, rather than flushing each line
+		 */
+		setvbuf(stdout, NULL, _IOFBF, LS_BUFFER_SIZE);
+	}
+
 	if(strict_errors && ignore_errors)
 		EXIT_UNSQUASH("Both -strict-errors and -ignore-errors should "
 								"not be set\n");
@@ -4257,7 +5144,7 @@ int parse_options(int argc, char *argv[])
 
 int main(int argc, char *argv[])
 {
-	int i, n;
+	int i, n, use_index;
 	long res;
 	int exit_code = 0;
 	char *command;
@@ -4322,6 +5209,8 @@ int main(int argc, char *argv[])
 		EXIT_UNSQUASH("Block size and block_log do not match."
 			"  File system is corrupt.\n");
 
+	check_memory_limit();
+
 	/*
 	 * convert from queue size in Mbytes to queue size in
 	 * blocks.
@@ -4354,7 +5243,18 @@ int main(int argc, char *argv[])
 
 	if(cat_files)
 		return cat_path(argc - i - 1, argv + i + 1);
-	else if(treat_as_excludes)
+
+	/*
+	 * If the filesystem has a path index, a plain listing of the
+	 * filesystem or of one path can be done from it, without walking
+	 * the directory table
+	 */
+	use_index = lsonly && !concise && max_depth == -1 && !use_regex &&
+		!treat_as_excludes && !follow_symlinks && extract == NULL &&
+		exclude == NULL && (argc - i - 1 == 0 || (argc - i - 1 == 1 &&
+		(no_wildcards || strpbrk(argv[i + 1], "*?[\\(") == NULL)));
+
+	if(treat_as_excludes)
 		for(n = i + 1; n < argc; n++)
 			exclude = add_exclude(exclude, argv[n], argv[n]);
 	else if(follow_symlinks)
@@ -4376,6 +5276,12 @@ int main(int argc, char *argv[])
 	if(pseudo_file)
 		return generate_pseudo(pseudo_name);
 
+	if(use_index && index_ls(dest, argc - i - 1 ? argv[i + 1] : NULL))
+		return exit_code;
+
+	if(extract == NULL)
+		prefetch_metadata();
+
 	if(!quiet || progress) {
 		res = pre_scan(dest, SQUASHFS_INODE_BLK(sBlk.s.root_inode),
 			SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), extracts,
@@ -4398,7 +5304,8 @@ int main(int argc, char *argv[])
 		enable_progress_bar();
 	}
 
-	res = dir_scan(dest, SQUASHFS_INODE_BLK(sBlk.s.root_inode),
+	res = dir_scan(dest, AT_FDCWD, dest,
+		SQUASHFS_INODE_BLK(sBlk.s.root_inode),
 		SQUASHFS_INODE_OFFSET(sBlk.s.root_inode), extracts, excludes, 1);
 	if(res == FALSE && set_exit_code)
 		exit_code = 2;
@@ -4408,6 +5315,10 @@ int main(int argc, char *argv[])
 		res = (long) queue_get(from_writer);
 		if(res == TRUE && set_exit_code)
 			exit_code = 2;
+
+		res = finish_creators();
+		if(res == TRUE && set_exit_code)
+			exit_code = 2;
 	}
 
 	disable_progress_bar();
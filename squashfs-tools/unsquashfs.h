@@ -182,12 +182,32 @@ struct dir {
 	struct dir_ent	*cur_entry;
 };
 
+/*
+ * A block queued to the writer thread.  If buffer is NULL, the block is
+ * either sparse (start is 0), or is stored uncompressed at start in the
+ * filesystem, and is copied directly from there to the output file
+ */
 struct file_entry {
 	int		offset;
 	int		size;
 	struct cache_entry *buffer;
+	long long	start;
+};
+
+
+/*
+ * Cached user or group name of a uid or gid, used when listing
+ */
+struct id_name {
+	unsigned int	id;
+	char		*name;
+	struct id_name	*next;
 };
 
+#define ID_NAME_HASH_SIZE 256
+
+/* size of the stdout buffer used when listing */
+#define LS_BUFFER_SIZE (1024 * 1024)
 
 struct squashfs_file {
 	int		fd;
@@ -202,6 +222,33 @@ struct squashfs_file {
 	unsigned int	xattr;
 };
 
+/*
+ * A directory being extracted.  It is held open while the directory scan,
+ * or the creator threads, are creating files in it, and closed when count
+ * drops to zero
+ */
+struct open_dir {
+	int		fd;
+	int		count;
+};
+
+/*
+ * A symlink, device, fifo or socket queued to a creator thread.  If link
+ * is set, pathname is a hard link to the previously queued link.  If dir
+ * is set, the file is created as name relative to it, rather than by
+ * pathname
+ */
+struct create_entry {
+	char		*pathname;
+	char		*name;
+	struct open_dir	*dir;
+	char		*link;
+	struct inode	inode;
+};
+
+/* size of each creator thread queue */
+#define CREATOR_QUEUE_SIZE 1024
+
 struct path_entry {
 	char		*name;
 	int		type;
@@ -251,6 +298,7 @@ struct directory_stack {
 extern struct super_block sBlk;
 extern int swap;
 extern struct hash_table_entry *directory_table_hash[65536];
+extern long long directory_table_end;
 extern pthread_mutex_t screen_mutex;
 extern int progress_enabled;
 extern int inode_number;
@@ -261,6 +309,9 @@ extern struct queue *to_reader, *to_inflate, *to_writer;
 extern struct cache *fragment_cache, *data_cache;
 extern struct compressor *comp;
 extern int use_localtime;
+extern squashfs_operations *s_ops;
+extern int short_ls;
+extern long long start_offset;
 
 /* unsquashfs.c */
 extern int read_inode_data(void *, long long *, unsigned int *, int);
@@ -271,6 +322,8 @@ extern void enable_progress_bar();
 extern void disable_progress_bar();
 extern void dump_queue(struct queue *);
 extern void dump_cache(struct cache *);
+extern void print_filename(char *, struct inode *);
+extern char *get_component(char *, char **);
 
 /* unsquash-1.c */
 int read_super_1(squashfs_operations **, void *);
@@ -297,4 +350,7 @@ extern int check_directory(struct dir *);
 
 /* unsquash-12.c */
 extern void sort_directory(struct dir *);
+
+/* unsquashfs_index.c */
+extern int index_ls(char *, char *);
 #endif
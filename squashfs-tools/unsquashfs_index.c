@@ -0,0 +1,316 @@
+/*
+ * Unsquash a squashfs filesystem.  This is a highly compressed read only
+ * filesystem.
+ *
+ * Copyright (c) 2021
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * unsquashfs_index.c
+ *
+ * List a filesystem using the path index written by Mksquashfs -path-index.
+ * The index holds every pathname in directory order, and so a path and
+ * its contents can be listed by reading a handful of metadata blocks,
+ * rather than walking the directory table from the root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_swap.h"
+#include "unsquashfs.h"
+#include "unsquashfs_error.h"
+#include "path_index.h"
+
+struct index_block {
+	long long	start;
+	char		*path;
+	int		len;
+};
+
+struct index_cursor {
+	int		block;
+	int		offset;
+	int		len;
+	unsigned int	start_block;
+	unsigned int	inode_offset;
+	int		type;
+	char		path[SQUASHFS_METADATA_SIZE];
+};
+
+static struct squashfs_path_index_header header;
+static struct index_block *index_blocks = NULL;
+static char *index_table = NULL;
+static char block[SQUASHFS_METADATA_SIZE];
+static int block_bytes, cur_block = -1;
+
+
+static int read_path_index()
+{
+	struct squashfs_path_index_header sheader;
+	long long size, start = sBlk.s.bytes_used;
+	unsigned int i;
+	int offset;
+
+	if(sBlk.s.s_major != 4)
+		return FALSE;
+
+	/*
+	 * Don't rely on read_fs_bytes() failing, images without an index
+	 * can end at bytes_used, and that would report an error
+	 */
+	size = lseek(fd, 0, SEEK_END);
+	if(size == -1 || size - start_offset < start + (long long)
+							sizeof(sheader))
+		return FALSE;
+
+	if(read_fs_bytes(fd, start, sizeof(sheader), &sheader) == FALSE)
+		return FALSE;
+
+	SQUASHFS_SWAP_PATH_INDEX_HEADER(&sheader, &header);
+
+	if(header.magic != SQUASHFS_PATH_INDEX_MAGIC ||
+			header.root_inode != sBlk.s.root_inode ||
+			header.blocks == 0 ||
+			header.index_start < start + (long long) sizeof(header) ||
+			header.index_start + header.index_bytes >
+							size - start_offset)
+		return FALSE;
+
+	index_table = malloc(header.index_bytes);
+	index_blocks = malloc(header.blocks * sizeof(struct index_block));
+	if(index_table == NULL || index_blocks == NULL)
+		MEM_ERROR();
+
+	if(read_fs_bytes(fd, header.index_start, header.index_bytes,
+						index_table) == FALSE)
+		goto failed;
+
+	for(i = 0, offset = 0; i < header.blocks; i++) {
+		struct squashfs_path_index index;
+
+		if(offset + sizeof(index) > header.index_bytes)
+			goto failed;
+
+		SQUASHFS_SWAP_PATH_INDEX(index_table + offset, &index);
+		offset += sizeof(index);
+
+		if(offset + index.size + 1 > header.index_bytes)
+			goto failed;
+
+		index_blocks[i].start = start + index.start_block;
+		index_blocks[i].path = index_table + offset;
+		index_blocks[i].len = index.size + 1;
+		offset += index.size + 1;
+	}
+
+	return TRUE;
+
+failed:
+	ERROR("Path index is corrupted, ignoring it\n");
+	free(index_table);
+	free(index_blocks);
+	return FALSE;
+}
+
+
+static void load_block(int n)
+{
+	if(n == cur_block)
+		return;
+
+	block_bytes = read_block(fd, index_blocks[n].start, NULL, 0, block);
+	if(block_bytes == 0)
+		EXIT_UNSQUASH("Failed to read path index block\n");
+
+	cur_block = n;
+}
+
+
+/*
+ * Move the cursor to the next entry in the index, returning FALSE at the
+ * end of the index
+ */
+static int next_entry(struct index_cursor *cursor)
+{
+	struct squashfs_path_index_entry entry;
+
+	if(cursor->offset == block_bytes) {
+		if(cursor->block + 1 == header.blocks)
+			return FALSE;
+
+		cursor->block ++;
+		cursor->offset = 0;
+	}
+
+	load_block(cursor->block);
+
+	if(cursor->offset + sizeof(entry) > block_bytes)
+		goto corrupted;
+
+	SQUASHFS_SWAP_PATH_INDEX_ENTRY(block + cursor->offset, &entry);
+
+	if((cursor->offset == 0 && entry.shared) ||
+			entry.shared > cursor->len ||
+			cursor->offset + sizeof(entry) + entry.size + 1 >
+							block_bytes)
+		goto corrupted;
+
+	memcpy(cursor->path + entry.shared, block + cursor->offset +
+		sizeof(entry), entry.size + 1);
+	cursor->len = entry.shared + entry.size + 1;
+	cursor->start_block = entry.start_block;
+	cursor->inode_offset = entry.offset;
+	cursor->type = entry.type;
+	cursor->offset += sizeof(entry) + entry.size + 1;
+
+	return TRUE;
+
+corrupted:
+	EXIT_UNSQUASH("Path index is corrupted\n");
+}
+
+
+/*
+ * Position the cursor at the first entry greater or equal to path, using
+ * the block index to find the one metadata block it can be in
+ */
+static int seek_entry(struct index_cursor *cursor, char *path, int len)
+{
+	int first = 0, last = header.blocks - 1;
+
+	while(first < last) {
+		int mid = (first + last + 1) / 2;
+
+		if(path_index_compare(index_blocks[mid].path,
+				index_blocks[mid].len, path, len) <= 0)
+			first = mid;
+		else
+			last = mid - 1;
+	}
+
+	cursor->block = first;
+	cursor->offset = 0;
+	cursor->len = 0;
+	load_block(first);
+
+	while(next_entry(cursor))
+		if(path_index_compare(cursor->path, cursor->len, path,
+								len) >= 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+
+static void print_entry(char *dest, struct index_cursor *cursor)
+{
+	struct inode *i = NULL;
+	char *pathname;
+	int res;
+
+	res = asprintf(&pathname, "%s%.*s", dest, cursor->len, cursor->path);
+	if(res == -1)
+		MEM_ERROR();
+
+	/* the inode is only needed for long listings */
+	if(!short_ls)
+		i = s_ops->read_inode(cursor->start_block,
+						cursor->inode_offset);
+
+	print_filename(pathname, i);
+
+	if(i && (i->type == SQUASHFS_SYMLINK_TYPE ||
+					i->type == SQUASHFS_LSYMLINK_TYPE))
+		free(i->symlink);
+	free(pathname);
+}
+
+
+/*
+ * List dest and target (or the whole filesystem if target is NULL) in the
+ * same way as dir_scan(), printing the directories leading to target,
+ * and target and its contents if it exists.  Returns FALSE if the
+ * filesystem doesn't have a path index, in which case nothing has been
+ * printed.
+ */
+int index_ls(char *dest, char *target)
+{
+	struct index_cursor cursor;
+	struct inode *i = NULL;
+	char *path = NULL, *name;
+	int len = 0, res;
+
+	if(read_path_index() == FALSE)
+		return FALSE;
+
+	if(!short_ls)
+		i = s_ops->read_inode(SQUASHFS_INODE_BLK(sBlk.s.root_inode),
+			SQUASHFS_INODE_OFFSET(sBlk.s.root_inode));
+	print_filename(dest, i);
+
+	if(target == NULL) {
+		cursor.block = 0;
+		cursor.offset = 0;
+		cursor.len = 0;
+		load_block(0);
+
+		while(next_entry(&cursor))
+			print_entry(dest, &cursor);
+
+		return TRUE;
+	}
+
+	while((target = get_component(target, &name)) != NULL) {
+		path = realloc(path, len + strlen(name) + 2);
+		if(path == NULL)
+			MEM_ERROR();
+
+		len += sprintf(path + len, "/%s", name);
+		free(name);
+
+		res = seek_entry(&cursor, path, len);
+		if(res == FALSE || cursor.len != len ||
+						memcmp(cursor.path, path, len))
+			/* doesn't exist */
+			break;
+
+		if(target[0] != '\0' && cursor.type != SQUASHFS_DIR_TYPE)
+			/* path continues past a non-directory */
+			break;
+
+		print_entry(dest, &cursor);
+
+		if(target[0] == '\0') {
+			/*
+			 * the contents of a directory immediately follow it
+			 * in the index, and are all prefixed by "path/"
+			 */
+			while(next_entry(&cursor) && cursor.len > len &&
+					cursor.path[len] == '/' &&
+					memcmp(cursor.path, path, len) == 0)
+				print_entry(dest, &cursor);
+			break;
+		}
+	}
+
+	free(path);
+	return TRUE;
+}
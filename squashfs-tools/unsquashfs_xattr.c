@@ -34,7 +34,10 @@ extern int user_xattrs;
 extern int ignore_errors;
 extern int strict_errors;
 
-int write_xattr(char *pathname, unsigned int xattr)
+/*
+ * Write the xattrs to the file open on fd, or pathname if fd is -1
+ */
+int write_xattr(char *pathname, int fd, unsigned int xattr)
 {
 	unsigned int count;
 	struct xattr_list *xattr_list;
@@ -48,7 +51,7 @@ int write_xattr(char *pathname, unsigned int xattr)
 			sBlk.s.xattr_id_table_start == SQUASHFS_INVALID_BLK)
 		return TRUE;
 
-	xattr_list = get_xattr(xattr, &count, &failed);
+	xattr_list = get_shared_xattr(xattr, &count, &failed);
 	if(xattr_list == NULL && failed == FALSE)
 		exit(1);
 
@@ -62,8 +65,17 @@ int write_xattr(char *pathname, unsigned int xattr)
 			continue;
 
 		if(root_process || prefix == SQUASHFS_XATTR_USER) {
-			int res = lsetxattr(pathname, xattr_list[i].full_name,
-				xattr_list[i].value, xattr_list[i].vsize, 0);
+			int res;
+
+			if(fd != -1)
+				res = fsetxattr(fd, xattr_list[i].full_name,
+					xattr_list[i].value, xattr_list[i].vsize,
+					0);
+			else
+				res = lsetxattr(pathname,
+					xattr_list[i].full_name,
+					xattr_list[i].value, xattr_list[i].vsize,
+					0);
 
 			if(res == -1) {
 				if(errno == ENOTSUP) {
@@ -141,7 +153,5 @@ int write_xattr(char *pathname, unsigned int xattr)
 		}
 	}
 
-	free_xattr(xattr_list, count);
-
 	return !failed;
 }
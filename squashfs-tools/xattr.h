@@ -37,6 +37,10 @@
  * until it meets the target */
 #define XATTR_TARGET_MAX	65536
 
+/* the number of uncompressed xattr metadata blocks cached when reading,
+ * must be a power of 2 */
+#define XATTR_BLOCK_CACHE_SIZE	64
+
 #define IS_XATTR(a)		(a != SQUASHFS_INVALID_XATTR)
 
 struct xattr_list {
@@ -72,9 +76,10 @@ extern long long write_xattrs();
 extern void save_xattrs();
 extern void restore_xattrs();
 extern unsigned int xattr_bytes, total_xattr_bytes;
-extern int write_xattr(char *, unsigned int);
+extern int write_xattr(char *, int, unsigned int);
 extern int read_xattrs_from_disk(int, struct squashfs_super_block *, int, long long *);
 extern struct xattr_list *get_xattr(int, unsigned int *, int *);
+extern struct xattr_list *get_shared_xattr(int, unsigned int *, int *);
 extern void free_xattr(struct xattr_list *, int);
 #else
 static inline int get_xattrs(int fd, struct squashfs_super_block *sBlk)
@@ -110,7 +115,7 @@ static inline void restore_xattrs()
 }
 
 
-static inline int write_xattr(char *pathname, unsigned int xattr)
+static inline int write_xattr(char *pathname, int fd, unsigned int xattr)
 {
 	return 1;
 }
@@ -131,6 +136,13 @@ static inline struct xattr_list *get_xattr(int i, unsigned int *count, int j)
 {
 	return NULL;
 }
+
+
+static inline struct xattr_list *get_shared_xattr(int i, unsigned int *count,
+	int j)
+{
+	return NULL;
+}
 #endif
 
 #ifdef XATTR_SUPPORT